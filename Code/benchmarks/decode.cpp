@@ -0,0 +1,86 @@
+// Compares table-driven decoder with linear scan over ISA table
+// on instructions found in the input binaries.
+#include <chrono>
+
+#include "infra/common.hpp"
+#include "infra/elf/elf.hpp"
+#include "memory/memory.hpp"
+#include "instruction/isa.hpp"
+
+static const std::vector<std::string> default_binaries = {
+    "inputs/8-queens-o0",
+    "inputs/8-queens-o2",
+    "inputs/arithm",
+    "inputs/branches",
+    "inputs/calc_test",
+    "inputs/jump",
+    "inputs/memory_ops"
+};
+
+static std::vector<uint32> collect_instructions(const std::string& filename) {
+    ElfLoader loader(filename);
+    Memory memory;
+    loader.load(memory);
+
+    std::vector<uint32> words;
+    for (Addr addr = 0; addr + 4 <= loader.get_data_end(); addr += 4) {
+        // untouched pages such as .bss hold only zeros
+        if (memory.get_host_page(addr) == nullptr) {
+            addr |= Memory::PAGE_SIZE - 4;
+            continue;
+        }
+        uint32 word = memory.read<4>(addr);
+        try {
+            find_entry_linear(word);
+            words.push_back(word);
+        }
+        catch (const std::invalid_argument&) { }
+    }
+    return words;
+}
+
+template<typename Decode>
+static double measure(const std::vector<uint32>& words, Decode decode) {
+    const size_t iterations = 20000000 / words.size() + 1;
+    uint32 checksum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        for (uint32 word : words)
+            checksum += decode(word).generated_entry.match;
+    auto end = std::chrono::steady_clock::now();
+
+    // keep compiler from throwing decoding away
+    if (checksum == NO_VAL32)
+        std::cout << "";
+
+    std::chrono::duration<double, std::nano> elapsed = end - start;
+    return elapsed.count() / (iterations * words.size());
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> binaries(argv + 1, argv + argc);
+    if (binaries.empty())
+        binaries = default_binaries;
+
+    std::cout << std::left << std::setw(24) << "binary"
+              << std::setw(8)  << "insns"
+              << std::setw(14) << "scan, ns"
+              << std::setw(14) << "table, ns"
+              << "speedup" << std::endl;
+
+    for (const auto& binary : binaries) {
+        const auto words = collect_instructions(binary);
+        if (words.empty())
+            continue;
+
+        double scan  = measure(words, find_entry_linear);
+        double table = measure(words, find_entry);
+        std::cout << std::left << std::setw(24) << binary
+                  << std::setw(8)  << words.size()
+                  << std::setw(14) << std::setprecision(3) << scan
+                  << std::setw(14) << std::setprecision(3) << table
+                  << std::setprecision(3) << scan / table << "x" << std::endl;
+    }
+    return 0;
+}
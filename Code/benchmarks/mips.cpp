@@ -0,0 +1,69 @@
+// Measures functional simulation speed of every engine
+// on the input binaries. Each engine runs until the program
+// ends or time limit is reached.
+#include <chrono>
+
+#include "funcsim/funcsim.hpp"
+
+static const std::vector<std::string> default_binaries = {
+    "inputs/8-queens-o0",
+    "inputs/8-queens-o2"
+};
+
+struct EngineSetup {
+    std::string name;
+    FuncSim::Engine engine;
+    bool fusion;
+};
+
+static const std::vector<EngineSetup> engines = {
+    { "step",     FuncSim::Engine::STEP,     true  },
+    { "unfused",  FuncSim::Engine::THREADED, false },
+    { "threaded", FuncSim::Engine::THREADED, true  },
+    { "jit",      FuncSim::Engine::JIT,      true  }
+};
+
+static const double TIME_LIMIT_SECONDS = 2.0;
+static const uint64 CHUNK = 10000;
+
+static double measure(const std::string& binary, const EngineSetup& setup) {
+    FuncSim simulator(binary);
+    simulator.set_engine(setup.engine);
+    simulator.set_fusion(setup.fusion);
+
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed(0);
+    try {
+        while (elapsed.count() < TIME_LIMIT_SECONDS) {
+            auto summary = simulator.run_batch(CHUNK);
+            elapsed = std::chrono::steady_clock::now() - start;
+            if (summary.reason == FuncSim::StopReason::EXIT)
+                break;
+        }
+    }
+    catch (const std::invalid_argument&) {
+        // binaries end with unknown instruction
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+
+    return simulator.get_executed() / elapsed.count() / 1e6;
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> binaries(argv + 1, argv + argc);
+    if (binaries.empty())
+        binaries = default_binaries;
+
+    std::cout << std::left << std::setw(24) << "binary";
+    for (const auto& engine : engines)
+        std::cout << std::setw(16) << engine.name + ", MIPS";
+    std::cout << std::endl;
+
+    for (const auto& binary : binaries) {
+        std::cout << std::left << std::setw(24) << binary;
+        for (const auto& engine : engines)
+            std::cout << std::setw(16) << std::setprecision(4) << measure(binary, engine);
+        std::cout << std::endl;
+    }
+    return 0;
+}
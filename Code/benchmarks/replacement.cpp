@@ -0,0 +1,95 @@
+// Compares replacement policies on synthetic line address traces
+// replayed through a tag array: time per access including lookup
+// and miss rate. "lru-list" is the std::list implementation
+// the flat policies replace.
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+
+#include "cache/replacement.hpp"
+
+static const std::vector<std::string> policies = {
+    "lru-list", "lru", "plru", "srrip", "brrip", "fifo", "random"
+};
+
+static const Size SETS = 64;
+static const size_t TRACE_LENGTH = 1 << 20;
+static const size_t ITERATIONS = 8;
+
+struct Trace {
+    std::string name;
+    std::vector<Addr> lines;
+};
+
+// loops fit the cache, streams and random accesses don't
+static std::vector<Trace> make_traces(Size ways) {
+    const Size capacity = SETS * ways;
+    std::vector<Trace> traces = { { "loop", {} }, { "hot+scan", {} }, { "random", {} } };
+    uint32 random = 1;
+    for (size_t i = 0; i < TRACE_LENGTH; ++i) {
+        random = random * 1664525u + 1013904223u;
+        traces[0].lines.push_back(i % (capacity * 3 / 4));
+        traces[1].lines.push_back((random >> 28) < 10 ? (random >> 8) % (capacity / 2) : capacity + i);
+        traces[2].lines.push_back((random >> 8) % (capacity * 2));
+    }
+    return traces;
+}
+
+struct Result {
+    double ns_per_access = 0;
+    double miss_rate = 0;
+};
+
+static Result measure(const std::string& name, Size ways, const Trace& trace) {
+    Result result;
+    uint64 misses = 0;
+    std::chrono::duration<double, std::nano> elapsed(0);
+    for (size_t iteration = 0; iteration < ITERATIONS; ++iteration) {
+        auto policy = ReplacementPolicy::create(name, ways, SETS);
+        std::vector<Addr> tags(SETS * ways, NO_VAL32);
+
+        auto start = std::chrono::steady_clock::now();
+        for (Addr line : trace.lines) {
+            Set set = line % SETS;
+            Addr* set_tags = &tags[set * ways];
+            Way way = std::find(set_tags, set_tags + ways, line) - set_tags;
+            if (way != ways) {
+                policy->touch(set, way);
+                continue;
+            }
+            misses++;
+            way = policy->get_victim(set);
+            set_tags[way] = line;
+            policy->insert(set, way);
+        }
+        elapsed += std::chrono::steady_clock::now() - start;
+    }
+    result.ns_per_access = elapsed.count() / (ITERATIONS * trace.lines.size());
+    result.miss_rate = static_cast<double>(misses) / (ITERATIONS * trace.lines.size());
+    return result;
+}
+
+int main() {
+    for (Size ways : { 4, 16 }) {
+        std::cout << SETS << " sets, " << ways << " ways" << std::endl;
+        const auto traces = make_traces(ways);
+        std::cout << std::left << std::setw(12) << "policy";
+        for (const auto& trace : traces)
+            std::cout << std::setw(24) << trace.name + ", ns / miss %";
+        std::cout << std::endl;
+
+        for (const auto& name : policies) {
+            std::cout << std::left << std::setw(12) << name;
+            for (const auto& trace : traces) {
+                auto result = measure(name, ways, trace);
+                std::ostringstream cell;
+                cell << std::fixed << std::setprecision(2) << result.ns_per_access
+                     << " / " << std::setprecision(1) << 100 * result.miss_rate;
+                std::cout << std::setw(24) << cell.str();
+            }
+            std::cout << std::endl;
+        }
+        std::cout << std::endl;
+    }
+    return 0;
+}
@@ -1,28 +1,13 @@
+#include "infra/trace/trace.hpp"
 #include "cache.hpp"
+#include <algorithm>
 #include <sstream>
+#include <tuple>
 
-LRUInfo::LRUInfo(Size num_ways, Size num_sets) :
-    lru(num_sets)
-{
-    std::list<Way> l(num_ways);
-    std::iota(l.begin(), l.end(), 0);
-    std::fill(lru.begin(), lru.end(), l);
-}
-
-void LRUInfo::touch(Set set, Way way) {
-    auto& list = this->lru[set];
-
-    for (auto it = list.begin(); it != list.end(); ++it) {
-        if (*it == way) {
-            list.splice(list.begin(), list, it);
-            return;
-        }
-    }
-}
-
-Way LRUInfo::get_LRU_way(Set set) {
-    auto& list = lru[set];
-    return list.back();
+std::pair<Size, Size> Cache::WriteBufferEntry::get_run(Size offset) const {
+    auto begin = std::find(this->is_written.begin() + offset, this->is_written.end(), true);
+    auto end = std::find(begin, this->is_written.end(), false);
+    return { begin - this->is_written.begin(), end - this->is_written.begin() };
 }
 
 uint32 Cache::Line::read_bytes(Addr offset, Size num_bytes) {
@@ -36,152 +21,577 @@ uint32 Cache::Line::read_bytes(Addr offset, Size num_bytes) {
     return value;
 }
 
-void Cache::Line::write_bytes(uint32 value, Addr offset, Size num_bytes) {
-    assert(offset + num_bytes <= this->data.size());
+Cache::Cache(MemoryPort& memory, const Config& config)
+    : memory(memory)
+    , config(config)
+    , num_sets(config.num_sets)
+    , line_size_in_bytes(config.line_size)
+    , array(config.num_ways, std::vector<Line>(config.num_sets, Line(config.line_size)))
+    , replacement(ReplacementPolicy::create(config.replacement, config.num_ways, config.num_sets))
+    , victims(config.victim_entries, Line(config.line_size))
+    , victim_replacement(config.victim_entries != 0 ? ReplacementPolicy::create("lru", config.victim_entries, 1) : nullptr)
+    , prefetcher(Prefetcher::create(config.prefetcher, { config.prefetch_degree, config.prefetch_distance, config.line_size }))
+{
+    if ((config.num_sets & (config.num_sets - 1)) != 0)
+        throw std::invalid_argument("Cache sets must be a power of 2");
+    if (config.line_size == 0 || config.queue_size == 0)
+        throw std::invalid_argument("Cache line and port queue must be positive");
+    memory.add_upper(this);
+}
 
-    for (uint i = 0; i < num_bytes; ++i) {
-        uint8 byte = static_cast<uint8>(value >> 8*i); 
-        this->data[offset + i] = byte;
-    }
+static Cache::Config make_config(Size num_ways,
+                                 Size num_sets,
+                                 Size line_size_in_bytes,
+                                 const std::string& replacement)
+{
+    Cache::Config config;
+    config.num_ways = num_ways;
+    config.num_sets = num_sets;
+    config.line_size = line_size_in_bytes;
+    config.replacement = replacement;
+    return config;
 }
 
-Cache::Cache(PerfMemory& memory,
+Cache::Cache(MemoryPort& memory,
+             Size num_ways,
+             Size num_sets,
+             Size line_size_in_bytes,
+             const std::string& replacement)
+    : Cache(memory, make_config(num_ways, num_sets, line_size_in_bytes, replacement))
+    { }
+
+Cache::Cache(MemoryPort& memory,
              Size num_ways,
              Size num_sets,
              Size line_size_in_bytes)
-    : memory(memory)
-    , num_sets(num_sets)
-    , line_size_in_bytes(line_size_in_bytes)
-    , array(num_ways, std::vector<Line>(num_sets, Line(line_size_in_bytes)))
-    , lru_info(num_ways, num_sets)
+    : Cache(memory, num_ways, num_sets, line_size_in_bytes, "lru")
     { }
 
-void Cache::process_hit(Way way) {
-    std::cout << "\thit" << std::endl;
-    auto& r = this->request;  // alias
+void Cache::add_upper(Cache* cache) {
+    // back-invalidation merges whole upper lines into line of this level
+    if (this->line_size_in_bytes % cache->line_size_in_bytes != 0)
+        throw std::invalid_argument("Upper cache line must divide line of lower level");
+    this->uppers.push_back(cache);
+}
+
+void Cache::process_hit(Request& r, Way way) {
+    TRACE(CACHE, BASIC, "\thit\n");
 
     Set set = this->get_set(r.addr);
     Line& line = this->array[way][set];
     assert(line.is_valid);
 
+    // line brought by miss of this request is already placed as new
+    if (!r.missed) {
+        this->stats.hits++;
+        this->stats.hits_under_miss += this->get_fills() != 0;
+        this->replacement->touch(set, way);
+        if (line.is_prefetched) {
+            this->stats.prefetch_hits++;
+            line.is_prefetched = false;
+        }
+    }
+
     Addr offset = this->get_line_offset(r.addr);
-    if (r.is_read) {
+    if (r.is_read && r.is_port) {
+        std::copy_n(line.data.begin() + offset, r.num_bytes, r.dst);
+    }
+    else if (r.is_read) {
         r.data = line.read_bytes(offset, r.num_bytes);
     }
     else {
-        line.write_bytes(r.data, offset, r.num_bytes);
-        line.is_dirty = true;
+        // write_back has stored these bytes, memory may be newer since then
+        if (r.flushed)
+            this->read_functional(r.bytes.data(), r.addr, r.num_bytes);
+        std::copy(r.bytes.begin(), r.bytes.end(), line.data.begin() + offset);
+        if (this->config.write_through) {
+            this->write_lower(r.addr, r.bytes.data(), r.num_bytes);
+            this->stats.written_through++;
+        }
+        else {
+            line.is_dirty = true;
+        }
     }
-    r.complete = true;
-    this->lru_info.touch(set, way);
+
+    // clean line moves to upper level, its way is refilled first
+    if (r.is_port && r.is_read && this->is_exclusive() && !line.is_dirty) {
+        line.is_valid = false;
+        this->replacement->invalidate(set, way);
+    }
+
+    this->serve(r);
 }
 
-void Cache::process_miss() {
-    std::cout << "\tmiss" << std::endl;
-    auto& r = this->request;  // alias
+void Cache::serve(Request& r) {
+    r.served = true;
+    r.cycles_left_to_complete = this->config.latency;
+    if (r.cycles_left_to_complete == 0)
+        this->complete(r);
+}
 
-    Set set = this->get_set(r.addr);
-    Way way = this->lru_info.get_LRU_way(set);
+void Cache::complete(Request& r) {
+    if (r.is_port) {
+        this->completed.push_back(r.id);
+        this->port_requests--;
+    }
+    else if (r.id == this->cpu_request) {
+        this->cpu_result = RequestResult{ true, r.data };
+    }
+
+    auto it = std::find_if(this->requests.begin(), this->requests.end(),
+                           [&r](const Request& q) { return &q == &r; });
+    this->requests.erase(it);
+}
+
+void Cache::post(const Request& r) {
+    // pipeline doesn't wait for write to be placed
+    if (!this->is_blocking() && !r.is_port && !r.is_read && r.id == this->cpu_request)
+        this->cpu_result = RequestResult{ true, NO_VAL32 };
+}
+
+bool Cache::back_invalidate(Addr line_addr, std::vector<uint8>& bytes) {
+    bool is_dirty = false;
+    // line of lower level may hold several lines of this one
+    for (Size offset = 0; offset < bytes.size(); offset += this->line_size_in_bytes) {
+        const auto [hit, way] = this->lookup(line_addr + offset);
+        if (hit)
+            this->replacement->invalidate(this->get_set(line_addr + offset), way);
+        Line* line_ptr = this->find_line(line_addr + offset);
+        if (line_ptr == nullptr)
+            continue;
+        Line& line = *line_ptr;  // alias
+        if (line.is_dirty) {
+            std::copy(line.data.begin(), line.data.end(), bytes.begin() + offset);
+            is_dirty = true;
+        }
+        line.is_valid = false;
+        line.is_dirty = false;
+        this->stats.back_invalidations++;
+    }
+    // upper levels hold newer data
+    for (Cache* upper : this->uppers)
+        is_dirty |= upper->back_invalidate(line_addr, bytes);
+    return is_dirty;
+}
+
+void Cache::evict(Set set, Way way) {
     Line& line = this->array[way][set];
+    if (!line.is_valid)
+        return;
+    if (this->victims.empty()) {
+        this->retire(line);
+        return;
+    }
+
+    // victim cache keeps the line and drops its oldest one instead
+    const Way entry = this->victim_replacement->get_victim(0);
+    this->retire(this->victims[entry]);
+    std::swap(line, this->victims[entry]);
+    this->victim_replacement->touch(0, entry);
+}
+
+void Cache::retire(Line& line) {
+    if (!line.is_valid)
+        return;
+
+    this->stats.useless_prefetches += line.is_prefetched;
+    line.is_prefetched = false;
 
-    if (line.is_valid && line.is_dirty) {
-        this->line_requests.push(
-            LineRequest(this->get_line_addr(line.addr), set, way, false)
-        );
-        std::cout << "\tcreated write line request" << std::endl;
+    if (this->config.inclusion == Inclusion::INCLUSIVE)
+        for (Cache* upper : this->uppers)
+            line.is_dirty |= upper->back_invalidate(line.addr, line.data);
+
+    if (line.is_dirty || this->memory.is_exclusive()) {
+        this->write_lower(line.addr, line.data.data(), line.data.size());
+        this->stats.writebacks++;
     }
+    line.is_valid = false;
+    line.is_dirty = false;
+}
 
-    this->line_requests.push(
-        LineRequest(this->get_line_addr(r.addr), set, way, true)
-    );
-    std::cout << "\tcreated read line request" << std::endl;
+bool Cache::is_way_busy(Set set, Way way) const {
+    return std::any_of(this->line_requests.begin(), this->line_requests.end(),
+                       [set, way](const LineRequest& lr) { return lr.is_read && lr.set == set && lr.way == way; });
 }
 
-void Cache::process_line_requests() {
-    if (this->line_requests.empty())
+Way Cache::get_victim(Set set) {
+    for (Way way = 0; way < this->array.size(); ++way)
+        if (!this->array[way][set].is_valid && !this->is_way_busy(set, way))
+            return way;
+    return this->replacement->get_victim(set);
+}
+
+std::pair<bool, Way> Cache::swap_victim(Addr addr) {
+    const auto tag = this->get_tag(addr);
+    for (Way entry = 0; entry < this->victims.size(); ++entry) {
+        Line& victim = this->victims[entry];
+        if (!victim.is_valid || this->get_tag(victim.addr) != tag)
+            continue;
+
+        Set set = this->get_set(addr);
+        Way way = this->get_victim(set);
+        if (this->is_way_busy(set, way))
+            return {false, NO_VAL32};
+        // line evicted from array takes the place of the found one
+        std::swap(this->array[way][set], victim);
+        this->replacement->insert(set, way);
+        if (victim.is_valid)
+            this->victim_replacement->touch(0, entry);
+        this->stats.victim_hits++;
+        return {true, way};
+    }
+    return {false, NO_VAL32};
+}
+
+void Cache::write_lower(Addr addr, const uint8* bytes, Size num_bytes) {
+    const Addr line_addr = this->get_line_addr(addr);
+    auto it = std::find_if(this->write_buffer.begin(), this->write_buffer.end(),
+                           [line_addr](const WriteBufferEntry& e) { return e.addr == line_addr; });
+    if (it != this->write_buffer.end()) {
+        // buffered bytes were stored by write_back, memory may be newer since then
+        if (it->flushed) {
+            this->memory.read_functional(it->data.data(), line_addr, it->data.size());
+            it->flushed = false;
+        }
+        this->stats.coalesced_writes++;
+    }
+    else if (this->write_buffer.size() < this->config.write_buffer) {
+        it = this->write_buffer.emplace(this->write_buffer.end(), line_addr, this->line_size_in_bytes);
+    }
+    else {
+        this->stats.write_buffer_full += this->config.write_buffer != 0;
+        LineRequest lr(addr, this->get_set(addr), NO_VAL32, false, num_bytes);
+        lr.data.assign(bytes, bytes + num_bytes);
+        this->line_requests.push_back(std::move(lr));
+        TRACE(CACHE, BASIC, "\tcreated write line request\n");
         return;
+    }
 
-    std::cout << "\tprocessing requests" << std::endl;
-    if (this->memory.is_busy())
+    const Addr offset = this->get_line_offset(addr);
+    std::copy_n(bytes, num_bytes, it->data.begin() + offset);
+    std::fill_n(it->is_written.begin() + offset, num_bytes, true);
+    this->stats.buffered_writes++;
+    TRACE(CACHE, BASIC, "\tbuffered write\n");
+}
+
+void Cache::flush_write_buffer(Addr line_addr) {
+    auto it = std::find_if(this->write_buffer.begin(), this->write_buffer.end(),
+                           [line_addr](const WriteBufferEntry& e) { return e.addr == line_addr; });
+    if (it == this->write_buffer.end())
         return;
 
-    auto& lr = this->line_requests.front();
-    Line& line = this->array[lr.way][lr.set];
+    for (auto [begin, end] = it->get_run(0); begin != it->data.size(); std::tie(begin, end) = it->get_run(end)) {
+        LineRequest lr(line_addr + begin, this->get_set(line_addr), NO_VAL32, false, end - begin);
+        lr.data.assign(it->data.begin() + begin, it->data.begin() + end);
+        lr.flushed = it->flushed;
+        this->line_requests.push_back(std::move(lr));
+    }
+    this->write_buffer.erase(it);
+}
+
+void Cache::drain_write_buffer() {
+    // line requests, fills above all, go to memory first
+    if (this->write_buffer.empty() || !this->memory.can_accept(false))
+        return;
+    for (const auto& lr : this->line_requests)
+        if (!is_sent(lr))
+            return;
 
+    auto& entry = this->write_buffer.front();  // alias
+    auto [begin, end] = entry.get_run(0);
+    // the latest line may be written further, so it waits to be coalesced
+    if (this->write_buffer.size() == 1 && !entry.is_draining && (begin != 0 || end != entry.data.size()))
+        return;
+    end = std::min<Size>(end, begin + this->memory.get_max_transfer());
+    // write_back has stored the bytes, memory may be newer since then
+    if (entry.flushed)
+        this->memory.read_functional(entry.data.data() + begin, entry.addr + begin, end - begin);
+    this->memory.send_write_request(entry.data.data() + begin, entry.addr + begin, end - begin);
+    std::fill(entry.is_written.begin() + begin, entry.is_written.begin() + end, false);
+    entry.is_draining = true;
+    this->stats.drained_writes++;
+    TRACE(CACHE, BASIC, "\tdrained write buffer\n");
+
+    if (entry.get_run(end).first == entry.data.size())
+        this->write_buffer.pop_front();
+}
 
-    if (lr.is_read) {
-        // read request is used to bring new line to cache from memory
-        assert(!(line.is_valid && line.is_dirty));
-        //assert(!(line.is_valid && line.addr != lr.addr));
+Cache::LineRequest* Cache::get_fill(Addr line_addr) {
+    for (auto& lr : this->line_requests)
+        if (lr.is_read && lr.addr == line_addr)
+            return &lr;
+    return nullptr;
+}
+
+Size Cache::get_fills() const {
+    return std::count_if(this->line_requests.begin(), this->line_requests.end(),
+                         [](const LineRequest& lr) { return lr.is_read; });
+}
+
+bool Cache::has_demand_line_requests() const {
+    return std::any_of(this->line_requests.begin(), this->line_requests.end(),
+                       [](const LineRequest& lr) { return !lr.is_prefetch; });
+}
+
+void Cache::process_miss(Request& r) {
+    TRACE(CACHE, BASIC, "\tmiss\n");
+    const Addr line_addr = this->get_line_addr(r.addr);
+    const bool first_miss = !r.missed;
+
+    // secondary miss waits for the line with the primary one, it isn't
+    // counted in misses to keep them independent of the number of MSHRs;
+    // demand miss caught up with prefetch is still a primary one
+    if (auto* fill = this->get_fill(line_addr)) {
+        TRACE(CACHE, BASIC, "\tmerged to line request\n");
+        if (fill->is_prefetch) {
+            this->stats.late_prefetches++;
+            this->stats.misses += first_miss;
+            fill->is_prefetch = false;
+        }
+        else {
+            this->stats.secondary_misses += first_miss;
+        }
+        r.missed = true;
+        this->post(r);
+        return;
     }
-    else {
-        // write request is used to store line in memory
-        assert(line.is_valid);
-        assert(line.is_dirty);
-        assert(line.addr == lr.addr);
+
+    // line is in victim cache, but its way is being filled
+    if (this->find_line(line_addr) != nullptr) {
+        this->stats.way_busy_cycles++;
+        return;
     }
 
-    if (lr.awaiting_memory_request) {
-        auto mr = this->memory.get_request_status();
-        assert (mr.is_ready);
-        
-        if (lr.is_read)
-            line.write_bytes(mr.data, lr.bytes_processed, 2);
+    // write miss passes to lower level without reading line,
+    // whole line written by upper level is placed anyway
+    const bool is_line_write = r.is_port && !r.is_read && r.num_bytes == this->line_size_in_bytes;
+    if (!r.is_read && !this->config.write_allocate && !is_line_write) {
+        this->stats.misses += first_miss;
+        if (r.flushed)
+            this->read_functional(r.bytes.data(), r.addr, r.num_bytes);
+        this->write_lower(r.addr, r.bytes.data(), r.num_bytes);
+        this->stats.written_around++;
+        this->serve(r);
+        return;
+    }
+
+    const Size fills = this->get_fills();
+    if (!this->is_blocking() && fills == this->config.mshrs) {
+        this->stats.mshr_full_cycles++;
+        return;
+    }
+
+    Set set = this->get_set(r.addr);
+    Way way = this->get_victim(set);
+    if (this->is_way_busy(set, way)) {
+        this->stats.way_busy_cycles++;
+        return;
+    }
+
+    r.missed = true;
+    this->stats.misses += first_miss;
+    this->stats.misses_under_miss += first_miss && fills != 0;
+    this->evict(set, way);
+    this->replacement->insert(set, way);
+
+    if (is_line_write) {
+        // whole line is written, there is nothing to read
+        Line& line = this->array[way][set];
+        std::copy(r.bytes.begin(), r.bytes.end(), line.data.begin());
+        line.addr = r.addr;
+        line.is_valid = true;
+        line.is_dirty = !this->config.write_through;
+        line.is_prefetched = false;
+        if (this->config.write_through) {
+            this->write_lower(r.addr, r.bytes.data(), r.num_bytes);
+            this->stats.written_through++;
+        }
+        return;
+    }
 
+    this->flush_write_buffer(line_addr);
+    this->line_requests.push_back(LineRequest(line_addr, set, way, true, this->line_size_in_bytes));
+    TRACE(CACHE, BASIC, "\tcreated read line request\n");
+    this->post(r);
+}
+
+void Cache::poll_line_requests() {
+    for (auto& lr : this->line_requests) {
+        if (!lr.awaiting_memory_request)
+            continue;
+        auto mr = this->memory.get_request_status(lr.memory_request);
+        if (!mr.is_ready)
+            continue;
+
+        // read data is in line when request is ready
         lr.awaiting_memory_request = false;
-        lr.bytes_processed += 2;
-        std::cout << "\tgot request from memory" << std::endl;
+        lr.bytes_processed += lr.bytes_requested;
+        TRACE(CACHE, BASIC, "\tgot request from memory\n");
     }
+}
+
+void Cache::process_line_requests() {
+    if (this->line_requests.empty())
+        return;
 
-    // all bytes are read/written, line request to memory is complete
-    if (lr.bytes_processed == line.data.size()) {
-        std::cout << "\tcompleted line request" << std::endl;
-        if (lr.is_read) {
-            line.is_valid = true;
-            line.addr = lr.addr;
-            line.is_dirty = false;
+    TRACE(CACHE, BASIC, "\tprocessing requests\n");
+    this->poll_line_requests();
+
+    // requests are sent to memory in order, so that
+    // a line is written back before it is read again
+    bool can_send = true;
+    for (auto it = this->line_requests.begin(); it != this->line_requests.end(); ) {
+        auto& lr = *it;  // alias
+
+        // all bytes are read/written, line request to memory is complete
+        if (lr.bytes_processed == lr.num_bytes) {
+            TRACE(CACHE, BASIC, "\tcompleted line request\n");
+            if (lr.is_read) {
+                Line& line = this->array[lr.way][lr.set];
+                line.is_valid = true;
+                line.addr = lr.addr;
+                line.is_dirty = false;
+                line.is_prefetched = lr.is_prefetch;
+            }
+            it = this->line_requests.erase(it);
+            continue;
         }
-        else {
-            line.is_valid = true;
-            line.is_dirty = false;
-            assert(line.addr == lr.addr);
+
+        if (!lr.awaiting_memory_request && can_send && this->memory.can_accept(lr.is_read)) {
+            // line is moved by bursts as large as memory allows
+            lr.bytes_requested = std::min<Size>(lr.num_bytes - lr.bytes_processed, this->memory.get_max_transfer());
+            const Addr addr = lr.addr + lr.bytes_processed;
+            if (lr.is_read) {
+                // line is refilled in place and holds no valid data until complete
+                Line& line = this->array[lr.way][lr.set];
+                line.is_valid = false;
+                lr.memory_request = this->memory.send_read_request(line.data.data() + lr.bytes_processed, addr, lr.bytes_requested);
+            }
+            else {
+                uint8* bytes = lr.data.data() + lr.bytes_processed;
+                // write_back has stored the line, memory may be newer since then
+                if (lr.flushed)
+                    this->memory.read_functional(bytes, addr, lr.bytes_requested);
+                lr.memory_request = this->memory.send_write_request(bytes, addr, lr.bytes_requested);
+            }
+            lr.awaiting_memory_request = true;
+            TRACE(CACHE, BASIC, "\tsent request to memory\n");
         }
 
-        // drop currrent line request
-        this->line_requests.pop();
-        // check other line requests
-        this->process_line_requests(); 
+        // blocking cache moves one demand line at a time
+        if ((this->is_blocking() && !lr.is_prefetch) || !is_sent(lr))
+            can_send = false;
+        ++it;
     }
-    else if (!lr.awaiting_memory_request) {
-        // send requests to memory
-        if (lr.is_read)
-            this->memory.send_read_request(lr.addr + lr.bytes_processed, 2);
-        else
-            this->memory.send_write_request(line.read_bytes(lr.bytes_processed, 2),
-                                            lr.addr + lr.bytes_processed, 2);
-        lr.awaiting_memory_request = true;
-        std::cout << "\tsent request to memory" << std::endl;
+}
+
+Cache::Request* Cache::get_next_request() {
+    // blocking cache serves the oldest request until it is complete
+    if (this->is_blocking()) {
+        if (this->requests.empty() || this->has_demand_line_requests())
+            return nullptr;
+        return &this->requests.front();
     }
+
+    for (auto& r : this->requests)
+        if (!r.served && !(r.missed && this->get_fill(this->get_line_addr(r.addr)) != nullptr))
+            return &r;
+    return nullptr;
 }
 
-void Cache::process() {
-    std::cout << "CACHE: " << std::endl;
-    auto& r = this->request;  // alias
+void Cache::train(Request& r, bool hit, Way way) {
+    if (this->prefetcher == nullptr || r.trained)
+        return;
+    r.trained = true;
+
+    // hit to prefetched line would have been a miss without prefetcher
+    bool miss = !hit || this->array[way][this->get_set(r.addr)].is_prefetched;
+    this->prefetch_lines.clear();
+    this->prefetcher->access(r.addr, r.pc, miss, this->prefetch_lines);
+    for (Addr line_addr : this->prefetch_lines) {
+        if (this->prefetch_queue.size() >= this->config.prefetch_queue)
+            break;
+        if (std::find(this->prefetch_queue.begin(), this->prefetch_queue.end(), line_addr) == this->prefetch_queue.end())
+            this->prefetch_queue.push_back(line_addr);
+    }
+}
 
-    assert(!r.complete);
+void Cache::issue_prefetch() {
+    // prefetches don't delay demand requests to memory
+    for (const auto& lr : this->line_requests)
+        if (!is_sent(lr))
+            return;
+    const bool mshr_free = this->is_blocking() ? this->line_requests.empty()
+                                               : this->get_fills() < this->config.mshrs;
+    if (!mshr_free || !this->memory.can_accept(true))
+        return;
 
-    if (this->line_requests.empty()) {
-        const auto [hit, way] = this->lookup(r.addr);
+    while (!this->prefetch_queue.empty()) {
+        const Addr line_addr = this->prefetch_queue.front();
+        if (this->find_line(line_addr) != nullptr || this->get_fill(line_addr) != nullptr) {
+            this->prefetch_queue.pop_front();
+            continue;
+        }
+
+        Set set = this->get_set(line_addr);
+        Way way = this->get_victim(set);
+        if (this->is_way_busy(set, way))
+            return;
+
+        this->prefetch_queue.pop_front();
+        this->evict(set, way);
+        this->replacement->insert(set, way);
+        this->flush_write_buffer(line_addr);
+        LineRequest lr(line_addr, set, way, true, this->line_size_in_bytes);
+        lr.is_prefetch = true;
+        this->line_requests.push_back(std::move(lr));
+        this->stats.prefetches++;
+        TRACE(CACHE, BASIC, "\tcreated prefetch line request\n");
+        return;
+    }
+}
+
+void Cache::process() {
+    TRACE(CACHE, BASIC, "CACHE:\n");
+
+    // requests wait for hit latency in parallel
+    bool served = false;
+    for (auto it = this->requests.begin(); it != this->requests.end(); ) {
+        if (it->served) {
+            served = true;
+            if (--it->cycles_left_to_complete == 0) {
+                this->complete(*it);
+                continue;
+            }
+        }
+        ++it;
+    }
+    // blocking cache looks nothing up meanwhile, but lines in flight
+    // (e.g. prefetched ones) still have to be polled
+    if (served && this->is_blocking()) {
+        this->process_line_requests();
+        return;
+    }
+
+    Request* r = this->get_next_request();
+    if (r == nullptr && this->prefetcher != nullptr)
+        this->issue_prefetch();
+    if (r != nullptr) {
+        auto found = this->lookup(r->addr);
+        if (!found.first && !this->victims.empty())
+            found = this->swap_victim(r->addr);
+        const auto [hit, way] = found;
+        this->train(*r, hit, way);
         if (hit)
-            this->process_hit(way);
+            this->process_hit(*r, way);
         else
-            this->process_miss();
+            this->process_miss(*r);
     }
     this->process_line_requests();
 }
 
 
-std::pair<bool, Way> Cache::lookup(Addr addr) {
+std::pair<bool, Way> Cache::lookup(Addr addr) const {
     const auto set = this->get_set(addr);
     const auto tag = this->get_tag(addr);
     for (uint way = 0; way < this->array.size(); ++way) {
@@ -193,69 +603,279 @@ std::pair<bool, Way> Cache::lookup(Addr addr) {
     return {false, NO_VAL32};
 }
 
-void Cache::send_read_request(Addr addr, Size num_bytes) {
-    auto& r = this->request;  // alias
+const Cache::Line* Cache::find_line(Addr addr) const {
+    const auto [hit, way] = this->lookup(addr);
+    if (hit)
+        return &this->array[way][this->get_set(addr)];
+    const auto tag = this->get_tag(addr);
+    for (const auto& line : this->victims)
+        if (line.is_valid && this->get_tag(line.addr) == tag)
+            return &line;
+    return nullptr;
+}
+
+bool Cache::is_busy() const {
+    if (this->cpu_result.is_ready)
+        return false;
+    if (this->is_blocking())
+        return true;
+    // request which is served or waits for its line can be abandoned
+    for (const auto& r : this->requests)
+        if (r.id == this->cpu_request)
+            return !r.served && !r.missed;
+    return false;
+}
 
-    if (!r.complete)
+void Cache::check_cpu_request(Addr addr, Size num_bytes) const {
+    if (this->is_busy())
         throw std::invalid_argument("Cannot send second request!");
+    if (num_bytes > 4 || num_bytes > this->line_size_in_bytes)
+        throw std::invalid_argument("Cache can't handle > 4 bytes or more than line per request");
     if ((addr % num_bytes) != 0) {
         std::stringstream stream;
         stream << "Unaligned cache access at addr " << std::hex << addr
                << " with num_bytes " << num_bytes;
         throw std::invalid_argument(stream.str());
     }
+}
 
-    r.is_read = true;
-    r.complete = false;
-    r.num_bytes = num_bytes;
-    r.addr = addr;
-    r.data = NO_VAL32;
+void Cache::send(Request&& r) {
+    // pipeline no longer waits for the previous read
+    if (!this->cpu_result.is_ready) {
+        auto it = std::find_if(this->requests.begin(), this->requests.end(),
+                               [this](const Request& q) { return q.id == this->cpu_request; });
+        if (it != this->requests.end())
+            this->requests.erase(it);
+    }
+
+    r.id = this->next_id++;
+    this->cpu_request = r.id;
+    this->cpu_result = RequestResult{ false, NO_VAL32 };
+    this->requests.push_back(std::move(r));
 
     this->process();
     this->process_called_this_cycle = true;
 }
 
-void Cache::send_write_request(uint32 value, Addr addr, Size num_bytes) {
-    auto& r = this->request;  // alias
+void Cache::send_read_request(Addr addr, Size num_bytes, Addr pc) {
+    this->check_cpu_request(addr, num_bytes);
+    if (this->profiler != nullptr)
+        this->profiler->record(this->read_access, addr);
 
-    if (!r.complete)
-        throw std::invalid_argument("Cannot send second request!");
-    if (num_bytes > 2)
-        throw std::invalid_argument("Cache can't handle > 2 bytes per request");
-    if ((addr % num_bytes) != 0) {
-        std::stringstream stream;
-        stream << "Unaligned cache access at addr " << std::hex << addr
-               << " with num_bytes " << num_bytes;
-        throw std::invalid_argument(stream.str());
-    }
+    Request r;
+    r.is_read = true;
+    r.addr = addr;
+    r.num_bytes = num_bytes;
+    r.pc = pc;
+    this->stats.reads++;
+    this->send(std::move(r));
+}
 
+void Cache::send_write_request(uint32 value, Addr addr, Size num_bytes, Addr pc) {
+    this->check_cpu_request(addr, num_bytes);
+    if (this->profiler != nullptr)
+        this->profiler->record(AccessProfiler::Access::STORE, addr);
+
+    Request r;
     r.is_read = false;
-    r.complete = false;
-    r.num_bytes = num_bytes;
     r.addr = addr;
-    r.data = value;
-
-    this->process();
-    this->process_called_this_cycle = true;
+    r.num_bytes = num_bytes;
+    r.pc = pc;
+    for (Size i = 0; i < num_bytes; ++i)
+        r.bytes.push_back(static_cast<uint8>(value >> 8*i));
+    this->stats.writes++;
+    this->send(std::move(r));
 }
 
 void Cache::clock() {
-    auto& r = this->request;  // alias
+    this->completed.clear();
+    this->stats.cycles++;
+    this->stats.mshr_occupancy += this->get_fills();
+    this->stats.write_buffer_occupancy += this->write_buffer.size();
 
-    if (r.complete)
+    if (this->requests.empty() && this->line_requests.empty() && this->prefetch_queue.empty() && this->write_buffer.empty())
         return;
 
-    if (!this->process_called_this_cycle)
+    // results of lower level are ready for one cycle only
+    if (this->process_called_this_cycle)
+        this->poll_line_requests();
+    else
         this->process();
+    this->drain_write_buffer();
 
     this->process_called_this_cycle = false;
 }
 
 Cache::RequestResult Cache::get_request_status() {
-    auto& r = this->request;  // alias
+    return this->cpu_result;
+}
 
-    if (r.complete)
-        return RequestResult {true, r.data};
-    else
-        return RequestResult {false, NO_VAL32};
+void Cache::check_port_request(Addr addr, size_t num_bytes) const {
+    if (this->port_requests >= this->config.queue_size)
+        throw std::invalid_argument("Cache port queue is full");
+    if (num_bytes == 0 || this->get_line_offset(addr) + num_bytes > this->line_size_in_bytes)
+        throw std::invalid_argument("Cache port request must be within a line");
+}
+
+MemoryPort::RequestId Cache::send_read_request(uint8* dst, Addr addr, size_t num_bytes) {
+    this->check_port_request(addr, num_bytes);
+    Request r;
+    r.id = this->next_id++;
+    r.is_port = true;
+    r.is_read = true;
+    r.addr = addr;
+    r.num_bytes = num_bytes;
+    r.dst = dst;
+    this->requests.push_back(std::move(r));
+    this->port_requests++;
+    this->stats.reads++;
+    return this->next_id - 1;
+}
+
+MemoryPort::RequestId Cache::send_write_request(const uint8* src, Addr addr, size_t num_bytes) {
+    this->check_port_request(addr, num_bytes);
+    Request r;
+    r.id = this->next_id++;
+    r.is_port = true;
+    r.is_read = false;
+    r.addr = addr;
+    r.num_bytes = num_bytes;
+    r.bytes.assign(src, src + num_bytes);
+    this->requests.push_back(std::move(r));
+    this->port_requests++;
+    this->stats.writes++;
+    return this->next_id - 1;
+}
+
+MemoryPort::RequestResult Cache::get_request_status(RequestId id) const {
+    bool is_ready = std::find(this->completed.begin(), this->completed.end(), id) != this->completed.end();
+    return RequestResult{ is_ready, NO_VAL32 };
+}
+
+void Cache::read_functional(uint8* dst, Addr addr, size_t num_bytes) const {
+    this->memory.read_functional(dst, addr, num_bytes);
+    // copies of this level are newer
+    const uint64 end = static_cast<uint64>(addr) + num_bytes;
+    for (uint64 a = addr; a < end; ) {
+        const Addr offset = this->get_line_offset(a);
+        const Size size = std::min<uint64>(this->line_size_in_bytes - offset, end - a);
+        if (const Line* line = this->find_line(a))
+            std::copy_n(line->data.begin() + offset, size, dst + (a - addr));
+        a += size;
+    }
+}
+
+void Cache::write_functional(const uint8* src, Addr addr, size_t num_bytes) {
+    // copies of this level stay dirty or clean
+    const uint64 end = static_cast<uint64>(addr) + num_bytes;
+    for (uint64 a = addr; a < end; ) {
+        const Addr offset = this->get_line_offset(a);
+        const Size size = std::min<uint64>(this->line_size_in_bytes - offset, end - a);
+        if (Line* line = this->find_line(a))
+            std::copy_n(src + (a - addr), size, line->data.begin() + offset);
+        a += size;
+    }
+    this->memory.write_functional(src, addr, num_bytes);
+}
+
+void Cache::write_back() {
+    auto store = [this](Line& line) {
+        if (!line.is_valid || !line.is_dirty)
+            return;
+        this->memory.write_functional(line.data.data(), line.addr, line.data.size());
+        line.is_dirty = false;
+    };
+    for (auto& way : this->array)
+        for (auto& line : way)
+            store(line);
+    for (auto& line : this->victims)
+        store(line);
+    // evicted lines and pending writes are newer than lines
+    for (auto& lr : this->line_requests) {
+        if (!lr.is_read) {
+            this->memory.write_functional(lr.data.data(), lr.addr, lr.data.size());
+            lr.flushed = true;
+        }
+    }
+    for (auto& entry : this->write_buffer) {
+        for (auto [begin, end] = entry.get_run(0); begin != entry.data.size(); std::tie(begin, end) = entry.get_run(end))
+            this->memory.write_functional(entry.data.data() + begin, entry.addr + begin, end - begin);
+        entry.flushed = true;
+    }
+    for (auto& r : this->requests) {
+        if (!r.is_read && !r.served) {
+            this->write_functional(r.bytes.data(), r.addr, r.num_bytes);
+            r.flushed = true;
+        }
+    }
+}
+
+void Cache::invalidate(Addr addr, Size num_bytes) {
+    if (num_bytes == 0)
+        return;
+
+    Addr first = this->get_line_addr(addr);
+    Addr last = this->get_line_addr(addr + num_bytes - 1);
+    for (Addr line_addr = first; line_addr <= last; line_addr += this->line_size_in_bytes) {
+        const auto [hit, way] = this->lookup(line_addr);
+        if (hit)
+            this->replacement->invalidate(this->get_set(line_addr), way);
+        Line* line = this->find_line(line_addr);
+        if (line == nullptr)
+            continue;
+        assert(!line->is_dirty);
+        line->is_valid = false;
+    }
+}
+
+void Cache::dump_statistics(std::ostream& out, const std::string& name, uint64 instructions) const {
+    const auto& s = this->stats;  // alias
+    const uint64 accesses = s.hits + s.misses + s.secondary_misses;
+    out << name << ": " << s.reads << " reads, " << s.writes << " writes, "
+        << s.hits << " hits, " << s.misses << " misses";
+    if (accesses != 0)
+        out << " (" << 100.0 * s.misses / accesses << "%)";
+    if (instructions != 0)
+        out << ", " << 1000.0 * s.misses / instructions << " MPKI";
+    out << ", " << s.writebacks << " writebacks";
+    if (s.written_through != 0)
+        out << ", " << s.written_through << " written through";
+    if (s.written_around != 0)
+        out << ", " << s.written_around << " written around";
+    if (s.back_invalidations != 0)
+        out << ", " << s.back_invalidations << " back-invalidated";
+    out << '\n';
+
+    if (this->prefetcher != nullptr) {
+        const uint64 covered = s.prefetch_hits + s.late_prefetches;
+        out << name << " prefetches: " << s.prefetches << " issued";
+        if (s.prefetches != 0)
+            out << ", " << 100.0 * covered / s.prefetches << "% accurate";
+        if (s.prefetch_hits + s.misses != 0)
+            out << ", " << 100.0 * covered / (s.prefetch_hits + s.misses) << "% of misses covered";
+        if (covered != 0)
+            out << ", " << 100.0 * s.prefetch_hits / covered << "% timely";
+        out << ", " << s.useless_prefetches << " evicted unused\n";
+    }
+
+    if (!this->victims.empty()) {
+        out << name << " victim cache: " << this->victims.size() << " lines, " << s.victim_hits << " hits saved";
+        if (s.victim_hits + s.misses != 0)
+            out << " (" << 100.0 * s.victim_hits / (s.victim_hits + s.misses) << "% of misses)";
+        out << '\n';
+    }
+
+    if (this->config.write_buffer != 0 && s.cycles != 0) {
+        out << name << " write buffer: " << static_cast<double>(s.write_buffer_occupancy) / s.cycles << " of "
+            << this->config.write_buffer << " lines busy, " << s.buffered_writes << " writes, "
+            << s.coalesced_writes << " coalesced, " << s.drained_writes << " sent to lower level, "
+            << s.write_buffer_full << " written around full buffer\n";
+    }
+
+    if (this->is_blocking() || s.cycles == 0)
+        return;
+    out << name << " MSHRs: " << static_cast<double>(s.mshr_occupancy) / s.cycles << " of "
+        << this->config.mshrs << " busy, " << s.secondary_misses << " merged misses, "
+        << s.hits_under_miss << " hits under miss, " << s.misses_under_miss << " misses under miss, "
+        << s.mshr_full_cycles << " cycles MSHRs full, " << s.way_busy_cycles << " cycles way busy\n";
 }
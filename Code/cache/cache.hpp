@@ -3,37 +3,87 @@
 
 #include "infra/common.hpp"
 #include "memory/memory.hpp"
+#include "port/port.hpp"
+#include "cache/replacement.hpp"
+#include "cache/prefetcher.hpp"
 
-#include <list>
-#include <queue>
-#include <numeric>
+#include <deque>
 
-using Set = uint32;
-using Way = uint32;
+// Cache serving requests either from pipeline (up to 4 bytes carried
+// in result) or from upper caches through memory port (bytes of a line),
+// misses are served by lower level: memory or next cache.
+// Without MSHRs the cache is blocking and serves one request at a time.
+// With them, misses wait for their lines while later requests hit
+// (hit-under-miss) or start other fills (miss-under-miss), misses to
+// a line being filled are merged. Pipeline writes are then posted:
+// complete once they have an MSHR. Prefetched lines are fetched
+// only when no demand request is looked up. Optional victim cache keeps
+// lines evicted from the array, a miss finding its line there swaps it
+// back instead of reading it from lower level. Bytes written to lower
+// level (evictions, write-through and not allocated writes) may wait in
+// write buffer, coalesced per line, and are drained when no line
+// request is waiting for memory. The latest line is kept until it is
+// written whole, or another line comes.
+class Cache : public MemoryPort {
+public:
+    using RequestResult = MemoryPort::RequestResult;
 
-class LRUInfo {
-private:
-    std::vector<  // set
-        std::list<  // list of ways ordered by usage time
-            Way  // way
-        >
-    > lru;
+    // contents of this level relative to upper ones
+    enum class Inclusion {
+        NINE,       // neither inclusive nor exclusive: lines are placed at every level
+        INCLUSIVE,  // evicted lines are invalidated in upper levels
+        EXCLUSIVE   // clean lines move to upper level, evicted ones come back
+    };
 
-public:
-    LRUInfo(Size ways, Size sets);
+    struct Config {
+        Size num_ways = 4;
+        Size num_sets = 64;
+        Size line_size = 16;
+        Cycles latency = 0;  // of hit, 0 completes in the same cycle
+        std::string replacement = "lru";
+        Inclusion inclusion = Inclusion::NINE;
+        Size queue_size = 4;  // requests of upper levels waiting for port
+        Size mshrs = 0;  // line fills in flight, 0 is blocking cache
+        std::string prefetcher = "none";
+        Size prefetch_degree = 1;
+        Size prefetch_distance = 1;
+        Size prefetch_queue = 8;  // lines waiting to be prefetched
+        Size victim_entries = 0;  // fully associative lines, 0 disables victim cache
+        bool write_through = false;  // written bytes go to lower level, lines stay clean
+        bool write_allocate = true;  // write miss reads line, otherwise bytes go to lower level
+        Size write_buffer = 0;  // lines coalesced in write buffer, 0 writes them at once
+    };
 
-    // make given way most recently used within set
-    void touch(Set set, Way way);
+    struct Stats {
+        uint64 reads = 0;
+        uint64 writes = 0;
+        uint64 hits = 0;
+        uint64 misses = 0;      // primary ones, secondary are counted apart
+        uint64 writebacks = 0;  // lines written to lower level
+        uint64 back_invalidations = 0;
 
-    // get least recently used way in a set
-    Way get_LRU_way(Set set);
-};
+        uint64 secondary_misses = 0;  // merged to fill in flight
+        uint64 hits_under_miss = 0;
+        uint64 misses_under_miss = 0;
+        uint64 mshr_full_cycles = 0;  // miss waits for free MSHR
+        uint64 way_busy_cycles = 0;   // miss waits for victim way being filled
+        uint64 mshr_occupancy = 0;    // summed over cycles
+        uint64 cycles = 0;
 
-class Cache {
-public:
-    struct RequestResult {
-        bool is_ready = false;
-        uint32 data = NO_VAL32;
+        uint64 prefetches = 0;          // lines fetched by prefetcher
+        uint64 prefetch_hits = 0;       // timely prefetches
+        uint64 late_prefetches = 0;     // demand miss merged to prefetch
+        uint64 useless_prefetches = 0;  // evicted before access
+
+        uint64 victim_hits = 0;  // misses saved by victim cache
+
+        uint64 written_through = 0;  // writes of write-through cache passed to lower level
+        uint64 written_around = 0;   // write misses not allocating line
+        uint64 buffered_writes = 0;
+        uint64 coalesced_writes = 0;  // to line already in write buffer
+        uint64 write_buffer_full = 0;  // lines written around full buffer
+        uint64 drained_writes = 0;  // requests from write buffer to lower level
+        uint64 write_buffer_occupancy = 0;  // summed over cycles
     };
 
 private:
@@ -43,20 +93,20 @@ private:
         Addr addr = NO_VAL32;
         bool is_valid = false;
         bool is_dirty = false;
-
+        bool is_prefetched = false;  // not accessed since prefetch
 
         Line(Size size_in_bytes) :
             data(size_in_bytes)
         { }
 
         uint32 read_bytes(Addr offset, Size num_bytes);
-        void write_bytes(uint32 value, Addr offset, Size num_bytes);
     };
 
     // underlying memory (or next-level cache)
-    PerfMemory& memory;
-    
+    MemoryPort& memory;
+
     // cache params
+    Config config;
     Size num_sets;
     Size line_size_in_bytes;
 
@@ -67,48 +117,148 @@ private:
         >
     > array;
 
-    // special object to evict LRU lines
-    LRUInfo lru_info;
+    // chooses lines to evict
+    std::unique_ptr<ReplacementPolicy> replacement;
+
+    // lines evicted from array, the oldest one leaves first
+    std::vector<Line> victims;
+    std::unique_ptr<ReplacementPolicy> victim_replacement;
+
+    // nullptr if disabled
+    std::unique_ptr<Prefetcher> prefetcher;
+    std::deque<Addr> prefetch_queue;
+    std::vector<Addr> prefetch_lines;  // from the latest access
+
+    // caches to back-invalidate if this one is inclusive
+    std::vector<Cache*> uppers;
 
     // read/write data request to caсhe
     struct Request {
-        bool complete = true;
+        RequestId id = 0;
+        bool is_port = false;  // from upper level, otherwise from pipeline
+        Addr pc = NO_VAL32;  // of instruction, trains prefetcher
+        bool trained = false;
         bool is_read = false;
         Addr addr = NO_VAL32;
-        uint32 data = NO_VAL32;
+        uint32 data = NO_VAL32;  // read by pipeline
         Size num_bytes = NO_VAL32;
+        uint8* dst = nullptr;  // read by upper level
+        std::vector<uint8> bytes;  // written
+        bool missed = false;  // waits for its line or has been placed by fill
+        bool served = false;  // data is accessed, waiting for hit latency
+        Cycles cycles_left_to_complete = 0;
+        bool flushed = false;  // bytes were written by functional write_back
     };
 
     // line read/write request to memory
     struct LineRequest {
         bool is_read = false;
         bool awaiting_memory_request = false;
+        MemoryPort::RequestId memory_request = 0;
         Addr addr = NO_VAL32;
         Set set = NO_VAL32;
         Way way = NO_VAL32;
         Size bytes_processed = 0;
+        Size bytes_requested = 0;  // by awaited memory request
+        Size num_bytes = 0;  // whole line, unless written through
+        // evicted line, so its way can be refilled at once
+        std::vector<uint8> data;
+        bool flushed = false;  // data was written by functional write_back
+        // line fill is an MSHR
+        bool is_prefetch = false;  // no demand request waits for it
 
-        LineRequest(Addr addr, Set set, Way way, bool is_read)
+        LineRequest(Addr addr, Set set, Way way, bool is_read, Size num_bytes)
             : is_read(is_read)
             , addr(addr)
             , set(set)
             , way(way)
+            , num_bytes(num_bytes)
+        { }
+    };
+
+    // bytes of a line waiting to be written to memory
+    struct WriteBufferEntry {
+        Addr addr = NO_VAL32;
+        std::vector<uint8> data;
+        std::vector<bool> is_written;  // per byte
+        bool flushed = false;  // data was written by functional write_back
+        bool is_draining = false;  // some bytes are sent
+
+        WriteBufferEntry(Addr addr, Size line_size)
+            : addr(addr)
+            , data(line_size)
+            , is_written(line_size, false)
         { }
+
+        // the first written bytes from given offset as [begin, end),
+        // begin is line size if there are none
+        std::pair<Size, Size> get_run(Size offset) const;
     };
 
-    // active request to cache (single-port cache)
-    Request request;
+    // requests in order of arrival, one is looked up per cycle
+    std::deque<Request> requests;
+    size_t port_requests = 0;
+    std::vector<RequestId> completed;  // port requests at the latest clock
+    RequestId next_id = 0;
+
+    // the latest request of pipeline, earlier ones are posted writes
+    // or reads abandoned by pipeline
+    RequestId cpu_request = NO_VAL32;
+    RequestResult cpu_result = { true, NO_VAL32 };
+
+    Stats stats;
+
+    // records requests to cache, reads are either loads or fetches
+    AccessProfiler* profiler = nullptr;
+    AccessProfiler::Access read_access = AccessProfiler::Access::LOAD;
 
     // queue of read/write line requests to memory
     // to be processed
-    std::queue<LineRequest> line_requests;
+    std::deque<LineRequest> line_requests;
 
-    // process active request to cache
+    // the oldest line is drained first
+    std::deque<WriteBufferEntry> write_buffer;
+
+    // process requests to cache
+    bool is_blocking() const { return config.mshrs == 0; }
+    Request* get_next_request();
+    LineRequest* get_fill(Addr line_addr);
+    Size get_fills() const;  // MSHRs in use
+    bool has_demand_line_requests() const;
+    static bool is_sent(const LineRequest& lr) {
+        return lr.bytes_processed + (lr.awaiting_memory_request ? lr.bytes_requested : 0) == lr.num_bytes;
+    }
     void process();
     bool process_called_this_cycle = false;
-    void process_miss();
-    void process_hit(Way way);
+    void process_miss(Request& r);
+    void process_hit(Request& r, Way way);
+    void serve(Request& r);  // data is accessed
+    void complete(Request& r);
+    void post(const Request& r);
+    void check_cpu_request(Addr addr, Size num_bytes) const;
+    void send(Request&& r);
+    void poll_line_requests();
     void process_line_requests();
+    void train(Request& r, bool hit, Way way);
+    void issue_prefetch();
+    bool is_way_busy(Set set, Way way) const;  // being filled
+    // invalid way which is not being filled, otherwise one chosen by policy
+    Way get_victim(Set set);
+    void evict(Set set, Way way);
+    // line leaves this level
+    void retire(Line& line);
+    // moves line from victim cache to array, if its way is not busy
+    std::pair<bool, Way> swap_victim(Addr addr);
+    // bytes within a line to lower level, through write buffer if it has room
+    void write_lower(Addr addr, const uint8* bytes, Size num_bytes);
+    // buffered bytes of line become line requests, so that they are
+    // written before line is read again
+    void flush_write_buffer(Addr line_addr);
+    void drain_write_buffer();
+    // drops line from this and upper levels, merging their dirty bytes
+    // to given line buffer; true if any of them was dirty
+    bool back_invalidate(Addr line_addr, std::vector<uint8>& bytes);
+    void check_port_request(Addr addr, size_t num_bytes) const;
 
     // helper functions
     uint get_set(Addr addr) const { return (addr / line_size_in_bytes) & (num_sets - 1); }
@@ -118,18 +268,68 @@ private:
     Addr get_line_addr(Addr addr) const { return addr - get_line_offset(addr); }
     Addr get_line_offset(Addr addr) const { return addr % this->line_size_in_bytes; }
     // check whether particular address is present in cache
-    std::pair<bool, Way> lookup(Addr addr);
+    std::pair<bool, Way> lookup(Addr addr) const;
+    // line of array or victim cache holding address, nullptr if none
+    const Line* find_line(Addr addr) const;
+    Line* find_line(Addr addr) {
+        return const_cast<Line*>(static_cast<const Cache*>(this)->find_line(addr));
+    }
 
 public:
-    Cache(PerfMemory& memory,
+    Cache(MemoryPort& memory, const Config& config);
+    Cache(MemoryPort& memory,
+          Size num_ways,
+          Size num_sets,
+          Size line_size_in_bytes,
+          const std::string& replacement);
+    Cache(MemoryPort& memory,
           Size num_ways,
           Size num_sets,
           Size line_size_in_bytes);
+    Cache(const Cache&) = delete;
+    Cache& operator=(const Cache&) = delete;
+
     void clock();
-    bool is_busy() { return !request.complete; }
-    void send_read_request(Addr addr, Size num_bytes);
-    void send_write_request(uint32 value, Addr addr, Size num_bytes);
+    // pipeline has to wait before sending next request
+    bool is_busy() const;
+    void send_read_request(Addr addr, Size num_bytes, Addr pc);
+    void send_write_request(uint32 value, Addr addr, Size num_bytes, Addr pc);
+    void send_read_request(Addr addr, Size num_bytes) {
+        send_read_request(addr, num_bytes, NO_VAL32);
+    }
+    void send_write_request(uint32 value, Addr addr, Size num_bytes) {
+        send_write_request(value, addr, num_bytes, NO_VAL32);
+    }
     RequestResult get_request_status();
+
+    // port for upper levels
+    bool can_accept(bool /* is_read */) const override { return port_requests < config.queue_size; }
+    Size get_max_transfer() const override { return line_size_in_bytes; }
+    RequestId send_read_request(uint8* dst, Addr addr, size_t num_bytes) override;
+    RequestId send_write_request(const uint8* src, Addr addr, size_t num_bytes) override;
+    RequestResult get_request_status(RequestId id) const override;
+    bool is_exclusive() const override { return config.inclusion == Inclusion::EXCLUSIVE; }
+    void add_upper(Cache* cache) override;
+    void read_functional(uint8* dst, Addr addr, size_t num_bytes) const override;
+    void write_functional(const uint8* src, Addr addr, size_t num_bytes) override;
+
+    // nullptr disables profiling
+    void set_profiler(AccessProfiler* value, AccessProfiler::Access reads) {
+        profiler = value;
+        read_access = reads;
+    }
+
+    const Stats& get_stats() const { return stats; }
+    // MPKI is counted per given number of instructions
+    void dump_statistics(std::ostream& out, const std::string& name, uint64 instructions) const;
+
+    // functional (zero-time) maintenance used to keep memory coherent
+    // with accesses made outside of pipeline, e.g. by system calls:
+    // store all dirty lines and pending writes to lower level,
+    // levels are written back from the lowest one
+    void write_back();
+    // drop lines holding given bytes
+    void invalidate(Addr addr, Size num_bytes);
 };
 
 #endif
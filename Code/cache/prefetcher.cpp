@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <cstdlib>
+
+#include "prefetcher.hpp"
+
+namespace {
+
+class NextLine : public Prefetcher {
+public:
+    explicit NextLine(const Config& config) : Prefetcher(config) { }
+
+    void access(Addr addr, Addr, bool miss, std::vector<Addr>& lines) override {
+        if (!miss)
+            return;
+        const Addr line = this->get_line(addr);
+        for (Size i = 0; i < this->config.degree; ++i)
+            lines.push_back((line + this->config.distance + i) * this->config.line_size);
+    }
+};
+
+// few streams of consecutive lines, a stream is confirmed
+// by the second miss next to its last line
+class Stream : public Prefetcher {
+private:
+    static const Size STREAMS = 4;
+
+    struct Entry {
+        Addr last = NO_VAL32;  // line
+        int32 direction = 0;
+        uint64 lru = 0;
+    };
+    std::vector<Entry> streams;
+    uint64 accesses = 0;
+
+public:
+    explicit Stream(const Config& config) : Prefetcher(config), streams(STREAMS) { }
+
+    void access(Addr addr, Addr, bool miss, std::vector<Addr>& lines) override {
+        if (!miss)
+            return;
+        const Addr line = this->get_line(addr);
+        this->accesses++;
+
+        for (auto& s : this->streams) {
+            const int32 direction = line == s.last + 1 ? 1 : line == s.last - 1 ? -1 : 0;
+            if (direction == 0 || (s.direction != 0 && direction != s.direction))
+                continue;
+            s.last = line;
+            s.direction = direction;
+            s.lru = this->accesses;
+            for (Size i = 0; i < this->config.degree; ++i)
+                lines.push_back((line + direction * static_cast<int32>(this->config.distance + i)) * this->config.line_size);
+            return;
+        }
+
+        auto& s = *std::min_element(this->streams.begin(), this->streams.end(),
+                                    [](const Entry& a, const Entry& b) { return a.lru < b.lru; });
+        s = Entry{ line, 0, this->accesses };
+    }
+};
+
+// reference prediction table indexed by PC, prefetches once
+// the same stride has been seen twice in a row
+class Stride : public Prefetcher {
+private:
+    static const Size ENTRIES = 64;
+    static constexpr uint8 MAX_CONFIDENCE = 3;
+    static constexpr uint8 THRESHOLD = 2;
+
+    struct Entry {
+        Addr pc = NO_VAL32;
+        Addr last = NO_VAL32;
+        int32 stride = 0;
+        uint8 confidence = 0;
+    };
+    std::vector<Entry> table;
+
+public:
+    explicit Stride(const Config& config) : Prefetcher(config), table(ENTRIES) { }
+
+    void access(Addr addr, Addr pc, bool, std::vector<Addr>& lines) override {
+        auto& e = this->table[(pc / 4) % ENTRIES];
+        if (e.pc != pc) {
+            e = Entry{ pc, addr, 0, 0 };
+            return;
+        }
+
+        const int32 stride = addr - e.last;
+        e.last = addr;
+        if (stride == e.stride && stride != 0) {
+            e.confidence = std::min<uint8>(e.confidence + 1, MAX_CONFIDENCE);
+        }
+        else {
+            e.stride = stride;
+            e.confidence = 0;
+        }
+        if (e.confidence < THRESHOLD)
+            return;
+
+        // strides shorter than line walk lines one by one
+        const int32 line_size = this->config.line_size;
+        int32 step = e.stride;
+        if (std::abs(step) < line_size)
+            step = step > 0 ? line_size : -line_size;
+        for (Size i = 0; i < this->config.degree; ++i) {
+            Addr target = addr + step * static_cast<int32>(this->config.distance + i);
+            lines.push_back(this->get_line(target) * this->config.line_size);
+        }
+    }
+};
+
+} // namespace
+
+std::unique_ptr<Prefetcher> Prefetcher::create(const std::string& name, const Config& config) {
+    if (config.degree == 0 || config.distance == 0 || config.line_size == 0)
+        throw std::invalid_argument("Prefetch degree, distance and line must be positive");
+    if (name == "none")
+        return nullptr;
+    if (name == "next-line")
+        return std::make_unique<NextLine>(config);
+    if (name == "stream")
+        return std::make_unique<Stream>(config);
+    if (name == "stride")
+        return std::make_unique<Stride>(config);
+    throw std::invalid_argument("Unknown prefetcher " + name);
+}
@@ -0,0 +1,41 @@
+#ifndef PREFETCHER_H
+#define PREFETCHER_H
+
+#include <memory>
+#include <vector>
+
+#include "infra/common.hpp"
+
+// Predicts lines to be accessed soon. Cache reports demand accesses
+// and fetches predicted lines when it has nothing else to do.
+// Prefetchers issue `degree` lines starting `distance` lines
+// (or strides) ahead of the access.
+//   none
+//   next-line - lines following every miss
+//   stream    - lines following ascending or descending sequences of misses
+//   stride    - per PC constant strides, for loads walking arrays
+class Prefetcher {
+public:
+    struct Config {
+        Size degree = 1;
+        Size distance = 1;
+        Size line_size = 16;
+    };
+
+protected:
+    const Config config;
+    Addr get_line(Addr addr) const { return addr / config.line_size; }
+
+public:
+    explicit Prefetcher(const Config& config) : config(config) { }
+    virtual ~Prefetcher() = default;
+
+    // miss is set for misses and first hits to prefetched lines,
+    // addresses of lines to prefetch are appended to lines
+    virtual void access(Addr addr, Addr pc, bool miss, std::vector<Addr>& lines) = 0;
+
+    // nullptr for "none"
+    static std::unique_ptr<Prefetcher> create(const std::string& name, const Config& config);
+};
+
+#endif
@@ -0,0 +1,214 @@
+#include <algorithm>
+#include <list>
+#include <numeric>
+#include <vector>
+
+#include "replacement.hpp"
+
+namespace {
+
+// per set list of ways from the most to the least recently used
+class ListLRU : public ReplacementPolicy {
+private:
+    std::vector<std::list<Way>> lru;
+
+public:
+    ListLRU(Size ways, Size sets) : lru(sets) {
+        std::list<Way> l(ways);
+        std::iota(l.begin(), l.end(), 0);
+        std::fill(lru.begin(), lru.end(), l);
+    }
+
+    void touch(Set set, Way way) override {
+        auto& list = this->lru[set];
+        for (auto it = list.begin(); it != list.end(); ++it) {
+            if (*it == way) {
+                list.splice(list.begin(), list, it);
+                return;
+            }
+        }
+    }
+
+    void invalidate(Set set, Way way) override {
+        auto& list = this->lru[set];
+        list.remove(way);
+        list.push_back(way);
+    }
+
+    Way get_victim(Set set) override { return this->lru[set].back(); }
+};
+
+// age of each way, 0 is the most recently used one
+class PackedLRU : public ReplacementPolicy {
+private:
+    Size ways;
+    std::vector<uint8> ages;
+
+public:
+    PackedLRU(Size ways, Size sets) : ways(ways), ages(ways * sets) {
+        if (ways > 256)
+            throw std::invalid_argument("LRU supports up to 256 ways");
+        for (Size i = 0; i < this->ages.size(); ++i)
+            this->ages[i] = i % ways;
+    }
+
+    void touch(Set set, Way way) override {
+        // byte stores may alias members, so loop bound is kept local
+        const Size ways = this->ways;
+        uint8* age = &this->ages[set * ways];
+        const uint8 old = age[way];
+        for (Way w = 0; w < ways; ++w)
+            age[w] += age[w] < old;
+        age[way] = 0;
+    }
+
+    void invalidate(Set set, Way way) override {
+        const Size ways = this->ways;
+        uint8* age = &this->ages[set * ways];
+        const uint8 old = age[way];
+        for (Way w = 0; w < ways; ++w)
+            age[w] -= age[w] > old;
+        age[way] = ways - 1;
+    }
+
+    Way get_victim(Set set) override {
+        const uint8* age = &this->ages[set * this->ways];
+        return std::find(age, age + this->ways, this->ways - 1) - age;
+    }
+};
+
+// binary tree over ways, node bit points to the half to evict from
+class TreePLRU : public ReplacementPolicy {
+private:
+    Size levels;
+    std::vector<uint64> trees;  // bit n is node n, root is 1
+
+public:
+    TreePLRU(Size ways, Size sets) : trees(sets) {
+        if (ways < 2 || ways > 64 || (ways & (ways - 1)) != 0)
+            throw std::invalid_argument("Tree PLRU needs power of 2 ways from 2 to 64");
+        this->levels = __builtin_ctz(ways);
+    }
+
+    void touch(Set set, Way way) override {
+        uint64& tree = this->trees[set];
+        Size node = 1;
+        for (Size level = this->levels; level > 0; --level) {
+            const uint64 bit = (way >> (level - 1)) & 1;
+            // point away from touched way
+            tree = (tree & ~(1ull << node)) | ((bit ^ 1) << node);
+            node = 2 * node + bit;
+        }
+    }
+
+    void invalidate(Set set, Way way) override {
+        uint64& tree = this->trees[set];
+        Size node = 1;
+        for (Size level = this->levels; level > 0; --level) {
+            const uint64 bit = (way >> (level - 1)) & 1;
+            // point to invalidated way
+            tree = (tree & ~(1ull << node)) | (bit << node);
+            node = 2 * node + bit;
+        }
+    }
+
+    Way get_victim(Set set) override {
+        const uint64 tree = this->trees[set];
+        Size node = 1;
+        for (Size level = 0; level < this->levels; ++level)
+            node = 2 * node + ((tree >> node) & 1);
+        return node - (1u << this->levels);
+    }
+};
+
+// re-reference prediction values, victim is predicted to be
+// re-referenced in the most distant future
+class RRIP : public ReplacementPolicy {
+private:
+    static constexpr uint8 MAX_RRPV = 3;
+    static constexpr uint32 BIMODAL_PERIOD = 32;
+
+    Size ways;
+    bool bimodal;
+    uint32 insertions = 0;
+    std::vector<uint8> rrpv;
+
+public:
+    RRIP(Size ways, Size sets, bool bimodal)
+        : ways(ways), bimodal(bimodal), rrpv(ways * sets, MAX_RRPV)
+    { }
+
+    void touch(Set set, Way way) override { this->rrpv[set * this->ways + way] = 0; }
+    void invalidate(Set set, Way way) override { this->rrpv[set * this->ways + way] = MAX_RRPV; }
+
+    void insert(Set set, Way way) override {
+        // BRRIP inserts at distant interval, only rarely at long one
+        bool distant = this->bimodal && ++this->insertions % BIMODAL_PERIOD != 0;
+        this->rrpv[set * this->ways + way] = distant ? MAX_RRPV : MAX_RRPV - 1;
+    }
+
+    Way get_victim(Set set) override {
+        const Size ways = this->ways;
+        uint8* rrpv = &this->rrpv[set * ways];
+        // age all ways at once until one becomes distant
+        const uint8 oldest = *std::max_element(rrpv, rrpv + ways);
+        if (oldest != MAX_RRPV)
+            for (Way w = 0; w < ways; ++w)
+                rrpv[w] += MAX_RRPV - oldest;
+        return std::find(rrpv, rrpv + ways, MAX_RRPV) - rrpv;
+    }
+};
+
+class FIFO : public ReplacementPolicy {
+private:
+    Size ways;
+    std::vector<Way> next;  // the oldest way of each set
+
+public:
+    FIFO(Size ways, Size sets) : ways(ways), next(sets, 0) { }
+
+    void touch(Set, Way) override { }
+    void insert(Set set, Way way) override { this->next[set] = (way + 1) % this->ways; }
+    void invalidate(Set set, Way way) override { this->next[set] = way; }
+    Way get_victim(Set set) override { return this->next[set]; }
+};
+
+class Random : public ReplacementPolicy {
+private:
+    Size ways;
+    uint32 state = 0x2545f491;
+
+public:
+    Random(Size ways, Size) : ways(ways) { }
+
+    void touch(Set, Way) override { }
+    Way get_victim(Set) override {
+        // xorshift32
+        this->state ^= this->state << 13;
+        this->state ^= this->state >> 17;
+        this->state ^= this->state << 5;
+        return this->state % this->ways;
+    }
+};
+
+} // namespace
+
+std::unique_ptr<ReplacementPolicy> ReplacementPolicy::create(const std::string& name, Size ways, Size sets) {
+    if (ways == 0 || sets == 0)
+        throw std::invalid_argument("Cache must have ways and sets");
+    if (name == "lru")
+        return std::make_unique<PackedLRU>(ways, sets);
+    if (name == "lru-list")
+        return std::make_unique<ListLRU>(ways, sets);
+    if (name == "plru")
+        return std::make_unique<TreePLRU>(ways, sets);
+    if (name == "srrip")
+        return std::make_unique<RRIP>(ways, sets, false);
+    if (name == "brrip")
+        return std::make_unique<RRIP>(ways, sets, true);
+    if (name == "fifo")
+        return std::make_unique<FIFO>(ways, sets);
+    if (name == "random")
+        return std::make_unique<Random>(ways, sets);
+    throw std::invalid_argument("Unknown replacement policy " + name);
+}
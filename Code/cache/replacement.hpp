@@ -0,0 +1,36 @@
+#ifndef REPLACEMENT_H
+#define REPLACEMENT_H
+
+#include <memory>
+
+#include "infra/common.hpp"
+
+using Set = uint32;
+using Way = uint32;
+
+// Chooses way to evict within a set. Policies keep their state
+// in flat per-set arrays, except "lru-list" which is the reference
+// std::list implementation kept for comparison.
+//   lru      - true LRU with packed ages
+//   plru     - tree pseudo-LRU, power of 2 ways
+//   srrip    - static re-reference interval prediction, 2-bit RRPV
+//   brrip    - bimodal RRIP, resists scans
+//   fifo     - round robin over ways
+//   random
+class ReplacementPolicy {
+public:
+    virtual ~ReplacementPolicy() = default;
+
+    // line in way was hit
+    virtual void touch(Set set, Way way) = 0;
+    // new line was placed to way
+    virtual void insert(Set set, Way way) { this->touch(set, way); }
+    // line in way was invalidated, way becomes the next victim
+    virtual void invalidate(Set, Way) { }
+    // way to place new line to
+    virtual Way get_victim(Set set) = 0;
+
+    static std::unique_ptr<ReplacementPolicy> create(const std::string& name, Size ways, Size sets);
+};
+
+#endif
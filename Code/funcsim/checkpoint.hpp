@@ -0,0 +1,22 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <array>
+
+#include "infra/common.hpp"
+#include "memory/memory.hpp"
+#include "rf/register.hpp"
+#include "syscall/syscall.hpp"
+
+// Architectural state of guest program. Memory pages are shared
+// with the simulator it was taken from and with every simulator
+// restored from it, so checkpoint is cheap to take and to copy.
+struct Checkpoint {
+    Memory::Snapshot memory;
+    std::array<uint32, Register::MAX_NUMBER> registers = {};
+    Addr PC = NO_VAL32;
+    uint64 executed = 0;
+    SyscallProxy::State syscalls;
+};
+
+#endif
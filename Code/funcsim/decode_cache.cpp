@@ -0,0 +1,28 @@
+#include "decode_cache.hpp"
+
+DecodeCache::DecodeCache(Size num_entries) :
+    entries(num_entries),
+    code_pages(1ull << (32 - PAGE_BITS), 0)
+{
+    if (num_entries == 0 || (num_entries & (num_entries - 1)) != 0)
+        throw std::invalid_argument("Decode cache size must be a power of 2");
+}
+
+const Instruction::Predecoded* DecodeCache::lookup(Addr PC) {
+    const auto& entry = this->entries[this->get_index(PC)];
+    if (entry.PC != PC) {
+        this->misses++;
+        return nullptr;
+    }
+    this->hits++;
+    return &entry.predecoded;
+}
+
+const Instruction::Predecoded& DecodeCache::fill(Addr PC, uint32 raw) {
+    auto& entry = this->entries[this->get_index(PC)];
+    // decode first: unknown instruction must not leave a stale entry
+    entry.predecoded = Instruction::predecode(raw);
+    entry.PC = PC;
+    this->code_pages[PC >> PAGE_BITS] = 1;
+    return entry.predecoded;
+}
@@ -0,0 +1,58 @@
+#ifndef DECODE_CACHE_H
+#define DECODE_CACHE_H
+
+#include "infra/common.hpp"
+#include "instruction/instruction.hpp"
+
+// Direct-mapped cache of predecoded instructions indexed by PC.
+// Allows functional simulator to skip fetch and decode
+// for instructions which were already executed.
+class DecodeCache {
+public:
+    static const Size PAGE_BITS = 12;
+
+private:
+    struct Entry {
+        Addr PC = NO_VAL32;  // never matches aligned PC
+        Instruction::Predecoded predecoded;
+    };
+
+    std::vector<Entry> entries;
+
+    // pages of guest memory which instructions were ever decoded from,
+    // byte per page to be cheaply checked from translated code
+    std::vector<uint8> code_pages;
+
+    uint64 hits = 0;
+    uint64 misses = 0;
+
+    size_t get_index(Addr PC) const { return (PC >> 2) & (entries.size() - 1); }
+
+public:
+    explicit DecodeCache(Size num_entries);
+
+    // returns nullptr if there is no entry for given PC
+    const Instruction::Predecoded* lookup(Addr PC);
+    const Instruction::Predecoded& fill(Addr PC, uint32 raw);
+
+    // false if bytes can't contain decoded instructions
+    bool may_hold_code(Addr addr, Size num_bytes) const {
+        return this->code_pages[addr >> PAGE_BITS]
+            || this->code_pages[(addr + num_bytes - 1) >> PAGE_BITS];
+    }
+    const uint8* get_code_pages() const { return code_pages.data(); }
+
+    // drop entries covering modified bytes
+    void invalidate(Addr addr, Size num_bytes) {
+        for (Addr word = addr & ~3u; word < addr + num_bytes; word += 4) {
+            auto& entry = this->entries[this->get_index(word)];
+            if (entry.PC == word)
+                entry.PC = NO_VAL32;
+        }
+    }
+
+    uint64 get_hits() const { return hits; }
+    uint64 get_misses() const { return misses; }
+};
+
+#endif
@@ -1,40 +1,227 @@
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+#include "infra/config/config.hpp"
+#include "infra/trace/trace.hpp"
 #include "funcsim.hpp"
 
+namespace config {
+    static         Value<uint64>      decode_cache_size = { "decode_cache_size", "predecoded instructions cache size", 4096 };
+    static         Value<std::string> engine            = { "engine", "functional engine: step, threaded or jit", "step" };
+    static         Value<uint64>      jit_threshold     = { "jit_threshold", "executions of block before its translation", 16 };
+    static         Value<uint64>      jit_buffer_size   = { "jit_buffer_size", "translated code buffer size in bytes", 16 << 20 };
+    static         Value<uint64>      fuse_ops          = { "fuse_ops", "fuse adjacent instructions in threaded engine", 1 };
+    static         Value<uint64>      reuse_distance    = { "reuse_distance", "collect LRU stack distances of instructions and data", 0 };
+    static         Value<uint64>      reuse_line        = { "reuse_line", "line size in bytes for reuse distances", 64 };
+}
+
 FuncSim::FuncSim(std::string executable_filename)
     : loader(executable_filename)
-    , memory(loader.load_data())
+    , memory()
     , rf()
+    , decode_cache(config::decode_cache_size)
+    , threaded(memory, rf, decode_cache)
+    , syscalls(memory, loader.get_data_end())
     , PC(loader.get_start_PC())
+    , profiler(AccessProfiler::create(Memory::PAGE_SIZE, 64))
 {
+    loader.load(memory);
+    memory.set_profiler(profiler.get());
+    threaded.set_profiler(profiler.get());
+    if (config::reuse_distance != 0)
+        enable_reuse_distance(config::reuse_line);
+
     // setup stack
     rf.set_stack_pointer(memory.get_stack_pointer());
     rf.validate(Register::Number::s0);
     rf.validate(Register::Number::ra);
+
+    this->threaded.set_fusion(config::fuse_ops != 0);
+
+    const std::string& engine_name = config::engine;
+    if (engine_name == "step")
+        set_engine(Engine::STEP);
+    else if (engine_name == "threaded")
+        set_engine(Engine::THREADED);
+    else if (engine_name == "jit")
+        set_engine(Engine::JIT);
+    else
+        throw std::invalid_argument("Unknown functional engine " + engine_name);
 }
 
-void FuncSim::step() {
-    // fetch
-    uint32 raw_bytes = this->memory.read_word(this->PC);
-    // decode
-    Instruction instr(raw_bytes, this->PC);
+void FuncSim::set_engine(Engine value) {
+    if (value == Engine::JIT && this->engine != Engine::JIT)
+        this->enable_jit(config::jit_threshold, config::jit_buffer_size);
+    else if (value != Engine::JIT && this->engine == Engine::JIT)
+        this->threaded.disable_jit();
+    this->engine = value;
+}
+
+void FuncSim::enable_jit(uint64 threshold, Size buffer_size) {
+    this->threaded.enable_jit(threshold, buffer_size);
+    this->engine = Engine::JIT;
+}
+
+void FuncSim::enable_reuse_distance(Size line_size) {
+    this->instruction_reuse = std::make_unique<ReuseDistance>(line_size);
+    this->data_reuse = std::make_unique<ReuseDistance>(line_size);
+    this->memory.set_reuse_distance(this->data_reuse.get());
+    this->threaded.set_reuse_distance(this->instruction_reuse.get());
+}
+
+const Instruction::Predecoded* FuncSim::fetch_decode() {
+    // both fetch and decode are skipped if PC is in decode cache
+    const auto* predecoded = this->decode_cache.lookup(this->PC);
+    if (predecoded != nullptr)
+        return predecoded;
+    try {
+        return &this->decode_cache.fill(this->PC, this->memory.read_word(this->PC));
+    }
+    catch (const std::invalid_argument&) {
+        this->syscalls.fault(this->PC);
+        return nullptr;
+    }
+}
+
+void FuncSim::execute(Instruction& instr) {
+    if (this->profiler != nullptr) {
+        this->profiler->record(AccessProfiler::Access::FETCH, this->PC);
+        this->profiler->tick();
+    }
+    if (this->instruction_reuse != nullptr)
+        this->instruction_reuse->access(this->PC);
     this->rf.read_sources(instr);
     // execute
     instr.execute();
     // memory
     this->memory.load_store(instr);
+    if (instr.is_store())
+        this->invalidate(instr.get_memory_addr(), instr.get_memory_size());
+    if (instr.is_syscall()) {
+        this->syscalls.execute(instr, this->rf);
+        if (this->syscalls.get_modified_size() != 0)
+            this->invalidate(this->syscalls.get_modified_addr(), this->syscalls.get_modified_size());
+    }
     // writeback
     this->rf.writeback(instr);
 
-    // let's start with this and improve when needed
-    std::cout << "0x" << std::hex << this->PC << ": "
-              << instr.get_disasm() << " "
-              << "(0x" << std::hex << raw_bytes << ")" << std::endl;
+    this->PC = instr.get_new_PC();
+    this->executed++;
+}
+
+void FuncSim::dump_statistics(std::ostream& out) const {
+    out << std::dec << "Instructions: " << this->executed << '\n'
+        << "Guest memory: " << this->memory.get_resident_size() / 1024 << " KiB\n";
+    if (this->engine == Engine::JIT) {
+        const auto& s = this->threaded.get_stats();  // alias
+        out << "JIT: " << s.translations << " blocks translated, " << s.buffer_resets << " code buffer resets\n";
+    }
+    if (this->instruction_reuse != nullptr)
+        this->instruction_reuse->dump(out, "Instruction");
+    if (this->data_reuse != nullptr)
+        this->data_reuse->dump(out, "Data");
+}
+
+void FuncSim::invalidate(Addr addr, Size num_bytes) {
+    this->decode_cache.invalidate(addr, num_bytes);
+    this->threaded.invalidate(addr, num_bytes);
+}
+
+Checkpoint FuncSim::checkpoint() const {
+    Checkpoint checkpoint;
+    checkpoint.memory = this->memory.snapshot();
+    std::copy_n(this->rf.get_values(), checkpoint.registers.size(), checkpoint.registers.begin());
+    checkpoint.PC = this->PC;
+    checkpoint.executed = this->executed;
+    checkpoint.syscalls = this->syscalls.get_state();
+    return checkpoint;
+}
+
+void FuncSim::restore(const Checkpoint& checkpoint) {
+    // decoded instructions are dropped only for pages which differ
+    for (Addr page : this->memory.diff(checkpoint.memory))
+        this->invalidate(page, Memory::PAGE_SIZE);
+    this->memory.restore(checkpoint.memory);
+    std::copy(checkpoint.registers.begin(), checkpoint.registers.end(), this->rf.get_values());
+    this->PC = checkpoint.PC;
+    this->executed = checkpoint.executed;
+    this->syscalls.set_state(checkpoint.syscalls);
+}
+
+void FuncSim::step() {
+    // fetch & decode
+    const auto* predecoded = this->fetch_decode();
+    if (predecoded == nullptr)
+        return;
+    uint32 raw_bytes = predecoded->raw;
+    Instruction instr(*predecoded, this->PC);
+    this->execute(instr);
+
+    TRACE(FUNCSIM, BASIC, "0x" << std::hex << instr.get_PC() << ": "
+                          << instr.get_disasm() << " "
+                          << "(0x" << std::hex << raw_bytes << ")\n");
     this->rf.dump();
+}
 
-    this->PC = instr.get_new_PC();
+void FuncSim::run(uint64 n) {
+    bool traced = TRACE_ENABLED(FUNCSIM, BASIC) || TRACE_ENABLED(RF, BASIC);
+    if (this->engine == Engine::STEP && traced) {
+        for (uint64 i = 0; i < n && !this->has_exited(); ++i)
+            this->step();
+        trace::flush();
+        return;
+    }
+    this->run_batch(n);
+}
+
+void FuncSim::run_until_exit() {
+    this->run(std::numeric_limits<uint64>::max());
+}
+
+FuncSim::BatchSummary FuncSim::run_batch(uint64 budget) {
+    return this->run_batch(budget, StopPredicate());
 }
 
-void FuncSim::run(uint32 n) {
-    for (uint32 i = 0; i < n; ++i)
-        this->step();
+FuncSim::BatchSummary FuncSim::run_batch(uint64 budget, const StopPredicate& stop) {
+    const auto start = std::chrono::steady_clock::now();
+    BatchSummary summary;
+
+    const uint64 until_count = stop.max_executed - std::min(this->executed, stop.max_executed);
+    if (until_count <= budget) {
+        budget = until_count;
+        summary.reason = StopReason::COUNT;
+    }
+    if (this->engine != Engine::STEP)
+        this->threaded.set_breakpoint(stop.breakpoint);
+
+    auto& retired = summary.retired;  // alias
+    while (retired < budget && !this->has_exited()) {
+        if (this->PC == stop.breakpoint && retired != 0)
+            break;
+        if (this->engine != Engine::STEP) {
+            // engine stops at instructions it can't handle,
+            // at blocks exceeding the budget and at breakpoint
+            uint64 count = this->threaded.run(this->PC, budget - retired);
+            retired += count;
+            this->executed += count;
+            if (count != 0)
+                continue;
+        }
+        const auto* predecoded = this->fetch_decode();
+        if (predecoded == nullptr)
+            break;
+        Instruction instr(*predecoded, this->PC);
+        this->execute(instr);
+        retired++;
+    }
+
+    if (this->has_exited())
+        summary.reason = StopReason::EXIT;
+    else if (this->PC == stop.breakpoint && retired != 0)
+        summary.reason = StopReason::BREAKPOINT;
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    summary.host_seconds = elapsed.count();
+    return summary;
 }
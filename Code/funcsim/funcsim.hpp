@@ -1,21 +1,100 @@
 #ifndef FUNCSIM_H
 #define FUNCSIM_H
 
+#include <limits>
+
 #include "infra/common.hpp"
 #include "rf/rf.hpp"
 #include "memory/memory.hpp"
 #include "infra/elf/elf.hpp"
+#include "funcsim/checkpoint.hpp"
+#include "funcsim/decode_cache.hpp"
+#include "funcsim/threaded.hpp"
+#include "syscall/syscall.hpp"
 
 class FuncSim {
+    public:
+        enum class Engine {
+            STEP,      // traces every instruction
+            THREADED,  // basic blocks with threaded dispatch
+            JIT        // threaded, hot blocks translated to host code
+        };
+
+        // reason of returning from run_batch
+        enum class StopReason {
+            BUDGET,      // budget of the batch is exhausted
+            BREAKPOINT,  // next instruction is at breakpoint
+            COUNT,       // total number of executed instructions reached limit
+            EXIT         // guest program has exited
+        };
+
+        // conditions ending batch before its budget is exhausted,
+        // guest exit always ends it
+        struct StopPredicate {
+            Addr breakpoint = NO_VAL32;  // stop before instruction at this PC
+            uint64 max_executed = std::numeric_limits<uint64>::max();  // limit of get_executed()
+        };
+
+        struct BatchSummary {
+            uint64 retired = 0;
+            double host_seconds = 0;
+            StopReason reason = StopReason::BUDGET;
+        };
+
     private:
         ElfLoader loader;
         FuncMemory memory;
         RF rf;
+        DecodeCache decode_cache;
+        ThreadedEngine threaded;
+        SyscallProxy syscalls;
         Addr PC = NO_VAL32;
+        Engine engine = Engine::STEP;
+        uint64 executed = 0;
+        std::unique_ptr<AccessProfiler> profiler;
+        std::unique_ptr<ReuseDistance> instruction_reuse;
+        std::unique_ptr<ReuseDistance> data_reuse;
+
+        // nullptr if word at PC can't be decoded, program is stopped then
+        const Instruction::Predecoded* fetch_decode();
+        void execute(Instruction& instr);
+        void invalidate(Addr addr, Size num_bytes);
     public:
         FuncSim(std::string executable_filename);
         void step();
-        void run(uint32 n);
+        void run(uint64 n);
+        void run_until_exit();
+
+        // executes at most budget instructions without tracing,
+        // instruction at breakpoint is executed if batch starts from it
+        BatchSummary run_batch(uint64 budget, const StopPredicate& stop);
+        BatchSummary run_batch(uint64 budget);
+
+        // O(1) in size of guest memory, restored simulator diverges
+        // from checkpoint without affecting it
+        Checkpoint checkpoint() const;
+        void restore(const Checkpoint& checkpoint);
+
+        // JIT doesn't record accesses, so it is rejected
+        // with profiler or reuse distances attached
+        void set_engine(Engine value);
+        // JIT engine translating blocks after threshold executions
+        // to code buffer of given size, set_engine takes them from config
+        void enable_jit(uint64 threshold, Size buffer_size);
+        void set_fusion(bool value) { threaded.set_fusion(value); }
+        void dump_statistics(std::ostream& out) const;
+
+        // collects LRU stack distances of instructions and data from now on
+        void enable_reuse_distance(Size line_size);
+        const ReuseDistance* get_instruction_reuse() const { return instruction_reuse.get(); }
+        const ReuseDistance* get_data_reuse() const { return data_reuse.get(); }
+        Addr get_PC() const { return PC; }
+        const RF& get_rf() const { return rf; }
+        const FuncMemory& get_memory() const { return memory; }
+        const ThreadedEngine::Stats& get_engine_stats() const { return threaded.get_stats(); }
+        uint64 get_executed() const { return executed; }
+        bool has_exited() const { return syscalls.has_exited(); }
+        int32 get_exit_code() const { return syscalls.get_exit_code(); }
 };
 
 #endif
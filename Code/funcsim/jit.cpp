@@ -0,0 +1,565 @@
+#include "jit.hpp"
+#include "memory/memory.hpp"
+#include "funcsim/decode_cache.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+
+namespace {
+
+enum Reg : uint8 {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8,  R9,  R10, R11, R12, R13, R14, R15
+};
+
+// condition codes
+enum Condition : uint8 {
+    CC_B  = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+    CC_L  = 0xc, CC_GE = 0xd
+};
+
+// registers used by translated code
+const Reg REGS    = RBX;  // guest registers
+const Reg MEMORY  = R12;  // TLB of guest memory
+const Reg CONTEXT = R13;  // Jit::Context
+const Reg PAGES   = R14;  // code pages map
+
+int32 reg_offset(uint8 reg) { return static_cast<int32>(reg * sizeof(uint32)); }
+
+// translated code looks up guest memory TLB
+const int32 TLB_ENTRY_BITS = 4;
+static_assert(sizeof(Memory::TlbEntry) == 1 << TLB_ENTRY_BITS, "TLB entry is indexed by shift");
+const int32 TLB_TAG_OFFSET = offsetof(Memory::TlbEntry, tag);
+const int32 TLB_HOST_OFFSET = offsetof(Memory::TlbEntry, host_offset);
+const int32 TLB_READ_OFFSET = offsetof(Memory::Tlb, read);
+const int32 TLB_WRITE_OFFSET = offsetof(Memory::Tlb, write);
+
+// page shifts are encoded as imm8 of 32-bit shifts
+static_assert(Memory::PAGE_BITS < 32, "guest page shift doesn't fit into shift encoding");
+static_assert(DecodeCache::PAGE_BITS < 32, "code page shift doesn't fit into shift encoding");
+
+// Minimal x86-64 assembler, only encodings needed by translator
+class Emitter {
+private:
+    uint8* begin;
+    uint8* current;
+    uint8* end;
+
+    void rex(bool w, uint8 reg, uint8 index, uint8 base) {
+        uint8 value = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+        if (value != 0x40)
+            byte(value);
+    }
+
+    // [base + disp32]
+    void memory(uint8 reg, uint8 base, int32 disp) {
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP)
+            byte(0x24);
+        dword(static_cast<uint32>(disp));
+    }
+
+    // [base + index], base can't be RBP or R13
+    void memory_index(uint8 reg, uint8 base, uint8 index) {
+        byte(((reg & 7) << 3) | 0x04);
+        byte(((index & 7) << 3) | (base & 7));
+    }
+
+    // [base + index + disp32]
+    void memory_index_disp(uint8 reg, uint8 base, uint8 index, int32 disp) {
+        byte(0x80 | ((reg & 7) << 3) | 0x04);
+        byte(((index & 7) << 3) | (base & 7));
+        dword(static_cast<uint32>(disp));
+    }
+
+    void registers(uint8 reg, uint8 rm) {
+        byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+public:
+    bool overflow = false;
+
+    Emitter(uint8* begin, uint8* end) : Emitter(begin, begin, end) { }
+    // fields before current position are patched too
+    Emitter(uint8* begin, uint8* current, uint8* end) : begin(begin), current(current), end(end) { }
+
+    uint8* position() const { return current; }
+
+    void byte(uint8 value) {
+        if (current < end)
+            *current++ = value;
+        else
+            overflow = true;
+    }
+
+    void dword(uint32 value) {
+        for (int i = 0; i < 4; ++i)
+            byte(static_cast<uint8>(value >> (8 * i)));
+    }
+
+    // mov dst, dword [base + disp]
+    void load32(Reg dst, Reg base, int32 disp) {
+        rex(false, dst, 0, base); byte(0x8b); memory(dst, base, disp);
+    }
+
+    // mov dst, qword [base + disp]
+    void load64(Reg dst, Reg base, int32 disp) {
+        rex(true, dst, 0, base); byte(0x8b); memory(dst, base, disp);
+    }
+
+    // mov dword [base + disp], src
+    void store32(Reg base, int32 disp, Reg src) {
+        rex(false, src, 0, base); byte(0x89); memory(src, base, disp);
+    }
+
+    // mov dword [base + disp], imm
+    void store32_imm(Reg base, int32 disp, uint32 imm) {
+        rex(false, 0, 0, base); byte(0xc7); memory(0, base, disp); dword(imm);
+    }
+
+    // add/or/and/sub/xor/cmp dst, dword [base + disp]
+    void alu_mem(uint8 opcode, Reg dst, Reg base, int32 disp) {
+        rex(false, dst, 0, base); byte(opcode); memory(dst, base, disp);
+    }
+
+    // 32-bit arithmetic with immediate, extension selects operation
+    void alu_imm(uint8 extension, Reg dst, int32 imm) {
+        rex(false, 0, 0, dst); byte(0x81); registers(extension, dst); dword(static_cast<uint32>(imm));
+    }
+
+    // 64-bit arithmetic on memory with immediate
+    void alu64_mem_imm(uint8 extension, Reg base, int32 disp, int32 imm) {
+        rex(true, 0, 0, base); byte(0x81); memory(extension, base, disp); dword(static_cast<uint32>(imm));
+    }
+
+    // mov dst, qword [base + index + disp]
+    void load64_indexed(Reg dst, Reg base, Reg index, int32 disp) {
+        rex(true, dst, index, base); byte(0x8b); memory_index_disp(dst, base, index, disp);
+    }
+
+    // cmp dst, dword [base + index + disp]
+    void cmp32_indexed(Reg dst, Reg base, Reg index, int32 disp) {
+        rex(false, dst, index, base); byte(0x3b); memory_index_disp(dst, base, index, disp);
+    }
+
+    // lea dst, [base + disp]
+    void lea64(Reg dst, Reg base, int32 disp) {
+        rex(true, dst, 0, base); byte(0x8d); memory(dst, base, disp);
+    }
+
+    void lea32(Reg dst, Reg base, int32 disp) {
+        rex(false, dst, 0, base); byte(0x8d); memory(dst, base, disp);
+    }
+
+    void mov32(Reg dst, Reg src) {
+        rex(false, src, 0, dst); byte(0x89); registers(src, dst);
+    }
+
+    void mov64(Reg dst, Reg src) {
+        rex(true, src, 0, dst); byte(0x89); registers(src, dst);
+    }
+
+    void mov_imm(Reg dst, uint32 imm) {
+        rex(false, 0, 0, dst); byte(0xb8 | (dst & 7)); dword(imm);
+    }
+
+    // shl/shr/sar by immediate or by CL
+    void shift_imm(uint8 extension, Reg dst, uint8 imm) {
+        rex(false, 0, 0, dst); byte(0xc1); registers(extension, dst); byte(imm);
+    }
+
+    void shift_cl(uint8 extension, Reg dst) {
+        rex(false, 0, 0, dst); byte(0xd3); registers(extension, dst);
+    }
+
+    // setcc al; movzx eax, al
+    void set_condition(Condition cc) {
+        byte(0x0f); byte(0x90 | cc); registers(0, RAX);
+        byte(0x0f); byte(0xb6); registers(RAX, RAX);
+    }
+
+    // load from [base + index] with zero or sign extension to 32 bits
+    void load_indexed(Size size, bool sign, Reg dst, Reg base, Reg index) {
+        rex(false, dst, index, base);
+        switch (size) {
+            case 1: byte(0x0f); byte(sign ? 0xbe : 0xb6); break;
+            case 2: byte(0x0f); byte(sign ? 0xbf : 0xb7); break;
+            default: byte(0x8b);
+        }
+        memory_index(dst, base, index);
+    }
+
+    void store_indexed(Size size, Reg src, Reg base, Reg index) {
+        if (size == 2)
+            byte(0x66);
+        rex(false, src, index, base);
+        byte(size == 1 ? 0x88 : 0x89);
+        memory_index(src, base, index);
+    }
+
+    // cmp byte [base + index], imm
+    void cmp8_indexed_imm(Reg base, Reg index, uint8 imm) {
+        rex(false, 0, index, base); byte(0x80); memory_index(7, base, index); byte(imm);
+    }
+
+    void push(Reg reg) { rex(false, 0, 0, reg); byte(0x50 | (reg & 7)); }
+    void pop(Reg reg)  { rex(false, 0, 0, reg); byte(0x58 | (reg & 7)); }
+    void ret() { byte(0xc3); }
+
+    void jmp_reg(Reg reg) {
+        rex(false, 0, 0, reg); byte(0xff); registers(4, reg);
+    }
+
+    // jumps with 32-bit displacement, return displacement field
+    uint8* jmp() {
+        byte(0xe9);
+        uint8* field = current;
+        dword(0);
+        return field;
+    }
+
+    uint8* jcc(Condition cc) {
+        byte(0x0f); byte(0x80 | cc);
+        uint8* field = current;
+        dword(0);
+        return field;
+    }
+
+    // fields outside of buffer, as of jumps emitted past its end, are left alone
+    void patch(uint8* field, const uint8* target) {
+        if (field < begin || field + 4 > end) {
+            overflow = true;
+            return;
+        }
+        int32 displacement = static_cast<int32>(target - (field + 4));
+        std::memcpy(field, &displacement, sizeof(displacement));
+    }
+};
+
+// arithmetic operations encodings
+const uint8 ADD_MEM = 0x03, OR_MEM = 0x0b, AND_MEM = 0x23, SUB_MEM = 0x2b, XOR_MEM = 0x33, CMP_MEM = 0x3b;
+const uint8 EXT_ADD = 0, EXT_OR = 1, EXT_AND = 4, EXT_SUB = 5, EXT_XOR = 6, EXT_CMP = 7;
+const uint8 EXT_SHL = 4, EXT_SHR = 5, EXT_SAR = 7;
+
+const int32 BUDGET_OFFSET      = offsetof(Jit::Context, budget);
+const int32 EXIT_OFFSET        = offsetof(Jit::Context, exit);
+const int32 STORE_ADDR_OFFSET  = offsetof(Jit::Context, store_addr);
+const int32 STORE_SIZE_OFFSET  = offsetof(Jit::Context, store_size);
+
+} // namespace
+
+bool Jit::is_supported() { return true; }
+
+Jit::Jit(Size buffer_size) :
+    buffer_size(buffer_size)
+{
+    void* memory = mmap(nullptr, buffer_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        throw std::invalid_argument("JIT: failed to allocate code buffer");
+    this->buffer = static_cast<uint8*>(memory);
+    this->emit_trampoline();
+    this->set_writable(false);
+}
+
+Jit::~Jit() {
+    munmap(this->buffer, this->buffer_size);
+}
+
+void Jit::emit_trampoline() {
+    Emitter e(this->buffer, this->buffer + this->buffer_size);
+
+    // Addr trampoline(Context* context, const uint8* code)
+    for (Reg reg : { RBX, RBP, R12, R13, R14, R15 })
+        e.push(reg);
+    e.mov64(CONTEXT, RDI);
+    e.load64(REGS,   CONTEXT, offsetof(Context, regs));
+    e.load64(MEMORY, CONTEXT, offsetof(Context, tlb));
+    e.load64(PAGES,  CONTEXT, offsetof(Context, code_pages));
+    e.jmp_reg(RSI);
+
+    // translated code jumps here with next PC in EAX
+    this->exit_stub = e.position();
+    for (Reg reg : { R15, R14, R13, R12, RBP, RBX })
+        e.pop(reg);
+    e.ret();
+
+    const uint8* entry = this->buffer;
+    std::memcpy(&this->trampoline, &entry, sizeof(entry));
+    this->trampoline_size = static_cast<Size>(e.position() - this->buffer);
+    this->used = this->trampoline_size;
+}
+
+void Jit::set_writable(bool value) {
+    const int protection = value ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC;
+    if (mprotect(this->buffer, this->buffer_size, protection) != 0)
+        throw std::runtime_error("JIT: failed to change code buffer protection");
+}
+
+void Jit::reset() {
+    this->used = this->trampoline_size;
+    this->full = false;
+    this->entries.clear();
+    this->pending_links.clear();
+}
+
+const uint8* Jit::translate(const std::vector<Op>& ops, Size length) {
+    // patches reach other blocks, so whole buffer is writable meanwhile
+    this->set_writable(true);
+    const uint8* entry = this->emit_block(ops, length);
+    this->set_writable(false);
+    return entry;
+}
+
+const uint8* Jit::emit_block(const std::vector<Op>& ops, Size length) {
+    uint8* entry = this->buffer + this->used;
+    Emitter e(this->buffer, entry, this->buffer + this->buffer_size);
+
+    // exits are emitted after block body
+    struct SideExit {
+        uint8* field;
+        Jit::Exit exit;
+        Addr PC;
+        Size refund;      // instructions of block which are not retired
+        Size store_size;  // for code writes
+    };
+    std::vector<SideExit> side_exits;
+    std::vector<std::pair<uint8*, Addr>> links;
+
+    // block doesn't fit into budget
+    e.alu64_mem_imm(EXT_CMP, CONTEXT, BUDGET_OFFSET, length);
+    side_exits.push_back({ e.jcc(CC_L), Exit::BUDGET, ops.front().PC, 0, 0 });
+    e.alu64_mem_imm(EXT_SUB, CONTEXT, BUDGET_OFFSET, length);
+
+    for (Size i = 0; i < ops.size(); ++i) {
+        const Op& op = ops[i];
+        const int32 rd  = reg_offset(op.rd);
+        const int32 rs1 = reg_offset(op.rs1);
+        const int32 rs2 = reg_offset(op.rs2);
+
+        // zero register is never written
+        auto writeback = [&]() {
+            if (op.rd != 0)
+                e.store32(REGS, rd, RAX);
+        };
+
+        auto arithm = [&](uint8 opcode) {
+            e.load32(RAX, REGS, rs1);
+            e.alu_mem(opcode, RAX, REGS, rs2);
+            writeback();
+        };
+        auto arithm_imm = [&](uint8 extension) {
+            e.load32(RAX, REGS, rs1);
+            e.alu_imm(extension, RAX, op.imm);
+            writeback();
+        };
+        auto shift = [&](uint8 extension) {
+            e.load32(RCX, REGS, rs2);
+            e.load32(RAX, REGS, rs1);
+            e.shift_cl(extension, RAX);
+            writeback();
+        };
+        auto shift_imm = [&](uint8 extension) {
+            e.load32(RAX, REGS, rs1);
+            e.shift_imm(extension, RAX, static_cast<uint8>(op.imm & 0x1f));
+            writeback();
+        };
+        auto compare = [&](Condition cc) {
+            e.load32(RAX, REGS, rs1);
+            e.alu_mem(CMP_MEM, RAX, REGS, rs2);
+            e.set_condition(cc);
+            writeback();
+        };
+        auto compare_imm = [&](Condition cc) {
+            e.load32(RAX, REGS, rs1);
+            e.alu_imm(EXT_CMP, RAX, op.imm);
+            e.set_condition(cc);
+            writeback();
+        };
+        // leaves guest address in RAX and TLB host offset in RDX,
+        // TLB misses and misaligned accesses are interpreted
+        auto address = [&](Size size, int32 tlb_offset) {
+            e.load32(RAX, REGS, rs1);
+            if (op.imm != 0)
+                e.alu_imm(EXT_ADD, RAX, op.imm);
+            e.mov32(RCX, RAX);
+            e.shift_imm(EXT_SHR, RCX, Memory::PAGE_BITS);
+            e.alu_imm(EXT_AND, RCX, Memory::TLB_SIZE - 1);
+            e.shift_imm(EXT_SHL, RCX, TLB_ENTRY_BITS);
+            e.mov32(RDX, RAX);
+            e.alu_imm(EXT_AND, RDX, static_cast<int32>(~(Memory::PAGE_SIZE - 1) | (size - 1)));
+            e.cmp32_indexed(RDX, MEMORY, RCX, tlb_offset + TLB_TAG_OFFSET);
+            side_exits.push_back({ e.jcc(CC_NE), Exit::SIDE, op.PC, length - i, 0 });
+            e.load64_indexed(RDX, MEMORY, RCX, tlb_offset + TLB_HOST_OFFSET);
+        };
+        auto load = [&](Size size, bool sign) {
+            address(size, TLB_READ_OFFSET);
+            e.load_indexed(size, sign, RCX, RDX, RAX);
+            if (op.rd != 0)
+                e.store32(REGS, rd, RCX);
+        };
+        auto store = [&](Size size) {
+            address(size, TLB_WRITE_OFFSET);
+            e.load32(R8, REGS, rs2);
+            e.store_indexed(size, R8, RDX, RAX);
+            // both first and last bytes might hit code page
+            for (Size offset : { Size(0), size - 1 }) {
+                e.lea32(RDX, RAX, offset);
+                e.shift_imm(EXT_SHR, RDX, DecodeCache::PAGE_BITS);
+                e.cmp8_indexed_imm(PAGES, RDX, 0);
+                side_exits.push_back({ e.jcc(CC_NE), Exit::CODE_WRITE, op.PC + 4, length - i - 1, size });
+                if (size == 1)
+                    break;
+            }
+        };
+        auto branch = [&](Condition cc) {
+            e.load32(RAX, REGS, rs1);
+            e.alu_mem(CMP_MEM, RAX, REGS, rs2);
+            links.emplace_back(e.jcc(cc), op.PC + op.imm);
+            links.emplace_back(e.jmp(), op.PC + 4);
+        };
+
+        switch (op.kind) {
+            case KIND_lui:
+                if (op.rd != 0)
+                    e.store32_imm(REGS, rd, op.imm);
+                break;
+            case KIND_auipc:
+                if (op.rd != 0)
+                    e.store32_imm(REGS, rd, op.PC + op.imm);
+                break;
+
+            case KIND_jal:
+                if (op.rd != 0)
+                    e.store32_imm(REGS, rd, op.PC + 4);
+                links.emplace_back(e.jmp(), op.PC + op.imm);
+                break;
+            case KIND_jalr:
+                e.load32(RAX, REGS, rs1);
+                e.alu_imm(EXT_ADD, RAX, op.imm);
+                e.alu_imm(EXT_AND, RAX, ~1);
+                if (op.rd != 0)
+                    e.store32_imm(REGS, rd, op.PC + 4);
+                e.patch(e.jmp(), this->exit_stub);
+                break;
+
+            case KIND_beq:  branch(CC_E);  break;
+            case KIND_bne:  branch(CC_NE); break;
+            case KIND_blt:  branch(CC_L);  break;
+            case KIND_bge:  branch(CC_GE); break;
+            case KIND_bltu: branch(CC_B);  break;
+            case KIND_bgeu: branch(CC_AE); break;
+
+            case KIND_lb:  load(1, true);  break;
+            case KIND_lh:  load(2, true);  break;
+            case KIND_lw:  load(4, false); break;
+            case KIND_lbu: load(1, false); break;
+            case KIND_lhu: load(2, false); break;
+
+            case KIND_sb: store(1); break;
+            case KIND_sh: store(2); break;
+            case KIND_sw: store(4); break;
+
+            case KIND_addi:  arithm_imm(EXT_ADD); break;
+            case KIND_xori:  arithm_imm(EXT_XOR); break;
+            case KIND_ori:   arithm_imm(EXT_OR);  break;
+            case KIND_andi:  arithm_imm(EXT_AND); break;
+            case KIND_slti:  compare_imm(CC_L);   break;
+            case KIND_sltiu: compare_imm(CC_B);   break;
+            case KIND_slli:  shift_imm(EXT_SHL);  break;
+            case KIND_srli:  shift_imm(EXT_SHR);  break;
+            case KIND_srai:  shift_imm(EXT_SAR);  break;
+
+            case KIND_add:  arithm(ADD_MEM); break;
+            case KIND_sub:  arithm(SUB_MEM); break;
+            case KIND_xor:  arithm(XOR_MEM); break;
+            case KIND_or:   arithm(OR_MEM);  break;
+            case KIND_and:  arithm(AND_MEM); break;
+            case KIND_slt:  compare(CC_L);   break;
+            case KIND_sltu: compare(CC_B);   break;
+            case KIND_sll:  shift(EXT_SHL);  break;
+            case KIND_srl:  shift(EXT_SHR);  break;
+            case KIND_sra:  shift(EXT_SAR);  break;
+
+            case KIND_nop: break;
+            case KIND_exit: links.emplace_back(e.jmp(), op.PC); break;
+            // operation without translation keeps block on interpreter
+            default: return nullptr;
+        }
+    }
+
+    // nothing is patched after the end of buffer
+    if (e.overflow) {
+        this->full = true;
+        return nullptr;
+    }
+
+    for (const auto& side_exit : side_exits) {
+        e.patch(side_exit.field, e.position());
+        if (side_exit.exit == Exit::CODE_WRITE) {
+            e.store32(CONTEXT, STORE_ADDR_OFFSET, RAX);
+            e.store32_imm(CONTEXT, STORE_SIZE_OFFSET, side_exit.store_size);
+        }
+        if (side_exit.refund != 0)
+            e.alu64_mem_imm(EXT_ADD, CONTEXT, BUDGET_OFFSET, side_exit.refund);
+        e.store32_imm(CONTEXT, EXIT_OFFSET, static_cast<uint32>(side_exit.exit));
+        e.mov_imm(RAX, side_exit.PC);
+        e.patch(e.jmp(), this->exit_stub);
+    }
+
+    // links to blocks which are not translated yet lead to dispatcher
+    std::vector<std::pair<uint8*, Addr>> pending;
+    for (const auto& [field, target] : links) {
+        auto it = this->entries.find(target);
+        if (it != this->entries.end()) {
+            e.patch(field, it->second);
+            continue;
+        }
+        e.patch(field, e.position());
+        e.mov_imm(RAX, target);
+        e.patch(e.jmp(), this->exit_stub);
+        pending.emplace_back(field, target);
+    }
+
+    if (e.overflow) {
+        this->full = true;
+        return nullptr;
+    }
+
+    for (const auto& [field, target] : pending)
+        this->pending_links[target].push_back(field);
+
+    // make jumps waiting for this block go directly here
+    const Addr PC = ops.front().PC;
+    auto waiting = this->pending_links.find(PC);
+    if (waiting != this->pending_links.end()) {
+        for (uint8* field : waiting->second)
+            e.patch(field, entry);
+        this->pending_links.erase(waiting);
+    }
+
+    this->entries.emplace(PC, entry);
+    this->used = static_cast<Size>(e.position() - this->buffer);
+    return entry;
+}
+
+#else
+
+bool Jit::is_supported() { return false; }
+
+Jit::Jit(Size) {
+    throw std::invalid_argument("JIT requires x86-64 host");
+}
+
+Jit::~Jit() { }
+void Jit::emit_trampoline() { }
+void Jit::set_writable(bool) { }
+const uint8* Jit::emit_block(const std::vector<Op>&, Size) { return nullptr; }
+void Jit::reset() { }
+const uint8* Jit::translate(const std::vector<Op>&, Size) { return nullptr; }
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <unordered_map>
+
+#include "infra/common.hpp"
+#include "funcsim/ops.hpp"
+
+// Translates basic blocks of fast functional engine to x86-64 host code.
+// Guest registers live in RF values array, guest memory is accessed
+// through its software TLB inline, and direct jumps between translated
+// blocks are patched to skip dispatcher.
+class Jit {
+public:
+    // reason of leaving translated code
+    enum class Exit : uint32 {
+        NEXT,        // continue from returned PC
+        BUDGET,      // block at returned PC doesn't fit into budget
+        SIDE,        // instruction at returned PC must be interpreted
+        CODE_WRITE   // completed store might have modified translated code
+    };
+
+    // state shared between dispatcher and translated code
+    struct Context {
+        uint32* regs = nullptr;
+        const void* tlb = nullptr;  // Memory::Tlb
+        const uint8* code_pages = nullptr;
+        int64 budget = 0;
+        Exit exit = Exit::NEXT;
+        Addr store_addr = NO_VAL32;
+        Size store_size = 0;
+    };
+
+private:
+    using Trampoline = Addr (*)(Context* context, const uint8* code);
+
+    uint8* buffer = nullptr;
+    Size buffer_size = 0;
+    Size used = 0;
+    Size trampoline_size = 0;
+    bool full = false;
+
+    Trampoline trampoline = nullptr;
+    const uint8* exit_stub = nullptr;
+
+    // entries of translated blocks and jumps waiting for them
+    std::unordered_map<Addr, const uint8*> entries;
+    std::unordered_map<Addr, std::vector<uint8*>> pending_links;
+
+    void emit_trampoline();
+    const uint8* emit_block(const std::vector<Op>& ops, Size length);
+
+    // code buffer is either writable or executable, never both
+    void set_writable(bool value);
+
+public:
+    explicit Jit(Size buffer_size);
+    ~Jit();
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    static bool is_supported();
+
+    // returns entry of translated block, nullptr if buffer is full
+    // or block has operation without translation
+    const uint8* translate(const std::vector<Op>& ops, Size length);
+    bool is_full() const { return full; }
+
+    // runs translated code until it leaves to dispatcher, returns PC
+    Addr execute(const uint8* code, Context& context) const {
+        return this->trampoline(&context, code);
+    }
+
+    // drops all translations
+    void reset();
+};
+
+#endif
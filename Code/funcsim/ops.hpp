@@ -0,0 +1,39 @@
+#ifndef OPS_H
+#define OPS_H
+
+#include "infra/common.hpp"
+
+// operations supported by fast functional engines, other
+// instructions terminate block and are executed by the caller
+#define THREADED_OPS(OP) \
+    OP(lui)  OP(auipc) \
+    OP(jal)  OP(jalr) \
+    OP(beq)  OP(bne)   OP(blt)   OP(bge)  OP(bltu) OP(bgeu) \
+    OP(lb)   OP(lh)    OP(lw)    OP(lbu)  OP(lhu) \
+    OP(sb)   OP(sh)    OP(sw) \
+    OP(addi) OP(slti)  OP(sltiu) OP(xori) OP(ori)  OP(andi) \
+    OP(slli) OP(srli)  OP(srai) \
+    OP(add)  OP(sub)   OP(sll)   OP(slt)  OP(sltu) \
+    OP(xor)  OP(srl)   OP(sra)   OP(or)   OP(and)
+
+enum OpKind : uint8 {
+#define KIND(name) KIND_ ## name,
+THREADED_OPS(KIND)
+#undef KIND
+    KIND_nop,   // arithmetic instruction writing to zero register
+    KIND_exit,  // leaves block without control transfer
+    KIND_MAX
+};
+
+// single operation of a basic block
+struct Op {
+    const void* handler = nullptr;  // address of implementation in interpreter
+    int32 imm = 0;
+    Addr PC = NO_VAL32;
+    OpKind kind = KIND_exit;
+    uint8 rd = 0;
+    uint8 rs1 = 0;
+    uint8 rs2 = 0;
+};
+
+#endif
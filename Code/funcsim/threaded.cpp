@@ -0,0 +1,508 @@
+#include <algorithm>
+#include <array>
+#include <limits>
+
+#include "threaded.hpp"
+
+// operation kinds indexed by opcode
+static const std::array<OpKind, Instruction::OPCODE_UNKNOWN + 1> kinds = [] {
+    std::array<OpKind, Instruction::OPCODE_UNKNOWN + 1> table;
+    table.fill(KIND_exit);
+#define KIND(name) table[Instruction::OPCODE_ ## name] = KIND_ ## name;
+THREADED_OPS(KIND)
+#undef KIND
+    return table;
+}();
+
+// adjacent pairs of operations executed by single handler of
+// interpreter: idioms emitted by compilers for constants, far calls,
+// array indexing and compare-and-branch, and pairs which are hot
+// in the benchmark binaries
+#define FUSED_OPS(PAIR) \
+    PAIR(lui, addi)   PAIR(auipc, addi) PAIR(auipc, jalr) \
+    PAIR(slli, add)   PAIR(add, lw)     PAIR(lw, slli)    PAIR(lw, add) \
+    PAIR(slt, beq)    PAIR(slt, bne)    PAIR(sltu, beq)   PAIR(sltu, bne) \
+    PAIR(slti, beq)   PAIR(slti, bne)   PAIR(sltiu, beq)  PAIR(sltiu, bne) \
+    PAIR(and, beq)    PAIR(and, bne)    PAIR(andi, beq)   PAIR(andi, bne) \
+    PAIR(addi, beq)   PAIR(addi, bne)   PAIR(addi, blt)   PAIR(addi, bge) \
+    PAIR(lw, beq)     PAIR(lw, bne)     PAIR(lw, blt)     PAIR(lw, bge) \
+    PAIR(lw, lw)      PAIR(lw, addi)    PAIR(sw, lw)      PAIR(addi, sw) \
+    PAIR(sub, sub)    PAIR(sub, sltu)   PAIR(sub, srai)   PAIR(sub, addi) \
+    PAIR(srai, xor)   PAIR(xor, sub)    PAIR(sltu, and)   PAIR(addi, and)
+
+// limits time spent in block without chaining checks
+static const Size MAX_BLOCK_LENGTH = 256;
+
+ThreadedEngine::ThreadedEngine(FuncMemory& memory, RF& rf, DecodeCache& decode_cache)
+    : memory(memory)
+    , rf(rf)
+    , decode_cache(decode_cache)
+{
+    Addr PC = NO_VAL32;
+    this->execute(nullptr, PC, 0);
+}
+
+ThreadedEngine::Block* ThreadedEngine::get_block(Addr PC) {
+    auto it = this->blocks.find(PC);
+    if (it != this->blocks.end())
+        return it->second.get();
+    return this->build_block(PC);
+}
+
+ThreadedEngine::Block* ThreadedEngine::build_block(Addr PC) {
+    auto block = std::make_unique<Block>();
+    block->PC = PC;
+
+    Addr op_PC = PC;
+    while (true) {
+        Op op;
+        op.PC = op_PC;
+        op.handler = this->handlers[KIND_exit];
+
+        if (block->length == MAX_BLOCK_LENGTH) {
+            block->ops.push_back(op);
+            break;
+        }
+
+        const Instruction::Predecoded* predecoded = this->decode_cache.lookup(op_PC);
+        if (predecoded == nullptr) {
+            try {
+                predecoded = &this->decode_cache.fill(op_PC, this->memory.read_word(op_PC));
+            }
+            catch (const std::invalid_argument&) {
+                block->ops.push_back(op);
+                break;
+            }
+        }
+
+        OpKind kind = kinds[predecoded->opcode];
+        if (kind == KIND_exit) {
+            block->ops.push_back(op);
+            break;
+        }
+
+        Instruction::Type type = Instruction::get_info(predecoded->opcode).type;
+        bool is_control = type == Instruction::Type::JUMP
+                       || type == Instruction::Type::BRANCH;
+        bool is_nop = type == Instruction::Type::ARITHM
+                   && predecoded->rd == 0;
+
+        op.kind = is_nop ? KIND_nop : kind;
+        op.handler = this->handlers[this->observed ? KIND_MAX : op.kind];
+        op.imm = predecoded->imm_v;
+        op.rd  = predecoded->rd;
+        op.rs1 = predecoded->rs1;
+        op.rs2 = predecoded->rs2;
+        block->ops.push_back(op);
+
+        block->length++;
+        op_PC += 4;
+        if (is_control)
+            break;
+    }
+
+    // remember failures not to decode the same PC again
+    if (block->length == 0) {
+        this->blocks.emplace(PC, nullptr);
+        return nullptr;
+    }
+
+    block->end_PC = op_PC;
+    for (Addr word = block->PC; word != block->end_PC; word += 4)
+        this->code_words[word >> PAGE_BITS].set((word & ((1 << PAGE_BITS) - 1)) >> 2);
+
+    if (this->fusion && !this->observed)
+        this->fuse(block.get());
+
+    Block* result = block.get();
+    this->blocks.emplace(PC, std::move(block));
+    return result;
+}
+
+void ThreadedEngine::fuse(Block* block) {
+    // only handler of the first op changes: operation kinds are kept
+    // for translation, and retired count is still block length
+    auto& ops = block->ops;  // alias
+    for (size_t i = 0; i + 1 < ops.size(); ++i) {
+        const void* handler = (*this->fused_handlers)[ops[i].kind][ops[i + 1].kind];
+        if (handler != nullptr) {
+            ops[i].handler = handler;
+            ++i;
+        }
+    }
+}
+
+bool ThreadedEngine::is_code(Addr addr, Size num_bytes) const {
+    for (Addr word = addr & ~3u; word < addr + num_bytes; word += 4) {
+        auto it = this->code_words.find(word >> PAGE_BITS);
+        if (it != this->code_words.end()
+            && it->second.test((word & ((1 << PAGE_BITS) - 1)) >> 2))
+            return true;
+    }
+    return false;
+}
+
+void ThreadedEngine::flush() {
+    this->blocks.clear();
+    this->code_words.clear();
+    if (this->jit != nullptr)
+        this->jit->reset();
+}
+
+void ThreadedEngine::set_fusion(bool value) {
+    this->flush();
+    this->fusion = value;
+}
+
+void ThreadedEngine::set_observers(AccessProfiler* profiler, ReuseDistance* instructions) {
+    bool observed = profiler != nullptr || instructions != nullptr;
+    if (observed && this->jit != nullptr)
+        throw std::invalid_argument("JIT doesn't record accesses, use threaded engine");
+    this->flush();
+    this->profiler = profiler;
+    this->instruction_reuse = instructions;
+    this->observed = observed;
+}
+
+void ThreadedEngine::set_profiler(AccessProfiler* value) {
+    this->set_observers(value, this->instruction_reuse);
+}
+
+void ThreadedEngine::set_reuse_distance(ReuseDistance* instructions) {
+    this->set_observers(this->profiler, instructions);
+}
+
+void ThreadedEngine::enable_jit(uint64 threshold, Size buffer_size) {
+    if (!Jit::is_supported())
+        throw std::invalid_argument("JIT is not supported on this host");
+    if (this->observed)
+        throw std::invalid_argument("JIT doesn't record accesses, use threaded engine");
+    this->flush();
+    this->jit = std::make_unique<Jit>(buffer_size);
+    this->jit_threshold = std::max<uint64>(threshold, 1);
+
+    auto& c = this->jit_context;  // alias
+    c.regs = this->rf.get_values();
+    c.tlb = &this->memory.get_tlb();
+    c.code_pages = this->decode_cache.get_code_pages();
+}
+
+void ThreadedEngine::disable_jit() {
+    this->flush();
+    this->jit.reset();
+}
+
+void ThreadedEngine::set_breakpoint(Addr PC) {
+    if (PC == this->breakpoint)
+        return;
+    this->breakpoint = PC;
+    // translated blocks are chained directly, so breakpoint
+    // can't be checked before entering them
+    if (this->jit != nullptr && PC != NO_VAL32)
+        this->reset_translations();
+}
+
+void ThreadedEngine::reset_translations() {
+    this->jit->reset();
+    // hot blocks are translated again after reaching threshold anew
+    for (auto& entry : this->blocks) {
+        if (entry.second != nullptr) {
+            entry.second->native = nullptr;
+            entry.second->executions = 0;
+        }
+    }
+}
+
+void ThreadedEngine::translate(Block* block) {
+    if (this->has_breakpoint(block))
+        return;
+    block->native = this->jit->translate(block->ops, block->length);
+    if (block->native == nullptr && this->jit->is_full()) {
+        // code buffer is full, start translating from scratch
+        this->reset_translations();
+        this->stats.buffer_resets++;
+        block->native = this->jit->translate(block->ops, block->length);
+        // block which doesn't fit into empty buffer stays interpreted
+        // until translations are dropped again
+        if (block->native == nullptr)
+            block->executions = this->jit_threshold;
+    }
+    this->stats.translations += block->native != nullptr;
+}
+
+void ThreadedEngine::invalidate(Addr addr, Size num_bytes) {
+    if (this->is_code(addr, num_bytes))
+        this->flush();
+}
+
+uint64 ThreadedEngine::run(Addr& PC, uint64 budget) {
+    Block* block = this->get_block(PC);
+    if (block == nullptr)
+        return 0;
+    return this->execute(block, PC, budget);
+}
+
+// labels as values are GNU extension
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+uint64 ThreadedEngine::execute(Block* block, Addr& PC, uint64 budget) {
+    static const void* const table[KIND_MAX + 1] = {
+#define LABEL(name) &&L_ ## name,
+THREADED_OPS(LABEL)
+#undef LABEL
+        &&L_nop,
+        &&L_exit,
+        &&L_observe  // runs before handler of any operation if engine is observed
+    };
+
+    static FusedHandlers fused_table = {};
+
+    if (block == nullptr) {
+#define FUSED_LABEL(first, second) fused_table[KIND_ ## first][KIND_ ## second] = &&L_ ## first ## _ ## second;
+FUSED_OPS(FUSED_LABEL)
+#undef FUSED_LABEL
+        this->handlers = table;
+        this->fused_handlers = &fused_table;
+        return 0;
+    }
+
+    uint32* r = this->rf.get_values();
+    const bool observed = this->observed;
+    uint64 retired = 0;
+    const Op* op = nullptr;
+    Addr next_PC = NO_VAL32;
+
+#define DISPATCH() goto *(++op)->handler
+
+    // semantics of operations, shared by single and fused handlers
+#define EXEC_lui   r[op->rd] = op->imm;
+#define EXEC_auipc r[op->rd] = op->PC + op->imm;
+
+#define EXEC_jal \
+    if (op->rd != 0) \
+        r[op->rd] = op->PC + 4; \
+    next_PC = op->PC + op->imm; \
+    goto block_end;
+
+#define EXEC_jalr \
+    next_PC = (r[op->rs1] + op->imm) & ~1u; \
+    if (op->rd != 0) \
+        r[op->rd] = op->PC + 4; \
+    goto block_end;
+
+#define BRANCH(condition) \
+    next_PC = (condition) ? op->PC + op->imm : op->PC + 4; \
+    goto block_end;
+
+#define EXEC_beq  BRANCH(r[op->rs1] == r[op->rs2])
+#define EXEC_bne  BRANCH(r[op->rs1] != r[op->rs2])
+#define EXEC_blt  BRANCH(static_cast<int32>(r[op->rs1]) <  static_cast<int32>(r[op->rs2]))
+#define EXEC_bge  BRANCH(static_cast<int32>(r[op->rs1]) >= static_cast<int32>(r[op->rs2]))
+#define EXEC_bltu BRANCH(r[op->rs1] <  r[op->rs2])
+#define EXEC_bgeu BRANCH(r[op->rs1] >= r[op->rs2])
+
+#define LOAD(type, size) { \
+        Addr addr = r[op->rs1] + op->imm; \
+        uint32 value = static_cast<uint32>(static_cast<type>(this->memory.read<size>(addr))); \
+        if (op->rd != 0) \
+            r[op->rd] = value; \
+        if (observed) \
+            this->memory.record(true, addr); \
+    }
+
+#define EXEC_lb  LOAD(int8,   1)
+#define EXEC_lh  LOAD(int16,  2)
+#define EXEC_lw  LOAD(uint32, 4)
+#define EXEC_lbu LOAD(uint8,  1)
+#define EXEC_lhu LOAD(uint16, 2)
+
+#define STORE(size) { \
+        Addr addr = r[op->rs1] + op->imm; \
+        this->memory.write<size>(r[op->rs2], addr); \
+        if (observed) \
+            this->memory.record(false, addr); \
+        if (this->decode_cache.may_hold_code(addr, size)) { \
+            this->decode_cache.invalidate(addr, size); \
+            if (this->is_code(addr, size)) \
+                goto code_modified; \
+        } \
+    }
+
+#define EXEC_sb STORE(1)
+#define EXEC_sh STORE(2)
+#define EXEC_sw STORE(4)
+
+#define EXEC_addi  r[op->rd] = r[op->rs1] + op->imm;
+#define EXEC_slti  r[op->rd] = static_cast<int32>(r[op->rs1]) < op->imm;
+#define EXEC_sltiu r[op->rd] = r[op->rs1] < static_cast<uint32>(op->imm);
+#define EXEC_xori  r[op->rd] = r[op->rs1] ^ op->imm;
+#define EXEC_ori   r[op->rd] = r[op->rs1] | op->imm;
+#define EXEC_andi  r[op->rd] = r[op->rs1] & op->imm;
+#define EXEC_slli  r[op->rd] = r[op->rs1] << (op->imm & 0x1f);
+#define EXEC_srli  r[op->rd] = r[op->rs1] >> (op->imm & 0x1f);
+#define EXEC_srai  r[op->rd] = static_cast<int32>(r[op->rs1]) >> (op->imm & 0x1f);
+
+#define EXEC_add   r[op->rd] = r[op->rs1] + r[op->rs2];
+#define EXEC_sub   r[op->rd] = r[op->rs1] - r[op->rs2];
+#define EXEC_sll   r[op->rd] = r[op->rs1] << (r[op->rs2] & 0x1f);
+#define EXEC_slt   r[op->rd] = static_cast<int32>(r[op->rs1]) < static_cast<int32>(r[op->rs2]);
+#define EXEC_sltu  r[op->rd] = r[op->rs1] < r[op->rs2];
+#define EXEC_xor   r[op->rd] = r[op->rs1] ^ r[op->rs2];
+#define EXEC_srl   r[op->rd] = r[op->rs1] >> (r[op->rs2] & 0x1f);
+#define EXEC_sra   r[op->rd] = static_cast<int32>(r[op->rs1]) >> (r[op->rs2] & 0x1f);
+#define EXEC_or    r[op->rd] = r[op->rs1] | r[op->rs2];
+#define EXEC_and   r[op->rd] = r[op->rs1] & r[op->rs2];
+
+    try {
+    enter:
+        if (block->native != nullptr)
+            goto native;
+        if (block->length > budget - retired || this->has_breakpoint(block)) {
+            PC = block->PC;
+            return retired;
+        }
+        if (++block->executions == this->jit_threshold && this->jit != nullptr) {
+            this->translate(block);
+            if (block->native != nullptr)
+                goto native;
+        }
+        op = block->ops.data();
+        goto *op->handler;
+
+    native: {
+        auto& c = this->jit_context;  // alias
+        c.budget = static_cast<int64>(std::min<uint64>(budget - retired, std::numeric_limits<int64>::max()));
+        c.exit = Jit::Exit::NEXT;
+        const int64 initial_budget = c.budget;
+        next_PC = this->jit->execute(block->native, c);
+        retired += static_cast<uint64>(initial_budget - c.budget);
+
+        switch (c.exit) {
+            case Jit::Exit::NEXT:
+                break;
+            case Jit::Exit::CODE_WRITE:
+                this->decode_cache.invalidate(c.store_addr, c.store_size);
+                if (!this->is_code(c.store_addr, c.store_size))
+                    break;
+                PC = next_PC;
+                this->flush();
+                return retired;
+            default:
+                PC = next_PC;
+                return retired;
+        }
+        block = this->get_block(next_PC);
+        if (block == nullptr) {
+            PC = next_PC;
+            return retired;
+        }
+        goto enter;
+    }
+
+#define HANDLER(name) L_ ## name: EXEC_ ## name DISPATCH();
+THREADED_OPS(HANDLER)
+#undef HANDLER
+
+    // op points to the second instruction of pair before its execution,
+    // so exceptions and code modifications are accounted precisely
+#define HANDLER(first, second) L_ ## first ## _ ## second: EXEC_ ## first ++op; EXEC_ ## second DISPATCH();
+FUSED_OPS(HANDLER)
+#undef HANDLER
+
+    L_nop:                                                                            DISPATCH();
+
+    L_observe:
+        if (this->profiler != nullptr) {
+            this->profiler->record(AccessProfiler::Access::FETCH, op->PC);
+            this->profiler->tick();
+        }
+        if (this->instruction_reuse != nullptr)
+            this->instruction_reuse->access(op->PC);
+        goto *table[op->kind];
+
+    L_exit:
+        next_PC = op->PC;
+        goto block_end;
+
+    block_end:
+        retired += block->length;
+        if (block->links[0].PC == next_PC) {
+            block = block->links[0].block;
+        }
+        else if (block->links[1].PC == next_PC) {
+            block = block->links[1].block;
+        }
+        else {
+            Block* next = this->get_block(next_PC);
+            if (next == nullptr) {
+                PC = next_PC;
+                return retired;
+            }
+            // first link keeps static successor, second one follows
+            // the latest target of indirect jump
+            auto& link = (block->links[0].block == nullptr) ? block->links[0] : block->links[1];
+            link.PC = next_PC;
+            link.block = next;
+            block = next;
+        }
+        goto enter;
+
+    code_modified:
+        // any block might be stale now, leave before executing next one
+        retired += (op - block->ops.data()) + 1;
+        PC = op->PC + 4;
+        this->flush();
+        return retired;
+    }
+    catch (const std::invalid_argument&) {
+        // instruction at op has not been completed
+        retired += op - block->ops.data();
+        PC = op->PC;
+        throw;
+    }
+
+#undef EXEC_lui
+#undef EXEC_auipc
+#undef EXEC_jal
+#undef EXEC_jalr
+#undef EXEC_beq
+#undef EXEC_bne
+#undef EXEC_blt
+#undef EXEC_bge
+#undef EXEC_bltu
+#undef EXEC_bgeu
+#undef EXEC_lb
+#undef EXEC_lh
+#undef EXEC_lw
+#undef EXEC_lbu
+#undef EXEC_lhu
+#undef EXEC_sb
+#undef EXEC_sh
+#undef EXEC_sw
+#undef EXEC_addi
+#undef EXEC_slti
+#undef EXEC_sltiu
+#undef EXEC_xori
+#undef EXEC_ori
+#undef EXEC_andi
+#undef EXEC_slli
+#undef EXEC_srli
+#undef EXEC_srai
+#undef EXEC_add
+#undef EXEC_sub
+#undef EXEC_sll
+#undef EXEC_slt
+#undef EXEC_sltu
+#undef EXEC_xor
+#undef EXEC_srl
+#undef EXEC_sra
+#undef EXEC_or
+#undef EXEC_and
+#undef BRANCH
+#undef STORE
+#undef LOAD
+#undef DISPATCH
+}
+
+#pragma GCC diagnostic pop
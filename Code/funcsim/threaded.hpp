@@ -0,0 +1,135 @@
+#ifndef THREADED_H
+#define THREADED_H
+
+#include <array>
+#include <bitset>
+#include <memory>
+#include <unordered_map>
+
+#include "infra/common.hpp"
+#include "rf/rf.hpp"
+#include "memory/memory.hpp"
+#include "funcsim/decode_cache.hpp"
+#include "funcsim/ops.hpp"
+#include "funcsim/jit.hpp"
+
+// Functional engine which splits guest code into basic blocks
+// ending at jumps and branches. Each block is an array of compact
+// operations executed with direct-threaded dispatch, blocks are
+// chained to their successors to avoid lookups, and common adjacent
+// pairs of operations share a single dispatch. Optionally, blocks
+// executed often enough are translated to host code.
+//
+// With profiler or reuse distances attached every operation passes
+// through observing handler before its own one, and pairs are not fused.
+class ThreadedEngine {
+public:
+    struct Stats {
+        uint64 translations = 0;   // blocks translated to host code
+        uint64 buffer_resets = 0;  // translations dropped as code buffer was full
+    };
+
+private:
+    struct Block;
+
+    // cached transition to successor block
+    struct Link {
+        Addr PC = NO_VAL32;
+        Block* block = nullptr;
+    };
+
+    struct Block {
+        Addr PC = NO_VAL32;
+        Addr end_PC = NO_VAL32;  // first byte after the block
+        Size length = 0;         // number of guest instructions
+        std::vector<Op> ops;     // ends with control transfer op
+        std::array<Link, 2> links;
+        uint64 executions = 0;
+        const uint8* native = nullptr;  // translated code, if any
+    };
+
+    FuncMemory& memory;
+    RF& rf;
+    DecodeCache& decode_cache;
+
+    std::unordered_map<Addr, std::unique_ptr<Block>> blocks;
+
+    // words of guest memory occupied by blocks grouped by pages,
+    // stores there require blocks to be rebuilt
+    static const Size PAGE_BITS = DecodeCache::PAGE_BITS;
+    std::unordered_map<Addr, std::bitset<(1 << PAGE_BITS) / 4>> code_words;
+
+    // handlers addresses indexed by operation kind,
+    // followed by observing handler
+    const void* const* handlers = nullptr;
+
+    // handlers of fused pairs indexed by kinds of both operations,
+    // nullptr if pair is not fused
+    using FusedHandlers = std::array<std::array<const void*, KIND_MAX>, KIND_MAX>;
+    const FusedHandlers* fused_handlers = nullptr;
+    bool fusion = true;
+
+    // record fetches of each operation, data accesses are
+    // passed to collectors of memory
+    AccessProfiler* profiler = nullptr;
+    ReuseDistance* instruction_reuse = nullptr;
+    bool observed = false;
+
+    // blocks containing breakpoint are neither entered nor translated
+    Addr breakpoint = NO_VAL32;
+
+    Stats stats;
+
+    std::unique_ptr<Jit> jit;
+    uint64 jit_threshold = 0;
+    Jit::Context jit_context;
+
+    Block* get_block(Addr PC);
+    Block* build_block(Addr PC);
+    bool is_code(Addr addr, Size num_bytes) const;
+    void flush();
+    void fuse(Block* block);
+    void translate(Block* block);
+    void reset_translations();
+    void set_observers(AccessProfiler* profiler, ReuseDistance* instructions);
+    bool has_breakpoint(const Block* block) const {
+        return this->breakpoint != NO_VAL32
+            && this->breakpoint - block->PC < block->end_PC - block->PC;
+    }
+
+    // executes chain of blocks starting from given one,
+    // initializes handlers table if block is nullptr
+    uint64 execute(Block* block, Addr& PC, uint64 budget);
+
+public:
+    ThreadedEngine(FuncMemory& memory, RF& rf, DecodeCache& decode_cache);
+
+    // executes at most budget instructions starting from PC, returns number
+    // of executed ones; stops early if block can't be built at PC,
+    // it doesn't fit into the remaining budget or contains breakpoint
+    uint64 run(Addr& PC, uint64 budget);
+
+    // NO_VAL32 disables breakpoint
+    void set_breakpoint(Addr PC);
+
+    // executes adjacent pairs of operations with single dispatch
+    void set_fusion(bool value);
+
+    // accesses are recorded as FuncMemory::load_store does, nullptr
+    // disables collector; translated code isn't observed, so JIT
+    // can't be enabled together with collectors
+    void set_profiler(AccessProfiler* value);
+    void set_reuse_distance(ReuseDistance* instructions);
+
+    // translates blocks after given number of executions
+    void enable_jit(uint64 threshold, Size buffer_size);
+    void disable_jit();
+
+    // notifies engine about store made outside of it
+    void invalidate(Addr addr, Size num_bytes);
+
+    size_t get_blocks_count() const { return blocks.size(); }
+    const Stats& get_stats() const { return stats; }
+};
+
+#endif
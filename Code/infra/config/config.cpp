@@ -41,6 +41,7 @@ namespace config {
     template class RequiredValue<std::string>;
     template class RequiredValue<uint64>;
     template class Value<uint64>;
+    template class Value<std::string>;
     template class Value<bool>;
 
     void parse_args(int argc, char** argv) {
@@ -1,7 +1,10 @@
 #include "elf.hpp"
+#include "memory/memory.hpp"
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <bitset>
 #include <algorithm>
 
@@ -45,6 +48,12 @@ ElfLoader::ElfLoader(std::string filename) :
     }
 
     this->entry_point = ehdr.e_entry;
+
+    for (size_t i = 0; i < phdrnum; i++) {
+        GElf_Phdr phdr = get_phdr(i);
+        if (phdr.p_type == PT_LOAD)
+            this->data_end = std::max<Addr>(this->data_end, phdr.p_vaddr + phdr.p_memsz);
+    }
 }
 
 ElfLoader::~ElfLoader() {
@@ -52,43 +61,61 @@ ElfLoader::~ElfLoader() {
     close(fd);
 }
 
-std::vector<uint8> ElfLoader::load_data() {
-    std::vector<uint8> data;
+GElf_Phdr ElfLoader::get_phdr(size_t index) {
+    GElf_Phdr phdr;
+    if (gelf_getphdr(elf_inst, static_cast<int>(index), &phdr) != &phdr) {
+        std::cerr << "ELF: getphdr failed" << std::endl;
+        exit(0);
+    }
+    return phdr;
+}
+
+void ElfLoader::load(Memory& memory) {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        std::cerr << "ELF: fstat failed" << std::endl;
+        exit(0);
+    }
+    const auto file_size = static_cast<size_t>(file_stat.st_size);
 
-    GElf_Phdr* temp_phdr, phdr;
-    unsigned long offset = 0;
-    ssize_t bytes_read = 0;
+    // private read-only mapping, pages are read from file on first access
+    void* image = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) {
+        std::cerr << "ELF: mmap failed" << std::endl;
+        exit(0);
+    }
+    std::shared_ptr<const void> mapping(image, [file_size](const void* ptr) {
+        munmap(const_cast<void*>(ptr), file_size);
+    });
+    const auto* file = static_cast<const uint8*>(image);
 
-    for (unsigned int i = 0; i < phdrnum; i++) {
-        temp_phdr = gelf_getphdr(elf_inst, i, &phdr);
-        if (temp_phdr != &phdr) {
-            std::cerr << "ELF: getphdr failed" << std::endl;
+    for (size_t i = 0; i < phdrnum; i++) {
+        GElf_Phdr phdr = get_phdr(i);
+        if (phdr.p_type != PT_LOAD)
+            continue;
+        if (phdr.p_offset + phdr.p_filesz > file_size) {
+            std::cerr << "ELF: segment exceeds file" << std::endl;
             exit(0);
         }
 
-        std::vector<int8> temp_buf(phdr.p_filesz);
-
-        if (phdr.p_type == PT_LOAD) {
-            offset = lseek(fd, phdr.p_offset, SEEK_SET);
-            if (offset != phdr.p_offset) {
-                std::cerr << "ELF: lseek failed" << std::endl;
-                exit(0);
-            }
+        const uint8* bytes = file + phdr.p_offset;
+        auto begin = static_cast<Addr>(phdr.p_vaddr);
+        auto end = static_cast<Addr>(phdr.p_vaddr + phdr.p_filesz);
 
-            bytes_read = read(fd, &temp_buf[0], phdr.p_filesz);
-            if (bytes_read != static_cast<ssize_t>(phdr.p_filesz)){
-                std::cerr << "ELF: read failed" << std::endl;
-                exit(0);
-            }
+        // guest pages fully covered by segment are shared with file
+        // if segment has the same offset in page of file and memory
+        Addr first = (begin + Memory::PAGE_SIZE - 1) & ~(Memory::PAGE_SIZE - 1);
+        Addr last = end & ~(Memory::PAGE_SIZE - 1);
+        if ((phdr.p_vaddr - phdr.p_offset) % Memory::PAGE_SIZE != 0 || first >= last)
+            first = last = end;
+        else
+            memory.map_shared(first, bytes + (first - begin), last - first, mapping);
 
-            if (data.size() < phdr.p_vaddr + phdr.p_filesz)
-                data.resize(phdr.p_vaddr + phdr.p_filesz, 0);
+        // partial pages are copied, so they have no bytes of other segments
+        memory.write_bytes(bytes, begin, first - begin);
+        memory.write_bytes(bytes + (last - begin), last, end - last);
 
-            std::copy(temp_buf.begin(), temp_buf.end(),
-                      data.begin() + phdr.p_vaddr);
-        }
+        TRACE(ELF, DETAILED, "segment 0x" << std::hex << begin << "-0x" << phdr.p_vaddr + phdr.p_memsz
+                             << ", shared 0x" << first << "-0x" << last << std::dec << "\n");
     }
-
-    return data;
 }
-
@@ -3,6 +3,9 @@
 
 #include <gelf.h>
 #include "infra/common.hpp"
+#include "infra/trace/trace.hpp"
+
+class Memory;
 
 class ElfLoader {
 private:
@@ -11,17 +14,25 @@ private:
     GElf_Ehdr ehdr;
     size_t phdrnum;
     Addr entry_point;
+    Addr data_end = 0;
+
+    GElf_Phdr get_phdr(size_t index);
 public:
     ElfLoader(std::string filename);
     ~ElfLoader();
 
-    std::vector<uint8> load_data();
+    // maps file read-only and shares its page-aligned parts of segments
+    // with guest memory copy-on-write, other bytes are copied;
+    // .bss is left to untouched zero pages
+    void load(Memory& memory);
     Addr get_start_PC() {
-        std::cout << "START PC: "
-                  << std::hex << entry_point
-                  << std::endl << std::endl;
+        TRACE(ELF, BASIC, "START PC: "
+                          << std::hex << entry_point
+                          << "\n\n");
         return entry_point;
     }
+    // first byte after loaded segments including .bss
+    Addr get_data_end() const { return data_end; }
 };
 
 #endif
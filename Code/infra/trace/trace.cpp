@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "infra/config/config.hpp"
+#include "trace.hpp"
+
+namespace config {
+    static         Value<std::string> trace      = { "trace",      "components to trace, e.g. perfsim,cache=2 or all", "" };
+    static         Value<std::string> trace_file = { "trace_file", "file to write trace to instead of stdout",         "" };
+}
+
+namespace trace {
+
+std::array<Level, static_cast<size_t>(Component::MAX)> levels = {};
+
+static const std::array<std::string, static_cast<size_t>(Component::MAX)> names = {
+    "funcsim", "perfsim", "cache", "memory", "rf", "elf"
+};
+
+namespace {
+
+// Accumulates messages in large buffer and passes them
+// to target stream buffer only when it gets full.
+class BufferedSink : public std::streambuf {
+private:
+    std::vector<char> buffer;
+    std::ofstream file;
+
+    std::streambuf* get_target() {
+        return this->file.is_open() ? this->file.rdbuf() : std::cout.rdbuf();
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        this->flush();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+            return this->sputc(traits_type::to_char_type(c));
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+        this->flush();
+        return 0;
+    }
+
+public:
+    explicit BufferedSink(Size size) : buffer(size) {
+        this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+    }
+
+    ~BufferedSink() override { this->flush(); }
+
+    void open(const std::string& filename) {
+        this->flush();
+        this->file.open(filename);
+        if (!this->file.is_open())
+            throw std::invalid_argument("Cannot open trace file " + filename);
+    }
+
+    void flush() {
+        std::streambuf* target = this->get_target();
+        auto size = this->pptr() - this->pbase();
+        // target is missing if std::cout is silenced
+        if (target != nullptr && size != 0) {
+            target->sputn(this->pbase(), size);
+            target->pubsync();
+        }
+        this->setp(this->buffer.data(), this->buffer.data() + this->buffer.size());
+    }
+};
+
+struct Sink {
+    BufferedSink buffer{ 1 << 20 };
+    std::ostream stream{ &buffer };
+};
+
+Sink& get_sink() {
+    static Sink instance;
+    return instance;
+}
+
+} // namespace
+
+std::ostream& sink() {
+    return get_sink().stream;
+}
+
+void flush() {
+    get_sink().buffer.flush();
+}
+
+void configure(const std::string& spec) {
+    levels.fill(Level::OFF);
+
+    std::istringstream stream(spec);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (item.empty())
+            continue;
+
+        std::string name = item.substr(0, item.find('='));
+        Level level = Level::BASIC;
+        if (name.size() != item.size()) {
+            std::string value = item.substr(name.size() + 1);
+            if (value == "0" || value == "1" || value == "2")
+                level = static_cast<Level>(value[0] - '0');
+            else
+                throw std::invalid_argument("Wrong trace level " + value);
+        }
+
+        if (name == "all") {
+            levels.fill(level);
+            continue;
+        }
+        auto it = std::find(names.begin(), names.end(), name);
+        if (it == names.end())
+            throw std::invalid_argument("Unknown trace component " + name);
+        levels[it - names.begin()] = level;
+    }
+}
+
+void init() {
+    configure(config::trace);
+    const std::string& filename = config::trace_file;
+    if (!filename.empty())
+        get_sink().buffer.open(filename);
+}
+
+} // namespace trace
@@ -0,0 +1,61 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <array>
+
+#include "infra/common.hpp"
+
+// Tracing of simulator internals. Each component has its own verbosity
+// level selected at runtime with --trace option, messages go to buffered
+// sink instead of flushing std::cout on every line. Release builds
+// (NDEBUG) compile all tracing out.
+namespace trace {
+    enum class Component : uint8 {
+        FUNCSIM,
+        PERFSIM,
+        CACHE,
+        MEMORY,
+        RF,
+        ELF,
+        MAX
+    };
+
+    enum class Level : uint8 {
+        OFF,
+        BASIC,     // one line per instruction or pipeline stage
+        DETAILED   // internal state and statistics
+    };
+
+    extern std::array<Level, static_cast<size_t>(Component::MAX)> levels;
+
+    inline bool is_enabled(Component component, Level level) {
+        return levels[static_cast<size_t>(component)] >= level;
+    }
+
+    // sets levels from comma-separated list of component[=level] items,
+    // e.g. "perfsim,cache=2"; "all" stands for every component
+    void configure(const std::string& spec);
+
+    // applies --trace and --trace_file options
+    void init();
+
+    // buffered stream of trace messages
+    std::ostream& sink();
+    void flush();
+}
+
+#ifdef NDEBUG
+#define TRACE_ENABLED(component, level) false
+#else
+#define TRACE_ENABLED(component, level) \
+    trace::is_enabled(trace::Component::component, trace::Level::level)
+#endif
+
+// message is evaluated only if tracing is enabled
+#define TRACE(component, level, message) \
+    do { \
+        if (TRACE_ENABLED(component, level)) \
+            trace::sink() << message; \
+    } while (0)
+
+#endif
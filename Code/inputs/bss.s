@@ -0,0 +1,37 @@
+# 64 KiB page-aligned .data and 64 MiB .bss: checks that .bss reads
+# as zeros, writes to both and exits with 7 + 5 + 3 + 0
+.section .text
+.globl _start
+_start:
+    la t0, table
+    lw a0, 0(t0)
+    li t1, 0xfffc
+    add t1, t0, t1
+    lw a1, 0(t1)
+    add a0, a0, a1
+    li t2, 3
+    sw t2, 4(t0)
+    lw a1, 4(t0)
+    add a0, a0, a1
+    la t0, heap
+    li t1, 0x3fffffc
+    add t1, t0, t1
+    lw a1, 0(t1)
+    add a0, a0, a1
+    sw a0, 0(t1)
+    lw a0, 0(t1)
+    li a7, 93
+    ecall
+
+.section .data
+.p2align 12
+table:
+    .word 7
+    .fill 0x3ffe, 4, 0
+    .word 5
+    .half 9
+
+.section .bss
+.p2align 12
+heap:
+    .zero 0x4000000
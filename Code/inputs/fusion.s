@@ -0,0 +1,52 @@
+# Exercises instruction pairs fused by threaded engine:
+# sums squares of array elements computed in a subroutine
+# and exits with the sum modulo 256
+.section .text
+.globl _start
+_start:
+    # s0 = array, s1 = length
+    lui s0, %hi(array)
+    addi s0, s0, %lo(array)
+    li s1, 16
+    li s2, 0
+    li t0, 0
+fill:
+    # array[t0] = t0 + 0x12345
+    lui t1, 0x12
+    addi t1, t1, 0x345
+    add t1, t1, t0
+    slli t2, t0, 2
+    add t2, t2, s0
+    sw t1, 0(t2)
+    addi t0, t0, 1
+    slt t3, t0, s1
+    bnez t3, fill
+    li t0, 0
+sum:
+    slli t2, t0, 2
+    add t2, t2, s0
+    lw a0, 0(t2)
+1:  auipc ra, %pcrel_hi(square)
+    jalr ra, %pcrel_lo(1b)(ra)
+    add s2, s2, a0
+    addi t0, t0, 1
+    sltu t3, t0, s1
+    bnez t3, sum
+    # exit(s2 & 0xff)
+    andi a0, s2, 0xff
+    li a7, 93
+    ecall
+
+# a0 = (a0 & 0x3ff) * (a0 & 0x3ff) by repeated addition
+square:
+    andi a1, a0, 0x3ff
+    mv a2, a1
+    li a0, 0
+2:  add a0, a0, a1
+    addi a2, a2, -1
+    bnez a2, 2b
+    ret
+
+.section .data
+array:
+    .space 64
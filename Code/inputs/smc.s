@@ -0,0 +1,30 @@
+# Rewrites its own hot loop: increment of the sum is patched
+# from 1 to 2 by a word store after 50 iterations and back by
+# a byte store after 75, exits with the sum of 125
+.section .text
+.globl _start
+_start:
+    li a0, 0
+    li t0, 0
+    li t1, 100
+    lui s0, %hi(patch)
+    addi s0, s0, %lo(patch)
+    # s1 = addi a0, a0, 1, s2 = addi a0, a0, 2
+    lw s1, 0(s0)
+    lui t2, 0x100
+    add s2, s1, t2
+loop:
+patch:
+    addi a0, a0, 1
+    addi t0, t0, 1
+    li t3, 50
+    bne t0, t3, 1f
+    sw s2, 0(s0)
+1:  li t3, 75
+    bne t0, t3, 2f
+    # immediate bits 16..23 are the third byte
+    srli t4, s1, 16
+    sb t4, 2(s0)
+2:  blt t0, t1, loop
+    li a7, 93
+    ecall
@@ -0,0 +1,17 @@
+# Touches memory far from the image: stack near the top of
+# address space and a word at 1 GiB, exits with their sum
+.section .text
+.globl _start
+_start:
+    addi sp, sp, -16
+    li t0, 40
+    sw t0, 12(sp)
+    lui t1, 0x40000
+    li t0, 2
+    sw t0, 0(t1)
+    lw a0, 12(sp)
+    lw a1, 0(t1)
+    add a0, a0, a1
+    addi sp, sp, 16
+    li a7, 93
+    ecall
@@ -0,0 +1,61 @@
+.section .text
+.globl _start
+_start:
+    # write(stdout, hello, 14)
+    li a0, 1
+    la a1, hello
+    li a2, 14
+    li a7, 64
+    ecall
+    # s0 = open("output.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644)
+    la a0, filename
+    li a1, 0x601
+    li a2, 0644
+    li a7, 1024
+    ecall
+    mv s0, a0
+    # write(s0, hello, 14)
+    mv a0, s0
+    la a1, hello
+    li a2, 14
+    li a7, 64
+    ecall
+    # close(s0)
+    mv a0, s0
+    li a7, 57
+    ecall
+    # s0 = open("output.txt", O_RDONLY)
+    la a0, filename
+    li a1, 0
+    li a7, 1024
+    ecall
+    mv s0, a0
+    # s1 = sbrk(64)
+    li a0, 0
+    li a7, 214
+    ecall
+    mv s1, a0
+    addi a0, s1, 64
+    li a7, 214
+    ecall
+    # s2 = read(s0, s1, 64)
+    mv a0, s0
+    mv a1, s1
+    li a2, 64
+    li a7, 63
+    ecall
+    mv s2, a0
+    # close(s0)
+    mv a0, s0
+    li a7, 57
+    ecall
+    # exit(s2)
+    mv a0, s2
+    li a7, 93
+    ecall
+
+.section .data
+hello:
+    .ascii "Hello, world!\n"
+filename:
+    .asciz "output.txt"
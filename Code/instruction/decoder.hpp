@@ -3,128 +3,77 @@
 
 #include "infra/common.hpp"
 #include "instruction.hpp"
-#include "rf/rf.hpp"
 
+// Extracts fields of raw instruction for format known at compile time,
+// so decoder of each opcode touches only fields it actually has.
+template <Instruction::Format format>
 class Decoder {
 private:
     using Format = Instruction::Format;
-    const Format format;
+    static_assert(format != Format::UNKNOWN, "Instruction format must be known");
 
-    const uint32 rd;
-    const uint32 rs1;
-    const uint32 rs2;
-    const uint32 I_imm;
-    const uint32 S_imm4_0;
-    const uint32 S_imm11_5;
-    const uint32 B_imm4_1;
-    const uint32 B_imm10_5;
-    const uint32 B_imm11;
-    const uint32 B_imm12;
-    const uint32 U_imm31_12;
-    const uint32 J_imm10_1;
-    const uint32 J_imm11;
-    const uint32 J_imm19_12;
-    const uint32 J_imm20;
-
-    uint32 get_I_immediate() const {
-        return I_imm;
+    static constexpr uint32 apply_mask(uint32 bytes, uint32 mask) {
+        // en.wikipedia.org/wiki/Find_first_set
+        return (bytes & mask) >> __builtin_ctz(mask);
     }
 
-    uint32 get_S_immediate() const {
-        return S_imm4_0
-            | (S_imm11_5 << 5);
+    static constexpr int32 sign_extend(int bits, uint32 x) {
+        uint32 m = 1u << (bits - 1);
+        return static_cast<int32>((x ^ m) - m);
     }
 
-    uint32 get_B_immediate() const {
-        return (B_imm4_1  << 1)
-            |  (B_imm10_5 << 5)
-            |  (B_imm11   << 11)
-            |  (B_imm12   << 12);
+    static constexpr uint32 get_I_immediate(uint32 raw) {
+        return apply_mask(raw, 0b11111111'11110000'00000000'00000000);
     }
 
-    uint32 get_U_immediate() const {
-        return (U_imm31_12 << 12);
+    static constexpr uint32 get_S_immediate(uint32 raw) {
+        return  apply_mask(raw, 0b00000000'00000000'00001111'10000000)
+             | (apply_mask(raw, 0b11111110'00000000'00000000'00000000) << 5);
     }
 
-    uint32 get_J_immediate() const {
-        return (J_imm10_1  << 1)
-            |  (J_imm11    << 11)
-            |  (J_imm19_12 << 12)
-            |  (J_imm20    << 20);
+    static constexpr uint32 get_B_immediate(uint32 raw) {
+        return (apply_mask(raw, 0b00000000'00000000'00001111'00000000) << 1)
+            |  (apply_mask(raw, 0b01111110'00000000'00000000'00000000) << 5)
+            |  (apply_mask(raw, 0b00000000'00000000'00000000'10000000) << 11)
+            |  (apply_mask(raw, 0b10000000'00000000'00000000'00000000) << 12);
     }
 
+    static constexpr uint32 get_U_immediate(uint32 raw) {
+        return raw & 0b11111111'11111111'11110000'00000000;
+    }
 
-    uint32 apply_mask(uint32 bytes, uint32 mask) const {
-        // en.wikipedia.org/wiki/Find_first_set
-        return (bytes & mask) >> __builtin_ctz(mask);
+    static constexpr uint32 get_J_immediate(uint32 raw) {
+        return (apply_mask(raw, 0b01111111'11100000'00000000'00000000) << 1)
+            |  (apply_mask(raw, 0b00000000'00010000'00000000'00000000) << 11)
+            |  (apply_mask(raw, 0b00000000'00001111'11110000'00000000) << 12)
+            |  (apply_mask(raw, 0b10000000'00000000'00000000'00000000) << 20);
     }
 
 public:
-    int32 get_immediate() const {
-        switch(format) {
-            case Format::R: return NO_VAL32;
-            case Format::I: return sign_extend(12, get_I_immediate());
-            case Format::S: return sign_extend(12, get_S_immediate());
-            case Format::B: return sign_extend(13, get_B_immediate());
-            case Format::U: return sign_extend(32, get_U_immediate());
-            case Format::J: return sign_extend(21, get_J_immediate());
-            default:        assert(0);
-        }
-    }
+    static constexpr bool has_rs1 = format != Format::U && format != Format::J;
+    static constexpr bool has_rs2 = format == Format::R || format == Format::S || format == Format::B;
+    static constexpr bool has_rd  = format != Format::S && format != Format::B;
 
-    Register get_rs1() const {
-        switch(format) {
-            case Format::R: return Register(rs1);
-            case Format::I: return Register(rs1);
-            case Format::S: return Register(rs1);
-            case Format::B: return Register(rs1);
-            case Format::U: return Register::zero();
-            case Format::J: return Register::zero();
-            default:        assert(0);
-        }
+    static constexpr uint8 get_rs1(uint32 raw) {
+        return has_rs1 ? apply_mask(raw, 0b00000000'00001111'10000000'00000000) : 0;
     }
 
-    Register get_rs2() const {
-        switch(format) {
-            case Format::R: return Register(rs2);
-            case Format::I: return Register::zero();
-            case Format::S: return Register(rs2);
-            case Format::B: return Register(rs2);
-            case Format::U: return Register::zero();
-            case Format::J: return Register::zero();
-            default:        assert(0);
-        }
+    static constexpr uint8 get_rs2(uint32 raw) {
+        return has_rs2 ? apply_mask(raw, 0b00000001'11110000'00000000'00000000) : 0;
     }
 
-    Register get_rd() const {
-        switch(format) {
-            case Format::R: return Register(rd);
-            case Format::I: return Register(rd);
-            case Format::S: return Register::zero();
-            case Format::B: return Register::zero();
-            case Format::U: return Register(rd);
-            case Format::J: return Register(rd);
-            default:        assert(0);
-        }
+    static constexpr uint8 get_rd(uint32 raw) {
+        return has_rd ? apply_mask(raw, 0b00000000'00000000'00001111'10000000) : 0;
     }
 
-    Decoder(uint32 raw, Format format) : format(format),
-        rd         (apply_mask(raw, 0b00000000'00000000'00001111'10000000)),
-        rs1        (apply_mask(raw, 0b00000000'00001111'10000000'00000000)),
-        rs2        (apply_mask(raw, 0b00000001'11110000'00000000'00000000)),
-        I_imm      (apply_mask(raw, 0b11111111'11110000'00000000'00000000)),
-        S_imm4_0   (apply_mask(raw, 0b00000000'00000000'00001111'10000000)),
-        S_imm11_5  (apply_mask(raw, 0b11111110'00000000'00000000'00000000)),
-        B_imm4_1   (apply_mask(raw, 0b00000000'00000000'00001111'00000000)),
-        B_imm10_5  (apply_mask(raw, 0b01111110'00000000'00000000'00000000)),
-        B_imm11    (apply_mask(raw, 0b00000000'00000000'00000000'10000000)),
-        B_imm12    (apply_mask(raw, 0b10000000'00000000'00000000'00000000)),
-        U_imm31_12 (apply_mask(raw, 0b11111111'11111111'11110000'00000000)),
-        J_imm10_1  (apply_mask(raw, 0b01111111'11100000'00000000'00000000)),
-        J_imm11    (apply_mask(raw, 0b00000000'00010000'00000000'00000000)),
-        J_imm19_12 (apply_mask(raw, 0b00000000'00001111'11110000'00000000)),
-        J_imm20    (apply_mask(raw, 0b10000000'00000000'00000000'00000000))
-    { }
+    static constexpr int32 get_immediate(uint32 raw) {
+        if constexpr (format == Format::I) return sign_extend(12, get_I_immediate(raw));
+        if constexpr (format == Format::S) return sign_extend(12, get_S_immediate(raw));
+        if constexpr (format == Format::B) return sign_extend(13, get_B_immediate(raw));
+        if constexpr (format == Format::U) return static_cast<int32>(get_U_immediate(raw));
+        if constexpr (format == Format::J) return sign_extend(21, get_J_immediate(raw));
+        return NO_VAL32;
+    }
 };
 
 #endif
@@ -1,38 +1,22 @@
-#include <sstream>
+#include <array>
+#include <iterator>
+#include <type_traits>
+#include <utility>
 
 #include "instruction.hpp"
 #include "decoder.hpp"
+#include "isa.hpp"
 #include "../rf/rf.hpp"
 
 using Format = Instruction::Format;
 using Type = Instruction::Type;
 
-// Contains fields which are generated by macro below
-struct ISAEntryGenerated {
-    std::string name;
-    uint32 match;
-    uint32 mask;
-    Instruction::Executor function;
-};
-
 #define DECLARE_INSN(name, match, mask) \
-static const ISAEntryGenerated ISA_entry_generated_ ## name = \
-{ #name, match, mask, &Instruction::execute_ ## name};
+static constexpr ISAEntryGenerated ISA_entry_generated_ ## name = \
+{ #name, match, mask, &Instruction::execute_ ## name, Instruction::OPCODE_ ## name };
 #include "opcodes.gen.hpp"
 #undef DECLARE_INSN
 
-// contains fields which are defined in the table below
-struct ISAEntry {
-    ISAEntryGenerated generated_entry;
-    Format format;
-    size_t memory_size;
-    Type type;
-
-    bool match(uint32 raw) const { 
-        return (raw & this->generated_entry.mask) == this->generated_entry.match;
-    }
-};
-
 
 // simple macro aliases
 #define I(name) \
@@ -45,7 +29,7 @@ Instruction::Format::format
 Instruction::Type::type
 
 // ISA table describing instructions
-static const std::vector<ISAEntry> ISA_table = {
+static constexpr ISAEntry ISA_table[] = {
 //   name       format  memsize     type
    { I(lui),     F(U),     0,    T(ARITHM) },
    { I(auipc),   F(U),     0,    T(ARITHM) },
@@ -84,11 +68,139 @@ static const std::vector<ISAEntry> ISA_table = {
    { I(or),      F(R),     0,    T(ARITHM) },
    { I(and),     F(R),     0,    T(ARITHM) },
    { I(sra),     F(R),     0,    T(ARITHM) },
-   { I(srl),     F(R),     0,    T(ARITHM) }
+   { I(srl),     F(R),     0,    T(ARITHM) },
+   { I(ecall),   F(I),     0,    T(SYSCALL) },
+   { I(ebreak),  F(I),     0,    T(SYSCALL) }
+};
+
+
+static constexpr size_t ISA_size = std::size(ISA_table);
+static_assert(ISA_size < 0xff, "ISA table doesn't fit 8-bit indices");
+
+static_assert(sizeof(Instruction) <= 32, "Instruction must stay compact");
+static_assert(std::is_trivially_copyable_v<Instruction>, "Instruction must be copied as plain bytes");
+
+static constexpr std::array<Instruction::Info, Instruction::OPCODE_UNKNOWN + 1> build_info_table() {
+    std::array<Instruction::Info, Instruction::OPCODE_UNKNOWN + 1> table{};
+    for (const auto& entry : ISA_table) {
+        auto& info = table[entry.generated_entry.opcode];
+        info.name        = entry.generated_entry.name;
+        info.function    = entry.generated_entry.function;
+        info.format      = entry.format;
+        info.type        = entry.type;
+        info.memory_size = static_cast<uint8>(entry.memory_size);
+    }
+    return table;
+}
+
+const std::array<Instruction::Info, Instruction::OPCODE_UNKNOWN + 1> Instruction::info_table = build_info_table();
+
+// Decoding is done with two-level table. First level is indexed
+// by major opcode and funct3 bits, slots shared by several
+// instructions refer to second level table indexed by funct7.
+// Both levels are built at compile time from MATCH/MASK values.
+struct DecodeSlot {
+    enum class Kind : uint8 {
+        NONE,    // no instruction matches
+        ENTRY,   // index of ISA table entry
+        FUNCT7,  // index of second level table
+        SCAN     // instructions differ in other bits, fall back to scan
+    };
+    Kind kind = Kind::NONE;
+    uint8 index = 0;
+};
+
+static constexpr uint32 FIRST_LEVEL_MASK  = 0x0000707c;  // opcode[6:2], funct3
+static constexpr uint32 SECOND_LEVEL_MASK = 0xfe00707c;  // + funct7
+
+static constexpr size_t get_first_level_index(uint32 raw) {
+    return (((raw >> 2) & 0x1f) << 3) | ((raw >> 12) & 0x7);
+}
+
+static constexpr size_t get_second_level_index(uint32 raw) {
+    return raw >> 25;
+}
+
+// raw bits which are selected by first level index
+static constexpr uint32 get_first_level_bits(size_t index) {
+    return static_cast<uint32>(((index >> 3) << 2) | ((index & 0x7) << 12));
+}
+
+static constexpr bool may_match(const ISAEntry& entry, uint32 bits, uint32 bits_mask) {
+    const auto& generated = entry.generated_entry;
+    return ((generated.match ^ bits) & generated.mask & bits_mask) == 0;
+}
+
+static constexpr size_t count_candidates(uint32 bits, uint32 bits_mask) {
+    size_t count = 0;
+    for (const auto& entry : ISA_table)
+        if (may_match(entry, bits, bits_mask))
+            ++count;
+    return count;
+}
+
+static constexpr size_t find_candidate(uint32 bits, uint32 bits_mask) {
+    for (size_t i = 0; i < ISA_size; ++i)
+        if (may_match(ISA_table[i], bits, bits_mask))
+            return i;
+    return ISA_size;
+}
+
+static constexpr size_t count_second_level_tables() {
+    size_t count = 0;
+    for (size_t i = 0; i < 256; ++i)
+        if (count_candidates(get_first_level_bits(i), FIRST_LEVEL_MASK) > 1)
+            ++count;
+    return count;
+}
+
+static constexpr size_t SECOND_LEVEL_TABLES = count_second_level_tables();
+
+struct DecodeTable {
+    std::array<DecodeSlot, 256> first_level;
+    std::array<std::array<DecodeSlot, 128>, SECOND_LEVEL_TABLES> second_level;
 };
 
+static constexpr DecodeSlot make_slot(uint32 bits, uint32 bits_mask) {
+    DecodeSlot slot;
+    switch (count_candidates(bits, bits_mask)) {
+        case 0:
+            slot.kind = DecodeSlot::Kind::NONE;
+            break;
+        case 1:
+            slot.kind = DecodeSlot::Kind::ENTRY;
+            slot.index = static_cast<uint8>(find_candidate(bits, bits_mask));
+            break;
+        default:
+            slot.kind = DecodeSlot::Kind::SCAN;
+    }
+    return slot;
+}
+
+static constexpr DecodeTable build_decode_table() {
+    DecodeTable table{};
+    size_t second_level_index = 0;
+
+    for (size_t i = 0; i < table.first_level.size(); ++i) {
+        const uint32 bits = get_first_level_bits(i);
+        auto& slot = table.first_level[i];
+        slot = make_slot(bits, FIRST_LEVEL_MASK);
+        if (slot.kind != DecodeSlot::Kind::SCAN)
+            continue;
+
+        slot.kind = DecodeSlot::Kind::FUNCT7;
+        slot.index = static_cast<uint8>(second_level_index);
+        auto& second_level = table.second_level[second_level_index++];
+        for (size_t j = 0; j < second_level.size(); ++j)
+            second_level[j] = make_slot(bits | static_cast<uint32>(j << 25), SECOND_LEVEL_MASK);
+    }
+    return table;
+}
+
+static constexpr DecodeTable decode_table = build_decode_table();
+
 
-const ISAEntry find_entry(uint32 raw) {
+const ISAEntry& find_entry_linear(uint32 raw) {
     for (const auto& x : ISA_table) {
         if (x.match(raw))
             return x;
@@ -96,82 +208,96 @@ const ISAEntry find_entry(uint32 raw) {
     throw std::invalid_argument("No entry found for given instruction");
 }
 
+const ISAEntry& find_entry(uint32 raw) {
+    DecodeSlot slot = decode_table.first_level[get_first_level_index(raw)];
+    if (slot.kind == DecodeSlot::Kind::FUNCT7)
+        slot = decode_table.second_level[slot.index][get_second_level_index(raw)];
+
+    switch (slot.kind) {
+        case DecodeSlot::Kind::ENTRY: {
+            // table checks only opcode, funct3 and funct7 bits
+            const auto& entry = ISA_table[slot.index];
+            if (entry.match(raw))
+                return entry;
+            break;
+        }
+        case DecodeSlot::Kind::SCAN:
+            return find_entry_linear(raw);
+        default:
+            break;
+    }
+    throw std::invalid_argument("No entry found for given instruction");
+}
 
-Instruction::Instruction(uint32 bytes, Addr PC) :
-    PC(PC),
-    new_PC(PC + 4)
-{
-    ISAEntry entry = find_entry(bytes);
 
-    this->name  = entry.generated_entry.name;
-    this->format = entry.format;
-    this->type = entry.type;
-    this->function  = entry.generated_entry.function;
-    this->memory_size = entry.memory_size;
+// Predecoders are instantiated for each ISA table entry, so
+// extraction of fields is specialized for format of its opcode
+// and decoding involves no checks of format at run time.
+using Predecoder = Instruction::Predecoded (*)(uint32 raw);
 
-    Decoder decoder(bytes, this->format);
-    this->rs1   = decoder.get_rs1();
-    this->rs2   = decoder.get_rs2();
-    this->rd    = decoder.get_rd();
-    this->imm_v = decoder.get_immediate();
+template <size_t index>
+static Instruction::Predecoded predecode_entry(uint32 raw) {
+    constexpr const ISAEntry& entry = ISA_table[index];
+    using EntryDecoder = Decoder<entry.format>;
+
+    Instruction::Predecoded predecoded;
+    predecoded.raw    = raw;
+    predecoded.opcode = entry.generated_entry.opcode;
+    predecoded.rs1    = EntryDecoder::get_rs1(raw);
+    predecoded.rs2    = EntryDecoder::get_rs2(raw);
+    predecoded.rd     = EntryDecoder::get_rd(raw);
+    predecoded.imm_v  = EntryDecoder::get_immediate(raw);
+    return predecoded;
+}
+
+template <size_t... indices>
+static constexpr std::array<Predecoder, ISA_size> build_predecoders(std::index_sequence<indices...>) {
+    return { &predecode_entry<indices>... };
 }
 
+static constexpr auto predecoders = build_predecoders(std::make_index_sequence<ISA_size>());
+
+Instruction::Predecoded Instruction::predecode(uint32 bytes) {
+    const ISAEntry& entry = find_entry(bytes);
+    return predecoders[&entry - ISA_table](bytes);
+}
+
+
+Instruction::Instruction(uint32 bytes, Addr PC) :
+    Instruction(predecode(bytes), PC)
+{ }
+
+
+Instruction::Instruction(const Predecoded& predecoded, Addr PC) :
+    PC(PC),
+    new_PC(PC + 4),
+    imm_v(predecoded.imm_v),
+    opcode(predecoded.opcode),
+    rs1(predecoded.rs1),
+    rs2(predecoded.rs2),
+    rd(predecoded.rd)
+{ }
+
 
 const std::string Instruction::get_disasm() const {
-    // might pretty-format in future but
-    // for debug stage this is perfect
-    std::ostringstream oss;
-    oss << this->name  << " ";
-    switch(this->format) {
+    const Info& info = this->get_info();
+    const std::string imm = std::to_string(this->imm_v);
+
+    std::string disasm = std::string(info.name) + " ";
+    switch(info.format) {
         case Format::R:
-            oss << this->rs1   << ", ";
-            oss << this->rs2   << ", ";
-            oss << this->rd;
-            break;
+            return disasm + get_rs1().get_name() + ", " + get_rs2().get_name() + ", " + get_rd().get_name();
         case Format::I:
-            oss << this->rs1   << ", ";
-            oss << this->rd    << ", ";
-            oss << std::hex << this->imm_v;
-            break;
+            return disasm + get_rs1().get_name() + ", " + get_rd().get_name()  + ", " + imm;
         case Format::S:
         case Format::B:
-            oss << this->rs1   << ", ";
-            oss << this->rs2   << ", ";
-            oss << std::hex << this->imm_v;
-            break;
+            return disasm + get_rs1().get_name() + ", " + get_rs2().get_name() + ", " + imm;
         case Format::U:
         case Format::J:
-            oss << this->rd    << ", ";
-            oss << std::hex << this->imm_v;
-            break;
+            return disasm + get_rd().get_name()  + ", " + imm;
+        case Format::UNKNOWN:
+            return info.name;
         default:
-            assert(0);
+            throw std::invalid_argument("Unknown instruction format");
     }
-    return oss.str();
-}
-
-Instruction::Instruction(const Instruction& other) :
-    PC(other.PC),
-    new_PC(other.new_PC),
-    complete(other.complete),
-    name(other.name),
-    format(other.format),
-    type(other.type),
-    rs1(other.rs1),
-    rs2(other.rs2),
-    rd(other.rd),
-    rs1_v(other.rs1_v),
-    rs2_v(other.rs2_v),
-    rd_v(other.rd_v),
-    imm_v(other.imm_v),
-    memory_addr(other.memory_addr),
-    memory_size(other.memory_size),
-    function(other.function)
-{}
-
-
-void Instruction::execute() {
-    (this->*function)();
-    this->complete = true;
 }
-
@@ -1,44 +1,67 @@
 #ifndef INSTRUCTION_H
 #define INSTRUCTION_H
 
+#include <array>
+
 #include "infra/common.hpp"
 #include "rf/register.hpp"
 
 class Instruction {
 public:
     // RISCV encoding format
-    enum class Format {
+    enum class Format : uint8 {
         R, I, S, B, U, J,
         UNKNOWN
     };
 
     // internal types
-    enum class Type {
+    enum class Type : uint8 {
         LOADU, LOAD, STORE,
         ARITHM,
         JUMP, BRANCH,
+        SYSCALL,
         UNKNOWN
     };
 
+    // index of instruction in generated opcodes list
+    enum Opcode : uint8 {
+#define DECLARE_INSN(name, match, mask) \
+OPCODE_ ## name,
+#include "opcodes.gen.hpp"
+#undef DECLARE_INSN
+        OPCODE_UNKNOWN
+    };
+
     // executor function type
     using Executor = void (Instruction::*)(void);
 
+    // properties shared by all instructions with the same opcode
+    struct Info {
+        const char* name = "unknown";
+        Executor function = &Instruction::execute_unknown;
+        Format format = Format::UNKNOWN;
+        Type type = Type::UNKNOWN;
+        uint8 memory_size = 0;
+    };
+
+    // PC-independent result of decoding raw bytes,
+    // allows to build instruction without decoder
+    struct Predecoded {
+        uint32 raw = NO_VAL32;
+        int32 imm_v = NO_VAL32;
+        Opcode opcode = OPCODE_UNKNOWN;
+        uint8 rs1 = 0;
+        uint8 rs2 = 0;
+        uint8 rd  = 0;
+    };
+
 private:
+    static const std::array<Info, OPCODE_UNKNOWN + 1> info_table;
+
     // PC
-    const Addr PC = NO_VAL32;
+    Addr PC = NO_VAL32;
     Addr new_PC = NO_VAL32;
 
-    // main info
-    bool complete = false;
-    std::string name = "unknown";
-    Format format = Format::UNKNOWN;
-    Type type = Type::UNKNOWN;
-
-    // registers
-    Register rs1 = Register::zero();
-    Register rs2 = Register::zero();
-    Register rd  = Register::zero();
-
     // registers values
     uint32 rs1_v = NO_VAL32;
     uint32 rs2_v = NO_VAL32;
@@ -49,25 +72,42 @@ private:
 
     // for loads/stores
     Addr memory_addr = NO_VAL32;
-    Size memory_size = NO_VAL32;
+
+    // main info, the rest is looked up by opcode
+    Opcode opcode = OPCODE_UNKNOWN;
+
+    // registers
+    uint8 rs1 = 0;
+    uint8 rs2 = 0;
+    uint8 rd  = 0;
+
+    const Info& get_info() const { return info_table[opcode]; }
 
 public:
     // constructors
     explicit Instruction(uint32 bytes, Addr PC);
-    Instruction(const Instruction& other);
+    explicit Instruction(const Predecoded& predecoded, Addr PC);
     Instruction() = delete;
 
+    static const Info& get_info(Opcode opcode) { return info_table[opcode]; }
+
     // dummy getters
-    const Register get_rs1 () const { return rs1; }
-    const Register get_rs2 () const { return rs2; }
-    const Register get_rd  () const { return rd; }
+    const Register get_rs1 () const { return Register(rs1); }
+    const Register get_rs2 () const { return Register(rs2); }
+    const Register get_rd  () const { return Register(rd); }
+
+    Opcode get_opcode() const { return opcode; }
+    Type get_type() const { return get_info().type; }
 
-    bool is_sign_extended_load () const { return type == Type::LOAD; }
-    bool is_zero_extended_load () const { return type == Type::LOADU; }
+    bool is_sign_extended_load () const { return get_type() == Type::LOAD; }
+    bool is_zero_extended_load () const { return get_type() == Type::LOADU; }
     bool is_load  () const { return is_sign_extended_load() || is_zero_extended_load(); }
-    bool is_store () const { return type == Type::STORE; }
-    bool is_jump () const { return (type == Type::JUMP); }
-    bool is_branch () const { return (type == Type::BRANCH); }
+    bool is_store () const { return get_type() == Type::STORE; }
+    bool is_jump () const { return (get_type() == Type::JUMP); }
+    bool is_branch () const { return (get_type() == Type::BRANCH); }
+    bool is_syscall () const { return (get_type() == Type::SYSCALL); }
+    // built from word which can't be decoded
+    bool is_illegal () const { return (get_type() == Type::UNKNOWN); }
     
     void set_rs1_v (uint32 value) { rs1_v = value; }
     void set_rs2_v (uint32 value) { rs2_v = value; }
@@ -82,22 +122,23 @@ public:
     Addr get_new_PC  () const { return new_PC; }
 
     Addr get_memory_addr() const { return memory_addr; }
-    Size get_memory_size() const { return memory_size; }
+    Size get_memory_size() const { return get_info().memory_size; }
 
-    // representation
-    const std::string get_name() const { return name; }
+    // representation, built on demand
+    const std::string get_name() const { return get_info().name; }
     const std::string get_disasm() const;
 
+    // decoding
+    static Predecoded predecode(uint32 bytes);
+
     // executors
-    void execute();
+    void execute() { (this->*get_info().function)(); }
     void execute_unknown();
 
 #define DECLARE_INSN(name, match, mask) \
 void execute_ ## name ();
 #include "opcodes.gen.hpp"
 #undef DECLARE_INSN
-
-    Executor function = &Instruction::execute_unknown;
 };
 
 #endif
@@ -0,0 +1,34 @@
+#ifndef ISA_H
+#define ISA_H
+
+#include "infra/common.hpp"
+#include "instruction.hpp"
+
+// Contains fields which are generated by DECLARE_INSN macro
+struct ISAEntryGenerated {
+    const char* name;
+    uint32 match;
+    uint32 mask;
+    Instruction::Executor function;
+    Instruction::Opcode opcode;
+};
+
+// contains fields which are defined in the ISA table
+struct ISAEntry {
+    ISAEntryGenerated generated_entry;
+    Instruction::Format format;
+    size_t memory_size;
+    Instruction::Type type;
+
+    constexpr bool match(uint32 raw) const {
+        return (raw & this->generated_entry.mask) == this->generated_entry.match;
+    }
+};
+
+// table-driven lookup, cost doesn't depend on ISA size
+const ISAEntry& find_entry(uint32 raw);
+
+// reference linear scan over the whole ISA table
+const ISAEntry& find_entry_linear(uint32 raw);
+
+#endif
@@ -1,21 +1,31 @@
 #include "infra/config/config.hpp"
+#include "infra/trace/trace.hpp"
 #include "perfsim/perfsim.hpp"
 #include "funcsim/funcsim.hpp"
 
 namespace config {
     static RequiredValue<std::string> binary   = { "binary,b",     "input binary file"             };
-    static RequiredValue<uint64>      n        = { "nsteps,n",     "number of instructions to run" };
+    static         Value<uint64>      n        = { "nsteps,n",     "number of steps to run, 0 to run until guest exits", 0 };
     static         Value<uint64>      func     = { "functional,f", "run in functional mode", false };
 }
 
 int main(int argc, char** argv) {
     config::parse_args(argc, argv);
+    trace::init();
     if (config::func) {
         FuncSim simulator(config::binary);
-        simulator.run(config::n);
+        if (config::n == 0)
+            simulator.run_until_exit();
+        else
+            simulator.run(config::n);
+        simulator.dump_statistics(std::cout);
+        return simulator.get_exit_code();
     } else {
         PerfSim simulator(config::binary);
-        simulator.run(config::n);
+        if (config::n == 0)
+            simulator.run_until_exit();
+        else
+            simulator.run(config::n);
+        return simulator.get_exit_code();
     }
-    return 0;
 }
@@ -0,0 +1,101 @@
+#include <iomanip>
+
+#include "dram.hpp"
+#include "infra/trace/trace.hpp"
+
+Dram::Config Dram::fixed_latency(Cycles latency) {
+    Config config;
+    config.banks = 1;
+    config.tRCD = 0;
+    config.tCAS = latency;
+    config.tRP = 0;
+    config.tREFI = 0;
+    // no row is kept open, so scheduler has no hits to reorder
+    config.open_page = false;
+    return config;
+}
+
+Dram::Dram(const Config& config)
+    : config(config)
+    , banks(config.channels * config.ranks * config.banks)
+    , next_refresh(config.channels * config.ranks, config.tREFI)
+{
+    if (config.channels == 0 || config.ranks == 0 || config.banks == 0 || config.row_size == 0)
+        throw std::invalid_argument("DRAM must have at least one channel, rank, bank and byte in row");
+    if (config.tCAS == 0)
+        throw std::invalid_argument("DRAM tCAS must be positive");
+}
+
+Dram::Location Dram::locate(Addr addr) const {
+    // consecutive rows go to different channels and banks
+    Addr index = addr / this->config.row_size;
+    Size channel = index % this->config.channels;
+    index /= this->config.channels;
+    Size bank = index % this->config.banks;
+    index /= this->config.banks;
+    Size rank = index % this->config.ranks;
+    Addr row = index / this->config.ranks;
+
+    Size global_rank = channel * this->config.ranks + rank;
+    return Location{ global_rank * this->config.banks + bank, global_rank, row };
+}
+
+void Dram::clock(uint64 cycle) {
+    if (this->config.tREFI == 0)
+        return;
+
+    for (Size rank = 0; rank < this->next_refresh.size(); ++rank) {
+        if (this->next_refresh[rank] > cycle)
+            continue;
+        for (Size i = 0; i < this->config.banks; ++i) {
+            auto& bank = this->banks[rank * this->config.banks + i];
+            bank.open_row = NO_VAL32;
+            bank.ready_cycle = std::max(bank.ready_cycle, cycle) + this->config.tRFC;
+        }
+        this->next_refresh[rank] += this->config.tREFI;
+        this->refreshes++;
+        TRACE(MEMORY, DETAILED, "refresh of rank " << rank << '\n');
+    }
+}
+
+Cycles Dram::access(Addr addr, uint64 cycle) {
+    const auto location = this->locate(addr);
+    auto& bank = this->banks[location.bank];
+    assert(bank.ready_cycle <= cycle);
+
+    Cycles row_commands = 0;
+    if (bank.open_row == location.row) {
+        bank.stats.hits++;
+    }
+    else if (bank.open_row == NO_VAL32) {
+        bank.stats.misses++;
+        row_commands = this->config.tRCD;
+    }
+    else {
+        bank.stats.conflicts++;
+        row_commands = this->config.tRP + this->config.tRCD;
+    }
+
+    if (this->config.open_page) {
+        bank.open_row = location.row;
+        bank.ready_cycle = cycle + row_commands;
+    }
+    else {
+        bank.open_row = NO_VAL32;
+        bank.ready_cycle = cycle + row_commands + this->config.tRP;
+    }
+    return row_commands + this->config.tCAS;
+}
+
+void Dram::dump_statistics(std::ostream& out) const {
+    out << "DRAM refreshes: " << this->refreshes << '\n';
+    for (Size i = 0; i < this->banks.size(); ++i) {
+        const auto& s = this->banks[i].stats;  // alias
+        uint64 total = s.hits + s.misses + s.conflicts;
+        if (total == 0)
+            continue;
+        out << "DRAM bank " << i << ": " << total << " accesses, row hit rate "
+            << std::setprecision(3) << 100.0 * s.hits / total << "%, "
+            << s.misses << " misses, " << s.conflicts << " conflicts\n";
+    }
+}
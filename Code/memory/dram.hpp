@@ -0,0 +1,78 @@
+#ifndef DRAM_H
+#define DRAM_H
+
+#include <iostream>
+#include <vector>
+
+#include "infra/common.hpp"
+
+// Timing of DRAM devices behind memory controller. Address is split
+// into column (within row), channel, bank, rank and row. Access to the
+// open row costs tCAS, to a closed bank tRCD + tCAS and to a bank
+// with another row open tRP + tRCD + tCAS. Row commands occupy bank,
+// column accesses are pipelined. Closed-page policy precharges bank
+// after every access. Each rank is refreshed every tREFI cycles
+// for tRFC cycles, refresh closes all rows of rank.
+class Dram {
+public:
+    struct Config {
+        Size channels = 1;
+        Size ranks = 1;
+        Size banks = 8;
+        Size row_size = 2048;  // bytes
+        Cycles tRCD = 11;
+        Cycles tCAS = 11;
+        Cycles tRP = 11;
+        Cycles tREFI = 7800;   // 0 disables refresh
+        Cycles tRFC = 260;
+        bool open_page = true;
+    };
+
+    // every access takes given latency, no bank conflicts or refresh
+    static Config fixed_latency(Cycles latency);
+
+    struct BankStats {
+        uint64 hits = 0;       // row was open
+        uint64 misses = 0;     // bank was precharged
+        uint64 conflicts = 0;  // other row was open
+    };
+
+private:
+    struct Bank {
+        Addr open_row = NO_VAL32;
+        uint64 ready_cycle = 0;  // row commands are done
+        BankStats stats;
+    };
+
+    Config config;
+    std::vector<Bank> banks;
+    std::vector<uint64> next_refresh;  // per rank
+    uint64 refreshes = 0;
+
+    struct Location {
+        Size bank;  // global index
+        Size rank;
+        Addr row;
+    };
+    Location locate(Addr addr) const;
+
+public:
+    explicit Dram(const Config& config);
+
+    // starts due refreshes
+    void clock(uint64 cycle);
+
+    bool is_ready(Addr addr, uint64 cycle) const { return banks[locate(addr).bank].ready_cycle <= cycle; }
+    bool is_row_hit(Addr addr) const {
+        auto location = locate(addr);
+        return banks[location.bank].open_row == location.row;
+    }
+
+    // bank must be ready, returns latency of access
+    Cycles access(Addr addr, uint64 cycle);
+
+    const BankStats& get_bank_stats(Size bank) const { return banks.at(bank).stats; }
+    void dump_statistics(std::ostream& out) const;
+};
+
+#endif
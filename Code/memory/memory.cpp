@@ -1,19 +1,181 @@
+#include <algorithm>
+#include <array>
+#include <cstddef>
+
 #include "memory.hpp"
+#include "infra/trace/trace.hpp"
 #include "infra/elf/elf.hpp"
 
 
-Memory::Memory(std::vector<uint8> data) :
-    data(std::move(data))
-{ 
-    this->data.resize(100000, 0);
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "TLB fast path accesses little-endian guest memory in host byte order");
+
+// backs TLB entries of pages which were never written
+alignas(Memory::PAGE_SIZE) static const std::array<uint8, Memory::PAGE_SIZE> zero_page = {};
+
+Memory::Memory(const std::vector<uint8>& image) {
+    for (size_t offset = 0; offset < image.size(); offset += PAGE_SIZE) {
+        auto begin = image.begin() + offset;
+        auto end = image.begin() + std::min(offset + PAGE_SIZE, image.size());
+        if (std::any_of(begin, end, [](uint8 byte) { return byte != 0; }))
+            std::copy(begin, end, this->get_page(static_cast<Addr>(offset)));
+    }
 }
 
 
-uint32 Memory::read(Addr addr, size_t num_bytes) const {
-    if (addr + num_bytes > this->data.size()){
-        std::cout << "ADDR" << std::dec << addr+num_bytes << " " << std::endl;
-        throw std::invalid_argument("Exceeded memory size");
+Memory::Table::Table(const Table& other)
+    : pages(other.pages)
+    , mapped(other.mapped)
+    , mappings(other.mappings)
+{
+    static_assert(offsetof(Page, bytes) == 0, "Page is found by pointer to its bytes");
+    for (size_t i = 0; i < this->pages.size(); ++i)
+        if (this->pages[i] != nullptr && !this->mapped[i])
+            Page::of(this->pages[i])->references.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+Memory::Table::~Table() {
+    for (size_t i = 0; i < this->pages.size(); ++i)
+        if (this->pages[i] != nullptr && !this->mapped[i])
+            Page::release(this->pages[i]);
+}
+
+
+Memory::Table& Memory::get_table(Addr addr) {
+    // use count of one means nobody else can see the object
+    if (this->directory.use_count() > 1)
+        this->directory = std::make_shared<Directory>(*this->directory);
+
+    auto& table = this->directory->tables[addr >> (TABLE_BITS + PAGE_BITS)];
+    if (table == nullptr) {
+        table = std::make_shared<Table>();
+        this->directory->num_tables++;
+    }
+    else if (table.use_count() > 1) {
+        // copy shares every page with the original
+        table = std::make_shared<Table>(*table);
+    }
+    return *table;
+}
+
+
+uint8* Memory::get_page(Addr addr) {
+    auto& table = this->get_table(addr);
+    auto index = get_table_index(addr);
+    if (table.is_exclusive(index))
+        return table.pages[index];
+
+    auto& page = table.pages[index];
+    auto* copy = new Page();
+    if (page != nullptr)
+        std::copy_n(page, PAGE_SIZE, copy->bytes.data());
+    if (page == nullptr || table.mapped[index])
+        this->directory->resident_pages++;
+    if (table.mapped[index]) {
+        table.mapped.reset(index);
+        this->directory->mapped_pages--;
+    }
+    else if (page != nullptr) {
+        Page::release(page);
+    }
+    page = copy->bytes.data();
+
+    // reads of the page might be mapped to zero or shared page
+    auto& entry = this->tlb.read[get_tlb_index(addr)];
+    if (entry.tag == (addr & ~(PAGE_SIZE - 1)))
+        entry.tag = NO_VAL32;
+    TRACE(MEMORY, DETAILED, "new page 0x" << std::hex << (addr & ~(PAGE_SIZE - 1)) << std::dec
+                            << ", resident " << this->get_resident_pages() << " pages\n");
+    return page;
+}
+
+
+void Memory::flush_tlb() const {
+    for (auto& entry : this->tlb.read)
+        entry.tag = NO_VAL32;
+    for (auto& entry : this->tlb.write)
+        entry.tag = NO_VAL32;
+}
+
+
+void Memory::map_shared(Addr addr, const uint8* host, size_t num_bytes,
+                        std::shared_ptr<const void> owner)
+{
+    if (get_page_offset(addr) != 0 || num_bytes % PAGE_SIZE != 0
+        || reinterpret_cast<uintptr_t>(host) % PAGE_SIZE != 0)
+        throw std::invalid_argument("Shared mapping must be page aligned");
+    check_range(addr, num_bytes);
+
+    for (size_t offset = 0; offset < num_bytes; offset += PAGE_SIZE) {
+        Addr page_addr = addr + static_cast<Addr>(offset);
+        auto& table = this->get_table(page_addr);
+        auto index = get_table_index(page_addr);
+        if (table.pages[index] != nullptr && !table.mapped[index]) {
+            Page::release(table.pages[index]);
+            this->directory->resident_pages--;
+        }
+        if (!table.mapped[index])
+            this->directory->mapped_pages++;
+        // host page is never written, writes copy it first
+        table.pages[index] = const_cast<uint8*>(host + offset);
+        table.mapped.set(index);
+        if (table.mappings.empty() || table.mappings.back() != owner)
+            table.mappings.push_back(owner);
+    }
+    this->flush_tlb();
+}
+
+
+Memory::Snapshot Memory::snapshot() const {
+    // pages written through TLB become shared
+    for (auto& entry : this->tlb.write)
+        entry.tag = NO_VAL32;
+    Snapshot snapshot;
+    snapshot.directory = this->directory;
+    return snapshot;
+}
+
+
+void Memory::restore(const Snapshot& snapshot) {
+    if (snapshot.directory == nullptr)
+        throw std::invalid_argument("Restoring from empty memory snapshot");
+    // snapshot is never modified, memory copies directory on write
+    this->directory = std::const_pointer_cast<Directory>(snapshot.directory);
+    this->flush_tlb();
+}
+
+
+std::vector<Addr> Memory::diff(const Snapshot& snapshot) const {
+    if (snapshot.directory == nullptr)
+        throw std::invalid_argument("Comparing with empty memory snapshot");
+
+    std::vector<Addr> pages;
+    const auto& ours = this->directory->tables;
+    const auto& theirs = snapshot.directory->tables;
+    for (size_t i = 0; i < ours.size(); ++i) {
+        // tables stay shared until one of sides writes them
+        if (ours[i] == theirs[i])
+            continue;
+        for (size_t j = 0; j < (1u << TABLE_BITS); ++j) {
+            const uint8* a = ours[i] == nullptr ? nullptr : ours[i]->pages[j];
+            const uint8* b = theirs[i] == nullptr ? nullptr : theirs[i]->pages[j];
+            if (a == b)
+                continue;
+            if (std::memcmp(a == nullptr ? zero_page.data() : a,
+                            b == nullptr ? zero_page.data() : b, PAGE_SIZE) != 0)
+                pages.push_back(static_cast<Addr>((i << (TABLE_BITS + PAGE_BITS)) | (j << PAGE_BITS)));
+        }
     }
+    return pages;
+}
+
+
+uint32 Memory::read(Addr addr, size_t num_bytes) const {
+    check_range(addr, num_bytes);
+    const uint8* page = this->find_page(addr);
+    fill_tlb(this->tlb.read[get_tlb_index(addr)], addr, page == nullptr ? zero_page.data() : page);
+
     uint32 value = 0;
     for (uint i = 0; i < num_bytes; ++i) {
         uint8 byte = this->read_byte(addr + i);
@@ -25,77 +187,200 @@ uint32 Memory::read(Addr addr, size_t num_bytes) const {
 
 
 void Memory::write(uint32 value, Addr addr, size_t num_bytes) {
-    if (addr + num_bytes > this->data.size())
-        throw std::invalid_argument("Exceeded memory size");
-
+    check_range(addr, num_bytes);
     for (uint i = 0; i < num_bytes; ++i) {
-        uint8 byte = static_cast<uint8>(value >> 8*i); 
+        uint8 byte = static_cast<uint8>(value >> 8*i);
         this->write_byte(byte, addr + i);
     }
+    fill_tlb(this->tlb.write[get_tlb_index(addr)], addr, this->get_page(addr));
 }
 
-void PerfMemory::process() {
-    auto& r = this->request;  // alias
 
-    assert(!r.complete);
-
-    if (r.cycles_left_to_complete == 0) {
-        if (r.is_read)
-            r.data = this->read(r.addr, r.num_bytes);
+void Memory::read_bytes(uint8* dst, Addr addr, size_t num_bytes) const {
+    check_range(addr, num_bytes);
+    while (num_bytes != 0) {
+        size_t chunk = std::min<size_t>(num_bytes, PAGE_SIZE - get_page_offset(addr));
+        const uint8* page = this->find_page(addr);
+        if (page == nullptr)
+            std::fill_n(dst, chunk, 0);
         else
-            this->write(r.data, r.addr, r.num_bytes);
+            std::copy_n(page + get_page_offset(addr), chunk, dst);
+        dst += chunk;
+        addr += static_cast<Addr>(chunk);
+        num_bytes -= chunk;
+    }
+}
 
-        r.complete = true;
-        this->request_result.is_ready = true;
-        this->request_result.data = r.data;
+
+void Memory::write_bytes(const uint8* src, Addr addr, size_t num_bytes) {
+    check_range(addr, num_bytes);
+    while (num_bytes != 0) {
+        size_t chunk = std::min<size_t>(num_bytes, PAGE_SIZE - get_page_offset(addr));
+        std::copy_n(src, chunk, this->get_page(addr) + get_page_offset(addr));
+        src += chunk;
+        addr += static_cast<Addr>(chunk);
+        num_bytes -= chunk;
     }
 }
 
-void PerfMemory::send_read_request(Addr addr, size_t num_bytes) {
-    auto& r = this->request;  // alias
+PerfMemory::PerfMemory(const std::vector<uint8>& image, const Config& config)
+    : Memory(image)
+    , config(config)
+{
+    if (config.latency == 0 || config.read_queue_size == 0 || config.write_queue_size == 0
+        || config.max_outstanding == 0 || config.issue_width == 0 || config.burst_length == 0)
+        throw std::invalid_argument("Memory latency, queue sizes, bandwidth and burst length must be positive");
+    if (config.bus_width == 0 || config.bus_width > 64)
+        throw std::invalid_argument("Memory bus width must be from 1 to 64 bytes");
+    if (config.dram)
+        this->dram = std::make_unique<Dram>(*config.dram);
+}
+
+static PerfMemory::Config latency_config(Cycles latency_in_cycles) {
+    PerfMemory::Config config;
+    config.latency = latency_in_cycles;
+    return config;
+}
 
-    if (!r.complete)
-        throw std::invalid_argument("Cannot send second request!");
-    if (num_bytes > 2)
-        throw std::invalid_argument("Memory can't handle > 2 bytes per request");
+PerfMemory::PerfMemory(const std::vector<uint8>& image, Cycles latency_in_cycles)
+    : PerfMemory(image, latency_config(latency_in_cycles))
+{ }
 
-    r.is_read = true;
-    r.complete = false;
-    r.cycles_left_to_complete = this->latency_in_cycles;
-    r.num_bytes = num_bytes;
+PerfMemory::PerfMemory(const Config& config)
+    : PerfMemory(std::vector<uint8>(), config)
+{ }
+
+PerfMemory::RequestId PerfMemory::enqueue(bool is_read, uint32 data, Addr addr, Size num_bytes) {
+    if (!this->can_accept(is_read))
+        throw std::invalid_argument(is_read ? "Memory read queue is full" : "Memory write queue is full");
+    if (num_bytes == 0 || num_bytes > this->get_max_transfer())
+        throw std::invalid_argument("Memory request exceeds burst of " + std::to_string(this->get_max_transfer()) + " bytes");
+
+    Request r;
+    r.id = this->next_id++;
+    r.is_read = is_read;
+    r.data = data;
     r.addr = addr;
-    r.data = NO_VAL32;
+    r.num_bytes = num_bytes;
+    r.beats = (num_bytes + this->config.bus_width - 1) / this->config.bus_width;
+    (is_read ? this->read_queue : this->write_queue).push_back(r);
+    return r.id;
 }
 
-void PerfMemory::send_write_request(uint32 value, Addr addr, size_t num_bytes) {
-    auto& r = this->request;  // alias
+PerfMemory::RequestId PerfMemory::send_read_request(Addr addr, size_t num_bytes) {
+    if (num_bytes > 4)
+        throw std::invalid_argument("Memory result can't hold > 4 bytes");
+    check_range(addr, num_bytes);
+    return this->enqueue(true, this->read(addr, num_bytes), addr, num_bytes);
+}
 
-    if (!r.complete)
-        throw std::invalid_argument("Cannot send second request!");
-    if (num_bytes > 2)
-        throw std::invalid_argument("Memory can't handle > 2 bytes per request");
+PerfMemory::RequestId PerfMemory::send_write_request(uint32 value, Addr addr, size_t num_bytes) {
+    if (num_bytes > 4)
+        throw std::invalid_argument("Memory result can't hold > 4 bytes");
+    check_range(addr, num_bytes);
+    auto id = this->enqueue(false, value, addr, num_bytes);
+    this->write(value, addr, num_bytes);
+    return id;
+}
 
-    r.is_read = false;
-    r.complete = false;
-    r.cycles_left_to_complete = this->latency_in_cycles;
-    r.num_bytes = num_bytes;
-    r.addr = addr;
-    r.data = value;
+PerfMemory::RequestId PerfMemory::send_read_request(uint8* dst, Addr addr, size_t num_bytes) {
+    check_range(addr, num_bytes);
+    auto id = this->enqueue(true, NO_VAL32, addr, num_bytes);
+    this->read_bytes(dst, addr, num_bytes);
+    return id;
+}
+
+PerfMemory::RequestId PerfMemory::send_write_request(const uint8* src, Addr addr, size_t num_bytes) {
+    check_range(addr, num_bytes);
+    auto id = this->enqueue(false, NO_VAL32, addr, num_bytes);
+    this->write_bytes(src, addr, num_bytes);
+    return id;
+}
+
+std::deque<PerfMemory::Request>::iterator PerfMemory::schedule(std::deque<Request>& queue) {
+    if (this->dram == nullptr)
+        return queue.begin();
+
+    const uint64 cycle = this->stats.cycles;
+    auto oldest_ready = queue.end();
+    for (auto it = queue.begin(); it != queue.end(); ++it) {
+        if (!this->dram->is_ready(it->addr, cycle))
+            continue;
+        if (this->dram->is_row_hit(it->addr))
+            return it;
+        if (oldest_ready == queue.end())
+            oldest_ready = it;
+    }
+    return oldest_ready;
+}
+
+void PerfMemory::issue() {
+    for (Size i = 0; i < this->config.issue_width; ++i) {
+        if (this->in_flight.size() == this->config.max_outstanding)
+            return;
+
+        // reads are on critical path, writes are drained when their queue fills up
+        bool drain_writes = this->write_queue.size() == this->config.write_queue_size;
+        auto& queue = (this->read_queue.empty() || drain_writes) ? this->write_queue : this->read_queue;
+        auto it = this->schedule(queue);
+        if (it == queue.end())
+            return;
+
+        auto r = *it;
+        queue.erase(it);
+        r.cycles_left_to_complete = this->dram == nullptr
+            ? this->config.latency
+            : this->dram->access(r.addr, this->stats.cycles);
+        r.cycles_left_to_complete += (r.beats - 1) * this->config.beat_cycles;
+        this->in_flight.push_back(r);
+        TRACE(MEMORY, DETAILED, "issued " << (r.is_read ? "read" : "write") << " request " << r.id
+                                << " for " << r.cycles_left_to_complete << " cycles\n");
+    }
 }
 
 void PerfMemory::clock() {
-    this->request_result.is_ready = false;
-    this->request_result.data = NO_VAL32;
-    
-    auto& r = this->request;  // alias
+    this->completed.clear();
 
-    if (r.complete) {
-        assert (r.cycles_left_to_complete == 0);
-        return;
+    auto& s = this->stats;  // alias
+    s.cycles++;
+    s.read_queue_occupancy += this->read_queue.size();
+    s.write_queue_occupancy += this->write_queue.size();
+
+    if (this->dram != nullptr)
+        this->dram->clock(s.cycles);
+    this->issue();
+    s.in_flight_occupancy += this->in_flight.size();
+
+    for (auto it = this->in_flight.begin(); it != this->in_flight.end(); ) {
+        if (--it->cycles_left_to_complete != 0) {
+            ++it;
+            continue;
+        }
+        (it->is_read ? s.reads : s.writes)++;
+        s.bytes += it->num_bytes;
+        s.beats += it->beats;
+        this->completed.emplace_back(it->id, it->is_read ? it->data : NO_VAL32);
+        it = this->in_flight.erase(it);
     }
+}
 
-    assert (r.cycles_left_to_complete > 0);
-    r.cycles_left_to_complete -= 1;
-    
-    this->process();
-}
\ No newline at end of file
+PerfMemory::RequestResult PerfMemory::get_request_status(RequestId id) const {
+    for (const auto& [completed_id, data] : this->completed)
+        if (completed_id == id)
+            return RequestResult{ true, data };
+    return RequestResult{};
+}
+
+void PerfMemory::dump_statistics(std::ostream& out) const {
+    const auto& s = this->stats;  // alias
+    if (s.cycles == 0)
+        return;
+    out << "Memory requests: " << s.reads << " reads, " << s.writes << " writes\n"
+        << "Memory bandwidth: " << static_cast<double>(s.bytes) / s.cycles << " bytes/cycle, "
+        << 100.0 * s.beats * this->config.beat_cycles / s.cycles << "% of bus cycles\n"
+        << "Memory occupancy: " << static_cast<double>(s.read_queue_occupancy) / s.cycles << " read queue, "
+        << static_cast<double>(s.write_queue_occupancy) / s.cycles << " write queue, "
+        << static_cast<double>(s.in_flight_occupancy) / s.cycles << " in flight\n";
+    if (this->dram != nullptr)
+        this->dram->dump_statistics(out);
+}
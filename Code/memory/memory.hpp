@@ -1,95 +1,369 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
 #include "infra/common.hpp"
 #include "instruction/instruction.hpp"
+#include "memory/dram.hpp"
+#include "memory/profiler.hpp"
+#include "memory/reuse.hpp"
+#include "port/port.hpp"
 
+// Sparse guest memory covering the whole 32-bit address space.
+// Pages are allocated on the first write, reads of untouched memory
+// return zeros. Page is found with two-level radix walk: directory
+// indexed by upper address bits points to tables of page pointers.
+// Recently used pages are cached in direct-mapped software TLBs,
+// separate for reads and writes.
+//
+// Directory, tables and pages are reference counted and copied
+// on write, so snapshots take O(1) and share all pages with memory
+// until one of them is modified. Host pages owned elsewhere
+// (e.g. mapped ELF file) are mapped the same way.
 class Memory {
+public:
+    static const Size PAGE_BITS = 12;
+    static const Size PAGE_SIZE = 1u << PAGE_BITS;
+    static const Size TABLE_BITS = 10;
+    static const Size DIRECTORY_BITS = 32 - TABLE_BITS - PAGE_BITS;
+    static const Size TLB_BITS = 8;
+    static const Size TLB_SIZE = 1u << TLB_BITS;
+
+    // Tag is guest page address, host byte of guest address is
+    // at host_offset + address. Invalid tag has bits set in page
+    // offset, so it mismatches any aligned access.
+    struct TlbEntry {
+        Addr tag = NO_VAL32;
+        uintptr_t host_offset = 0;
+    };
+
+    struct Tlb {
+        std::array<TlbEntry, TLB_SIZE> read;
+        std::array<TlbEntry, TLB_SIZE> write;
+    };
+
 private:
-    std::vector<uint8> data;
+    // pages are shared by copies of tables, so they count references
+    struct Page {
+        std::array<uint8, PAGE_SIZE> bytes = {};
+        std::atomic<uint32> references{ 1 };
+
+        static Page* of(uint8* bytes) { return reinterpret_cast<Page*>(bytes); }
+        static void release(uint8* bytes) {
+            Page* page = of(bytes);
+            if (page->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                delete page;
+        }
+    };
+
+    // pointers to host pages, nullptr for untouched ones
+    struct Table {
+        std::array<uint8*, 1u << TABLE_BITS> pages = {};
+        std::bitset<1u << TABLE_BITS> mapped;  // page belongs to host mapping
+        std::vector<std::shared_ptr<const void>> mappings;  // keep mapped pages alive
+
+        Table() = default;
+        Table(const Table& other);
+        Table& operator=(const Table&) = delete;
+        ~Table();
+
+        // page can be written in place if nobody else refers to it
+        bool is_exclusive(Size index) const {
+            return this->pages[index] != nullptr && !this->mapped[index]
+                && Page::of(this->pages[index])->references.load(std::memory_order_acquire) == 1;
+        }
+    };
+
+    struct Directory {
+        std::array<std::shared_ptr<Table>, 1u << DIRECTORY_BITS> tables;
+        Size num_tables = 0;
+        Size resident_pages = 0;  // pages allocated by memory
+        Size mapped_pages = 0;
+    };
+
+public:
+    // immutable state of memory, copies are cheap
+    class Snapshot {
+        friend class Memory;
+        std::shared_ptr<const Directory> directory;
+    public:
+        Snapshot() = default;
+    };
+
+private:
+    std::shared_ptr<Directory> directory = std::make_shared<Directory>();
+
+    mutable Tlb tlb;
+
+    static Size get_page_offset(Addr addr) { return addr & (PAGE_SIZE - 1); }
+    static Size get_table_index(Addr addr) { return (addr >> PAGE_BITS) & ((1u << TABLE_BITS) - 1); }
+    static Size get_tlb_index(Addr addr) { return (addr >> PAGE_BITS) & (TLB_SIZE - 1); }
+
+    // keeps low bits of misaligned address, so they fail tag compare
+    template <size_t num_bytes>
+    static Addr get_tlb_tag(Addr addr) { return addr & (~(PAGE_SIZE - 1) | (num_bytes - 1)); }
+
+    template <size_t num_bytes>
+    using Word = std::conditional_t<num_bytes == 1, uint8, std::conditional_t<num_bytes == 2, uint16, uint32>>;
+
+    static void fill_tlb(TlbEntry& entry, Addr addr, const uint8* page) {
+        entry.tag = addr & ~(PAGE_SIZE - 1);
+        entry.host_offset = reinterpret_cast<uintptr_t>(page) - entry.tag;
+    }
+
+    static const uint8* find_page(const Directory& directory, Addr addr) {
+        const Table* table = directory.tables[addr >> (TABLE_BITS + PAGE_BITS)].get();
+        if (table == nullptr)
+            return nullptr;
+        return table->pages[get_table_index(addr)];
+    }
+
+    const uint8* find_page(Addr addr) const { return find_page(*this->directory, addr); }
+
+    // copies directory and table if they are shared
+    Table& get_table(Addr addr);
+    // allocates page or copies shared one
+    uint8* get_page(Addr addr);
+    void flush_tlb() const;
 
     uint8 read_byte(Addr addr) const {
-        return this->data[addr];
+        const uint8* page = this->find_page(addr);
+        return page == nullptr ? 0 : page[get_page_offset(addr)];
     }
 
     void write_byte(uint8 value, Addr addr) {
-        this->data[addr] = value;
+        this->get_page(addr)[get_page_offset(addr)] = value;
+    }
+
+protected:
+    static void check_range(Addr addr, size_t num_bytes) {
+        if (static_cast<uint64>(addr) + num_bytes > (1ull << 32))
+            throw std::invalid_argument("Exceeded memory size");
     }
-    
+
 public:
+    // slow path, refills TLB
     uint32 read(Addr addr, size_t num_bytes) const;
     void write(uint32 value, Addr addr, size_t num_bytes);
 
+    // aligned accesses hitting TLB take a single compare
+    // and a host-endian access
+    template <size_t num_bytes>
+    uint32 read(Addr addr) const {
+        const auto& entry = this->tlb.read[get_tlb_index(addr)];
+        if (get_tlb_tag<num_bytes>(addr) != entry.tag)
+            return this->read(addr, num_bytes);
+        Word<num_bytes> value;
+        std::memcpy(&value, reinterpret_cast<const uint8*>(entry.host_offset + addr), num_bytes);
+        return value;
+    }
+
+    template <size_t num_bytes>
+    void write(uint32 value, Addr addr) {
+        const auto& entry = this->tlb.write[get_tlb_index(addr)];
+        if (get_tlb_tag<num_bytes>(addr) != entry.tag) {
+            this->write(value, addr, num_bytes);
+            return;
+        }
+        auto word = static_cast<Word<num_bytes>>(value);
+        std::memcpy(reinterpret_cast<uint8*>(entry.host_offset + addr), &word, num_bytes);
+    }
+
+    // bulk copies between host and guest memory
+    void read_bytes(uint8* dst, Addr addr, size_t num_bytes) const;
+    void write_bytes(const uint8* src, Addr addr, size_t num_bytes);
+
+    // maps num_bytes of host memory at guest address read-only,
+    // both addresses must be page aligned; owner keeps host memory alive
+    void map_shared(Addr addr, const uint8* host, size_t num_bytes,
+                    std::shared_ptr<const void> owner);
+
+    // O(1), pages become shared and are copied on the next write
+    Snapshot snapshot() const;
+    void restore(const Snapshot& snapshot);
+    // addresses of pages which contents differ from snapshot
+    std::vector<Addr> diff(const Snapshot& snapshot) const;
+
 public:
-    Memory(std::vector<uint8> data);
-    Addr get_stack_pointer() const { return (data.size() - 1) & ~(32 - 1); }
+    Memory() = default;
+    // image is placed at address 0, its zero pages are not allocated
+    Memory(const std::vector<uint8>& image);
+    Memory(const Memory&) = delete;
+    Memory& operator=(const Memory&) = delete;
+
+    Addr get_stack_pointer() const { return 0x7fffffe0; }
+
+    // host page holding given address, nullptr if it was never written
+    const uint8* get_host_page(Addr addr) const { return find_page(addr); }
+    // allocates or copies page if needed
+    uint8* get_writable_host_page(Addr addr) { return get_page(addr); }
+
+    // direct access for translated code
+    const Tlb& get_tlb() const { return tlb; }
+
+    // host memory occupied by guest pages and page tables, pages shared
+    // with snapshots are counted, pages of host mappings are not
+    Size get_resident_pages() const { return directory->resident_pages; }
+    Size get_shared_pages() const { return directory->mapped_pages; }
+    uint64 get_resident_size() const {
+        return sizeof(Directory)
+            + directory->num_tables * sizeof(Table)
+            + directory->resident_pages * static_cast<uint64>(PAGE_SIZE);
+    }
 };
 
 
 class FuncMemory : public Memory {
 private:
+    AccessProfiler* profiler = nullptr;
+    ReuseDistance* reuse_distance = nullptr;
+
     void load(Instruction& instr) const {
-        uint32 value = this->read(instr.get_memory_addr(), instr.get_memory_size());
-        instr.set_rd_v(value);
+        Addr addr = instr.get_memory_addr();
+        switch (instr.get_memory_size()) {
+            case 1:  instr.set_rd_v(this->read<1>(addr)); break;
+            case 2:  instr.set_rd_v(this->read<2>(addr)); break;
+            default: instr.set_rd_v(this->read<4>(addr)); break;
+        }
     }
 
     void store(const Instruction& instr) {
-        this->write(instr.get_rs2_v(), instr.get_memory_addr(), instr.get_memory_size());
-    }     
+        Addr addr = instr.get_memory_addr();
+        switch (instr.get_memory_size()) {
+            case 1:  this->write<1>(instr.get_rs2_v(), addr); break;
+            case 2:  this->write<2>(instr.get_rs2_v(), addr); break;
+            default: this->write<4>(instr.get_rs2_v(), addr); break;
+        }
+    }
 
 public:
-    FuncMemory(std::vector<uint8> data) : Memory(data) { }
+    FuncMemory() = default;
+    FuncMemory(const std::vector<uint8>& image) : Memory(image) { }
 
-    uint32 read_word(Addr addr) { return this->read(addr, 4); }
+    uint32 read_word(Addr addr) { return this->read<4>(addr); }
     void load_store(Instruction& instr) {
         if (instr.is_load())
             this->load(instr);
         else if (instr.is_store())
             this->store(instr);
+        else
+            return;
+        this->record(instr.is_load(), instr.get_memory_addr());
     }
+
+    // passes access to collectors, used by engines accessing memory directly
+    void record(bool is_load, Addr addr) {
+        if (this->profiler != nullptr)
+            this->profiler->record(is_load ? AccessProfiler::Access::LOAD : AccessProfiler::Access::STORE, addr);
+        if (this->reuse_distance != nullptr)
+            this->reuse_distance->access(addr);
+    }
+
+    // loads and stores are recorded by collectors, nullptr disables them
+    void set_profiler(AccessProfiler* value) { profiler = value; }
+    void set_reuse_distance(ReuseDistance* value) { reuse_distance = value; }
 };
 
 
-class PerfMemory : public Memory {
+// Memory controller with read and write queues and a number
+// of requests in flight. Data is accessed when request is accepted,
+// so completion order affects only timing. Each cycle up to issue_width
+// queued requests start if there is a free slot, reads go first unless
+// write queue is full. Result is ready for one cycle after completion.
+// Request moves up to burst_length beats of bus_width bytes, its first
+// beat takes fixed latency or is timed by optional DRAM model, each next
+// beat takes beat_cycles. With DRAM
+// the oldest row hit to a ready bank is started first (FR-FCFS),
+// otherwise the oldest request to a ready bank.
+class PerfMemory : public Memory, public MemoryPort {
 public:
-    struct RequestResult {
-        bool is_ready = false;
-        uint32 data = NO_VAL32;
+    struct Config {
+        Cycles latency = 3;
+        Size read_queue_size = 1;
+        Size write_queue_size = 1;
+        Size max_outstanding = 1;  // requests in flight
+        Size issue_width = 1;      // requests started per cycle
+        Size bus_width = 8;        // bytes per beat
+        Size burst_length = 8;     // beats per request
+        Cycles beat_cycles = 1;
+        std::optional<Dram::Config> dram;  // fixed latency if empty
+    };
+
+    struct Stats {
+        uint64 cycles = 0;
+        uint64 reads = 0;
+        uint64 writes = 0;
+        uint64 bytes = 0;
+        uint64 beats = 0;
+        // sums of occupancies over cycles
+        uint64 read_queue_occupancy = 0;
+        uint64 write_queue_occupancy = 0;
+        uint64 in_flight_occupancy = 0;
     };
 
 private:
-    // read/write request to memory
     struct Request {
-        bool complete = true;
+        RequestId id = 0;
         bool is_read = false;
-        Addr addr = NO_VAL32;
         uint32 data = NO_VAL32;
-        size_t num_bytes = NO_VAL32;
+        Addr addr = NO_VAL32;
+        Size num_bytes = 0;
+        Size beats = 0;
         Cycles cycles_left_to_complete = 0;
     };
 
-    // active request to memory (single-port memory)
-    Request request;
-    RequestResult request_result;
+    Config config;
+    std::unique_ptr<Dram> dram;
+    std::deque<Request> read_queue;
+    std::deque<Request> write_queue;
+    std::vector<Request> in_flight;
+    // completed at the latest clock
+    std::vector<std::pair<RequestId, uint32>> completed;
+    RequestId next_id = 0;
+    Stats stats;
 
-    // fixed memory latency
-    Cycles latency_in_cycles = 0;
-
-    // process active request to memory
-    void process();
+    RequestId enqueue(bool is_read, uint32 data, Addr addr, Size num_bytes);
+    std::deque<Request>::iterator schedule(std::deque<Request>& queue);
+    void issue();
 
 public:
-    PerfMemory(std::vector<uint8> data,
-               Cycles latency_in_cycles)
-    : Memory(data)
-    , latency_in_cycles(latency_in_cycles)
-    { }
+    PerfMemory(const std::vector<uint8>& image, const Config& config);
+    PerfMemory(const std::vector<uint8>& image, Cycles latency_in_cycles);
+    explicit PerfMemory(const Config& config);
 
     void clock();
-    bool is_busy() { return !request.complete; }
-    void send_read_request(Addr addr, size_t num_bytes);
-    void send_write_request(uint32 value, Addr addr, size_t num_bytes);
-    RequestResult get_request_status() { return request_result; }
+    bool can_accept(bool is_read) const override {
+        return is_read ? read_queue.size() < config.read_queue_size
+                       : write_queue.size() < config.write_queue_size;
+    }
+    Size get_max_transfer() const override { return config.bus_width * config.burst_length; }
+
+    // up to 4 bytes carried in result
+    RequestId send_read_request(Addr addr, size_t num_bytes);
+    RequestId send_write_request(uint32 value, Addr addr, size_t num_bytes);
+    // bursts, bytes are copied when request is accepted
+    RequestId send_read_request(uint8* dst, Addr addr, size_t num_bytes) override;
+    RequestId send_write_request(const uint8* src, Addr addr, size_t num_bytes) override;
+    RequestResult get_request_status(RequestId id) const override;
+
+    void read_functional(uint8* dst, Addr addr, size_t num_bytes) const override {
+        this->read_bytes(dst, addr, num_bytes);
+    }
+    void write_functional(const uint8* src, Addr addr, size_t num_bytes) override {
+        this->write_bytes(src, addr, num_bytes);
+    }
+
+    const Stats& get_stats() const { return stats; }
+    void dump_statistics(std::ostream& out) const;
 };
 
 #endif
@@ -0,0 +1,145 @@
+#include <algorithm>
+
+#include "infra/config/config.hpp"
+#include "profiler.hpp"
+
+namespace config {
+    static         Value<std::string> profile        = { "profile",        "prefix of memory access profile files, empty disables profiling", "" };
+    static         Value<std::string> profile_format = { "profile_format", "memory heat map format: csv or binary",                           "csv" };
+    static         Value<uint64>      profile_bucket = { "profile_bucket", "instructions or cycles per profile bucket",                     10000 };
+}
+
+static Size log2_exact(Size value, const char* what) {
+    if (value == 0 || (value & (value - 1)) != 0)
+        throw std::invalid_argument(std::string(what) + " must be a power of 2");
+    return __builtin_ctz(value);
+}
+
+AccessProfiler::AccessProfiler(const Config& config)
+    : config(config)
+    , page_bits(log2_exact(config.page_size, "Profiled page size"))
+    , line_bits(log2_exact(config.line_size, "Profiled line size"))
+{
+    // rows of binary heat map keep counters in 32 bits
+    if (config.bucket_length == 0 || config.bucket_length > (1ull << 30))
+        throw std::invalid_argument("Profile bucket must be from 1 to 2^30 ticks");
+    if (config.line_size > config.page_size)
+        throw std::invalid_argument("Profiled line can't exceed page");
+
+    if (config.prefix.empty())
+        return;
+    if (config.format == Format::CSV) {
+        this->heat_map.open(config.prefix + ".heat.csv");
+        this->heat_map << "bucket,page,loads,stores,fetches\n";
+    }
+    else {
+        this->heat_map.open(config.prefix + ".heat.bin", std::ios::binary);
+    }
+    this->working_set_file.open(config.prefix + ".wss.csv");
+    this->working_set_file << "bucket,pages,lines\n";
+    if (!this->heat_map || !this->working_set_file)
+        throw std::invalid_argument("Can't create profile files " + config.prefix + ".*");
+}
+
+std::unique_ptr<AccessProfiler> AccessProfiler::create(Size page_size, Size line_size) {
+    const std::string& prefix = config::profile;
+    if (prefix.empty())
+        return nullptr;
+
+    Config profiler_config;
+    profiler_config.prefix = prefix;
+    profiler_config.bucket_length = config::profile_bucket;
+    profiler_config.page_size = page_size;
+    profiler_config.line_size = line_size;
+    const std::string& format = config::profile_format;
+    if (format == "binary")
+        profiler_config.format = Format::BINARY;
+    else if (format != "csv")
+        throw std::invalid_argument("Unknown profile format " + format);
+    return std::make_unique<AccessProfiler>(profiler_config);
+}
+
+AccessProfiler::PageEntry* AccessProfiler::touch_page(Addr page) {
+    auto& entry = this->pages[page];
+    if (entry.bucket != this->bucket) {
+        entry.bucket = this->bucket;
+        entry.bucket_counters = {};
+        this->bucket_pages.emplace_back(page, &entry);
+    }
+    return &entry;
+}
+
+AccessProfiler::LineEntry* AccessProfiler::touch_line(Addr line) {
+    auto& entry = this->lines[line];
+    if (entry.bucket != this->bucket) {
+        entry.bucket = this->bucket;
+        this->bucket_lines++;
+    }
+    return &entry;
+}
+
+void AccessProfiler::close_bucket() {
+    // heat map rows go by address, so buckets are easy to plot
+    std::sort(this->bucket_pages.begin(), this->bucket_pages.end());
+    for (const auto& [page, entry] : this->bucket_pages) {
+        if (!this->heat_map.is_open())
+            break;
+        const auto& c = entry->bucket_counters;  // alias
+        if (this->config.format == Format::CSV) {
+            this->heat_map << this->bucket << ',' << (page << this->page_bits)
+                           << ',' << c[0] << ',' << c[1] << ',' << c[2] << '\n';
+            continue;
+        }
+        const std::array<uint32, 5> row = {
+            static_cast<uint32>(this->bucket), page << this->page_bits,
+            static_cast<uint32>(c[0]), static_cast<uint32>(c[1]), static_cast<uint32>(c[2])
+        };
+        this->heat_map.write(reinterpret_cast<const char*>(row.data()), sizeof(row));
+    }
+
+    WorkingSet point;
+    point.bucket = this->bucket;
+    point.pages = this->bucket_pages.size();
+    point.lines = this->bucket_lines;
+    this->working_set.push_back(point);
+    if (this->working_set_file.is_open())
+        this->working_set_file << point.bucket << ',' << point.pages << ',' << point.lines << '\n';
+
+    this->bucket_pages.clear();
+    this->bucket_lines = 0;
+    this->bucket++;
+    this->ticks = 0;
+    // next access of each kind has to stamp its entries with new bucket
+    this->last_page = {};
+    this->last_line = {};
+}
+
+void AccessProfiler::finish() {
+    if (this->finished)
+        return;
+    this->finished = true;
+    if (this->ticks != 0 || !this->bucket_pages.empty())
+        this->close_bucket();
+    if (this->config.prefix.empty())
+        return;
+
+    std::vector<std::pair<Addr, const LineEntry*>> sorted;
+    sorted.reserve(this->lines.size());
+    for (const auto& [line, entry] : this->lines)
+        sorted.emplace_back(line, &entry);
+    std::sort(sorted.begin(), sorted.end());
+
+    std::ofstream out(this->config.prefix + ".lines.csv");
+    out << "line,loads,stores,fetches\n";
+    for (const auto& [line, entry] : sorted) {
+        const auto& c = entry->counters;  // alias
+        out << (line << this->line_bits) << ',' << c[0] << ',' << c[1] << ',' << c[2] << '\n';
+    }
+    this->heat_map.close();
+    this->working_set_file.close();
+}
+
+AccessProfiler::Counters AccessProfiler::get_line_counters(Addr addr) const {
+    auto it = this->lines.find(addr >> this->line_bits);
+    return it == this->lines.end() ? Counters{} : it->second.counters;
+}
@@ -0,0 +1,128 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <array>
+#include <fstream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "infra/common.hpp"
+
+// Aggregates guest memory accesses per page and per line, split into
+// loads, stores and fetches. Time is divided into buckets of
+// bucket_length ticks (instructions or cycles, whatever owner counts).
+// At the end of each bucket its pages are appended to heat map
+// and numbers of distinct pages and lines touched to working set curve,
+// per line totals are written when profiling finishes.
+//
+// Accesses of one kind mostly stay within a line, so the last page and
+// line of each kind are cached and hash tables are looked up only when
+// access moves to another one.
+class AccessProfiler {
+public:
+    enum class Access : uint8 { LOAD, STORE, FETCH, MAX };
+    using Counters = std::array<uint64, static_cast<size_t>(Access::MAX)>;
+
+    enum class Format {
+        CSV,    // bucket,page,loads,stores,fetches
+        BINARY  // the same as 5 host-endian uint32 per row
+    };
+
+    struct Config {
+        std::string prefix;  // of output files, empty to keep results in memory only
+        Format format = Format::CSV;
+        uint64 bucket_length = 10000;
+        Size page_size = 4096;
+        Size line_size = 64;
+    };
+
+    struct WorkingSet {
+        uint64 bucket = 0;
+        Size pages = 0;
+        Size lines = 0;
+    };
+
+private:
+    static const uint64 NO_KEY = ~0ull;
+
+    struct PageEntry {
+        Counters bucket_counters = {};
+        uint64 bucket = NO_KEY;  // last bucket page was touched in
+    };
+
+    struct LineEntry {
+        Counters counters = {};
+        uint64 bucket = NO_KEY;
+    };
+
+    template <typename Entry>
+    struct LastEntry {
+        uint64 key = NO_KEY;
+        Entry* entry = nullptr;
+    };
+
+    Config config;
+    Size page_bits;
+    Size line_bits;
+
+    std::unordered_map<Addr, PageEntry> pages;  // by page number
+    std::unordered_map<Addr, LineEntry> lines;  // by line number
+    std::array<LastEntry<PageEntry>, static_cast<size_t>(Access::MAX)> last_page;
+    std::array<LastEntry<LineEntry>, static_cast<size_t>(Access::MAX)> last_line;
+
+    // pages touched in current bucket, in order of first access
+    std::vector<std::pair<Addr, PageEntry*>> bucket_pages;
+    Size bucket_lines = 0;
+    uint64 bucket = 0;
+    uint64 ticks = 0;
+    bool finished = false;
+
+    std::vector<WorkingSet> working_set;
+    std::ofstream heat_map;
+    std::ofstream working_set_file;
+
+    PageEntry* touch_page(Addr page);
+    LineEntry* touch_line(Addr line);
+    void close_bucket();
+
+public:
+    explicit AccessProfiler(const Config& config);
+    AccessProfiler(const AccessProfiler&) = delete;
+    AccessProfiler& operator=(const AccessProfiler&) = delete;
+    ~AccessProfiler() { this->finish(); }
+
+    // from command line options, nullptr if profiling is disabled
+    static std::unique_ptr<AccessProfiler> create(Size page_size, Size line_size);
+
+    void record(Access access, Addr addr) {
+        const auto kind = static_cast<size_t>(access);
+        auto& page = this->last_page[kind];  // alias
+        if (page.key != addr >> this->page_bits) {
+            page.key = addr >> this->page_bits;
+            page.entry = this->touch_page(page.key);
+        }
+        page.entry->bucket_counters[kind]++;
+
+        auto& line = this->last_line[kind];  // alias
+        if (line.key != addr >> this->line_bits) {
+            line.key = addr >> this->line_bits;
+            line.entry = this->touch_line(line.key);
+        }
+        line.entry->counters[kind]++;
+    }
+
+    // advances time by one instruction or cycle
+    void tick() {
+        if (++this->ticks == this->config.bucket_length)
+            this->close_bucket();
+    }
+
+    // closes incomplete bucket and writes line totals
+    void finish();
+
+    const std::vector<WorkingSet>& get_working_set() const { return working_set; }
+    Counters get_line_counters(Addr addr) const;
+};
+
+#endif
@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <iomanip>
+#include <numeric>
+
+#include "reuse.hpp"
+
+ReuseDistance::ReuseDistance(Size line_size, Size capacity)
+    : tree(capacity + 1)
+{
+    if (line_size == 0 || (line_size & (line_size - 1)) != 0)
+        throw std::invalid_argument("Reuse distance line size must be a power of 2");
+    if (capacity < 2)
+        throw std::invalid_argument("Reuse distance capacity must be at least 2");
+    this->line_bits = __builtin_ctz(line_size);
+}
+
+void ReuseDistance::add(uint32 time, int32 delta) {
+    for (Size i = time + 1; i < this->tree.size(); i += i & (~i + 1))
+        this->tree[i] += delta;
+}
+
+uint32 ReuseDistance::count_until(uint32 time) const {
+    int32 sum = 0;
+    for (Size i = time + 1; i > 0; i -= i & (~i + 1))
+        sum += this->tree[i];
+    return sum;
+}
+
+void ReuseDistance::compact() {
+    // renumber last accesses from 0 keeping their order
+    std::vector<std::pair<uint32, Addr>> order;
+    order.reserve(this->last_access.size());
+    for (const auto& [line, time] : this->last_access)
+        order.emplace_back(time, line);
+    std::sort(order.begin(), order.end());
+
+    Size capacity = this->tree.size() - 1;
+    while (capacity < 2 * order.size())
+        capacity *= 2;
+    this->tree.assign(capacity + 1, 0);
+    for (uint32 time = 0; time < order.size(); ++time) {
+        this->last_access[order[time].second] = time;
+        this->add(time, 1);
+    }
+    this->now = order.size();
+}
+
+void ReuseDistance::record(Addr line) {
+    if (this->now == this->tree.size() - 1)
+        this->compact();
+
+    auto [it, inserted] = this->last_access.emplace(line, this->now);
+    if (inserted) {
+        this->cold_misses++;
+    }
+    else {
+        // every line accessed after this one has its 1 later in time
+        Size distance = this->last_access.size() - this->count_until(it->second);
+        if (distance >= this->histogram.size())
+            this->histogram.resize(distance + 1);
+        this->histogram[distance]++;
+        this->add(it->second, -1);
+        it->second = this->now;
+    }
+    this->add(this->now, 1);
+    this->now++;
+}
+
+double ReuseDistance::get_hit_rate(Size lines) const {
+    if (this->accesses == 0)
+        return 0;
+    Size end = std::min<Size>(lines, this->histogram.size());
+    uint64 hits = std::accumulate(this->histogram.begin(), this->histogram.begin() + end, uint64{ 0 });
+    return static_cast<double>(hits) / this->accesses;
+}
+
+void ReuseDistance::dump(std::ostream& out, const std::string& name) const {
+    out << name << " reuse distance, " << (1u << this->line_bits) << "-byte lines: "
+        << this->accesses << " accesses, " << this->cold_misses << " cold misses\n";
+    for (Size lines = 1; ; lines *= 2) {
+        out << "  LRU " << std::setw(8) << lines << " lines: "
+            << std::fixed << std::setprecision(2) << 100 * this->get_hit_rate(lines) << "% hits\n";
+        if (lines >= this->histogram.size())
+            break;
+    }
+    out << std::defaultfloat;
+}
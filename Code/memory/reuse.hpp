@@ -0,0 +1,64 @@
+#ifndef REUSE_H
+#define REUSE_H
+
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include "infra/common.hpp"
+
+// LRU stack distance of accesses at line granularity: number of distinct
+// lines touched since the previous access to the same line. Access hits
+// in fully associative LRU cache of C lines iff its distance is below C,
+// so the histogram predicts hit rates of every cache size at once.
+//
+// Olken's algorithm: Fenwick tree over access times holds 1 at the last
+// access time of each line, distance is the number of ones after it,
+// O(log n) per access. Times are renumbered when tree is exhausted.
+class ReuseDistance {
+private:
+    static const uint64 NO_LINE = ~0ull;
+
+    Size line_bits;
+    std::unordered_map<Addr, uint32> last_access;  // time by line number
+    std::vector<int32> tree;  // Fenwick tree indexed by time + 1
+    uint32 now = 0;
+    uint64 last_line = NO_LINE;
+
+    std::vector<uint64> histogram = std::vector<uint64>(1);  // accesses by distance
+    uint64 accesses = 0;
+    uint64 cold_misses = 0;
+
+    void add(uint32 time, int32 delta);
+    uint32 count_until(uint32 time) const;  // ones at [0, time]
+    void compact();
+    void record(Addr line);
+
+public:
+    // tree grows from capacity if distinct lines don't fit in its half
+    ReuseDistance(Size line_size, Size capacity);
+    explicit ReuseDistance(Size line_size) : ReuseDistance(line_size, 1u << 16) { }
+
+    void access(Addr addr) {
+        this->accesses++;
+        // repeated access to line doesn't change LRU stack
+        if (addr >> this->line_bits == this->last_line) {
+            this->histogram[0]++;
+            return;
+        }
+        this->last_line = addr >> this->line_bits;
+        this->record(addr >> this->line_bits);
+    }
+
+    const std::vector<uint64>& get_histogram() const { return histogram; }
+    uint64 get_accesses() const { return accesses; }
+    uint64 get_cold_misses() const { return cold_misses; }
+
+    // of fully associative LRU cache holding given number of lines
+    double get_hit_rate(Size lines) const;
+
+    // predicted hit rates for power of 2 cache sizes
+    void dump(std::ostream& out, const std::string& name) const;
+};
+
+#endif
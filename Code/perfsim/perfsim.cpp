@@ -1,23 +1,202 @@
 #include "infra/config/config.hpp"
+#include "infra/trace/trace.hpp"
 #include "perfsim.hpp"
 
 namespace config {
-    static         Value<uint64>      cache_ways     = { "cache_ways",     "cache ways",                4 };
-    static         Value<uint64>      cache_sets     = { "cache_sets",     "cache sets",               64 };
-    static         Value<uint64>      cache_line     = { "cache_line",     "cache line size in bytes", 16 };
-    static         Value<uint64>      memory_latency = { "memory_latency", "memory latency in cycles",  3 };
+    static         Value<uint64>      cache_ways         = { "cache_ways",         "cache ways",                                   4 };
+    static         Value<uint64>      cache_sets         = { "cache_sets",         "cache sets",                                  64 };
+    static         Value<uint64>      cache_line         = { "cache_line",         "cache line size in bytes",                    16 };
+    static         Value<std::string> icache_replacement = { "icache_replacement", "icache replacement policy",                   "lru" };
+    static         Value<std::string> dcache_replacement = { "dcache_replacement", "dcache replacement policy",                   "lru" };
+    static         Value<uint64>      cache_latency      = { "cache_latency",      "L1 hit latency in cycles",                     0 };
+    static         Value<uint64>      cache_mshrs        = { "cache_mshrs",        "L1 MSHRs, 0 is blocking cache",                0 };
+    static         Value<std::string> icache_prefetcher  = { "icache_prefetcher",  "icache prefetcher, e.g. next-line, stream",  "none" };
+    static         Value<std::string> dcache_prefetcher  = { "dcache_prefetcher",  "dcache prefetcher, e.g. stride",            "none" };
+    static         Value<uint64>      prefetch_degree    = { "prefetch_degree",    "lines prefetched per access",                  1 };
+    static         Value<uint64>      prefetch_distance  = { "prefetch_distance",  "lines or strides prefetched ahead",            1 };
+    static         Value<uint64>      icache_victims     = { "icache_victims",     "icache victim cache lines, 0 disables it",     0 };
+    static         Value<uint64>      dcache_victims     = { "dcache_victims",     "dcache victim cache lines, 0 disables it",     0 };
+    static         Value<std::string> dcache_write       = { "dcache_write",       "dcache write policy: back or through",       "back" };
+    static         Value<uint64>      dcache_allocate    = { "dcache_allocate",    "dcache reads line on write miss",              1 };
+    static         Value<uint64>      dcache_wbuffer     = { "dcache_wbuffer",     "dcache write buffer lines, 0 disables it",     0 };
+    static         Value<uint64>      l2_ways            = { "l2_ways",            "L2 ways",                                      8 };
+    static         Value<uint64>      l2_sets            = { "l2_sets",            "L2 sets, 0 disables L2",                       0 };
+    static         Value<uint64>      l2_line            = { "l2_line",            "L2 line size in bytes",                       64 };
+    static         Value<uint64>      l2_latency         = { "l2_latency",         "L2 hit latency in cycles",                     8 };
+    static         Value<std::string> l2_inclusion       = { "l2_inclusion",       "L2 inclusion: nine, inclusive or exclusive", "nine" };
+    static         Value<std::string> l2_replacement     = { "l2_replacement",     "L2 replacement policy",                       "lru" };
+    static         Value<uint64>      l2_mshrs           = { "l2_mshrs",           "L2 MSHRs, 0 is blocking cache",                0 };
+    static         Value<std::string> l2_write           = { "l2_write",           "L2 write policy: back or through",           "back" };
+    static         Value<uint64>      l2_allocate        = { "l2_allocate",        "L2 reads line on write miss",                  1 };
+    static         Value<uint64>      l2_wbuffer         = { "l2_wbuffer",         "L2 write buffer lines, 0 disables it",         0 };
+    static         Value<uint64>      l3_ways            = { "l3_ways",            "L3 ways",                                     16 };
+    static         Value<uint64>      l3_sets            = { "l3_sets",            "L3 sets, 0 disables L3",                       0 };
+    static         Value<uint64>      l3_line            = { "l3_line",            "L3 line size in bytes",                       64 };
+    static         Value<uint64>      l3_latency         = { "l3_latency",         "L3 hit latency in cycles",                    20 };
+    static         Value<std::string> l3_inclusion       = { "l3_inclusion",       "L3 inclusion: nine, inclusive or exclusive", "nine" };
+    static         Value<std::string> l3_replacement     = { "l3_replacement",     "L3 replacement policy",                       "lru" };
+    static         Value<uint64>      l3_mshrs           = { "l3_mshrs",           "L3 MSHRs, 0 is blocking cache",                0 };
+    static         Value<std::string> l3_write           = { "l3_write",           "L3 write policy: back or through",           "back" };
+    static         Value<uint64>      l3_allocate        = { "l3_allocate",        "L3 reads line on write miss",                  1 };
+    static         Value<uint64>      l3_wbuffer         = { "l3_wbuffer",         "L3 write buffer lines, 0 disables it",         0 };
+    static         Value<uint64>      memory_latency     = { "memory_latency",     "memory latency in cycles",                     3 };
+    static         Value<uint64>      memory_read_queue  = { "memory_read_queue",  "memory read queue size",                       1 };
+    static         Value<uint64>      memory_write_queue = { "memory_write_queue", "memory write queue size",                      1 };
+    static         Value<uint64>      memory_outstanding = { "memory_outstanding", "memory requests in flight",                    1 };
+    static         Value<uint64>      memory_issue_width = { "memory_issue_width", "memory requests started per cycle",            1 };
+    static         Value<uint64>      memory_bus_width   = { "memory_bus_width",   "memory bus width in bytes, 1 to 64",           8 };
+    static         Value<uint64>      memory_burst       = { "memory_burst",       "memory beats per request",                     8 };
+    static         Value<uint64>      memory_beat_cycles = { "memory_beat_cycles", "memory cycles per next beat of burst",         1 };
+    static         Value<uint64>      dram_channels      = { "dram_channels",      "DRAM channels",                                1 };
+    static         Value<uint64>      dram_ranks         = { "dram_ranks",         "DRAM ranks per channel",                       1 };
+    static         Value<uint64>      dram_banks         = { "dram_banks",         "DRAM banks per rank",                          8 };
+    static         Value<uint64>      dram_row_size      = { "dram_row_size",      "DRAM row size in bytes",                    2048 };
+    static         Value<uint64>      dram_tRCD          = { "dram_tRCD",          "DRAM activate to column access, cycles",      11 };
+    static         Value<uint64>      dram_tCAS          = { "dram_tCAS",          "DRAM column access latency, cycles",          11 };
+    static         Value<uint64>      dram_tRP           = { "dram_tRP",           "DRAM precharge time, cycles",                 11 };
+    static         Value<uint64>      dram_tREFI         = { "dram_tREFI",         "DRAM refresh interval, 0 disables refresh", 7800 };
+    static         Value<uint64>      dram_tRFC          = { "dram_tRFC",          "DRAM refresh time, cycles",                  260 };
+    static         Value<std::string> memory_model       = { "memory_model",       "memory timing: fixed, dram or dram-fixed",  "fixed" };
+    static         Value<std::string> dram_page_policy   = { "dram_page_policy",   "DRAM row buffer policy: open or closed",    "open" };
+}
+
+static PerfMemory::Config get_memory_config() {
+    PerfMemory::Config config;
+    config.latency = config::memory_latency;
+    config.read_queue_size = config::memory_read_queue;
+    config.write_queue_size = config::memory_write_queue;
+    config.max_outstanding = config::memory_outstanding;
+    config.issue_width = config::memory_issue_width;
+    config.bus_width = config::memory_bus_width;
+    config.burst_length = config::memory_burst;
+    config.beat_cycles = config::memory_beat_cycles;
+
+    const std::string& model = config::memory_model;
+    if (model == "dram") {
+        Dram::Config dram;
+        dram.channels = config::dram_channels;
+        dram.ranks = config::dram_ranks;
+        dram.banks = config::dram_banks;
+        dram.row_size = config::dram_row_size;
+        dram.tRCD = config::dram_tRCD;
+        dram.tCAS = config::dram_tCAS;
+        dram.tRP = config::dram_tRP;
+        dram.tREFI = config::dram_tREFI;
+        dram.tRFC = config::dram_tRFC;
+
+        const std::string& policy = config::dram_page_policy;
+        if (policy != "open" && policy != "closed")
+            throw std::invalid_argument("Unknown DRAM page policy " + policy);
+        dram.open_page = policy == "open";
+        config.dram = dram;
+    }
+    else if (model == "dram-fixed") {
+        // DRAM path timed as fixed latency memory, for regression
+        config.dram = Dram::fixed_latency(config::memory_latency);
+    }
+    else if (model != "fixed") {
+        throw std::invalid_argument("Unknown memory model " + model);
+    }
+    return config;
+}
+
+static Cache::Config get_l1_config(const std::string& replacement, const std::string& prefetcher, Size victims) {
+    Cache::Config config;
+    config.num_ways = config::cache_ways;
+    config.num_sets = config::cache_sets;
+    config.line_size = config::cache_line;
+    config.latency = config::cache_latency;
+    config.mshrs = config::cache_mshrs;
+    config.prefetcher = prefetcher;
+    config.prefetch_degree = config::prefetch_degree;
+    config.prefetch_distance = config::prefetch_distance;
+    config.victim_entries = victims;
+    config.replacement = replacement;
+    return config;
+}
+
+static void set_write_policy(Cache::Config& config, const std::string& policy, bool allocate, Size buffer) {
+    if (policy != "back" && policy != "through")
+        throw std::invalid_argument("Unknown cache write policy " + policy);
+    config.write_through = policy == "through";
+    config.write_allocate = allocate;
+    config.write_buffer = buffer;
+}
+
+static Cache::Config get_dcache_config() {
+    Cache::Config config = get_l1_config(config::dcache_replacement, config::dcache_prefetcher, config::dcache_victims);
+    set_write_policy(config, config::dcache_write, config::dcache_allocate, config::dcache_wbuffer);
+    return config;
+}
+
+static Cache::Inclusion get_inclusion(const std::string& name) {
+    if (name == "nine")
+        return Cache::Inclusion::NINE;
+    if (name == "inclusive")
+        return Cache::Inclusion::INCLUSIVE;
+    if (name == "exclusive")
+        return Cache::Inclusion::EXCLUSIVE;
+    throw std::invalid_argument("Unknown cache inclusion " + name);
+}
+
+// nullptr if level is disabled
+static std::unique_ptr<Cache> create_cache(MemoryPort& lower,
+                                           Size ways,
+                                           Size sets,
+                                           Size line,
+                                           Cycles latency,
+                                           const std::string& inclusion,
+                                           const std::string& replacement,
+                                           Size mshrs,
+                                           const std::string& write_policy,
+                                           bool write_allocate,
+                                           Size write_buffer)
+{
+    if (sets == 0)
+        return nullptr;
+    Cache::Config config;
+    config.num_ways = ways;
+    config.num_sets = sets;
+    config.line_size = line;
+    config.latency = latency;
+    config.inclusion = get_inclusion(inclusion);
+    config.replacement = replacement;
+    config.mshrs = mshrs;
+    set_write_policy(config, write_policy, write_allocate, write_buffer);
+    return std::make_unique<Cache>(lower, config);
+}
+
+MemoryPort& PerfSim::get_l1_lower() {
+    if (this->l2 != nullptr)
+        return *this->l2;
+    if (this->l3 != nullptr)
+        return *this->l3;
+    return this->memory;
 }
 
 PerfSim::PerfSim(std::string executable_filename)
     : loader(executable_filename)
-    , memory(loader.load_data(), config::memory_latency)
-    , icache(memory, config::cache_ways, config::cache_sets, config::cache_line)
-    , dcache(memory, config::cache_ways, config::cache_sets, config::cache_line)
+    , memory(get_memory_config())
+    , l3(create_cache(memory, config::l3_ways, config::l3_sets, config::l3_line,
+                      config::l3_latency, config::l3_inclusion, config::l3_replacement, config::l3_mshrs,
+                      config::l3_write, config::l3_allocate, config::l3_wbuffer))
+    , l2(create_cache(l3 != nullptr ? static_cast<MemoryPort&>(*l3) : memory,
+                      config::l2_ways, config::l2_sets, config::l2_line,
+                      config::l2_latency, config::l2_inclusion, config::l2_replacement, config::l2_mshrs,
+                      config::l2_write, config::l2_allocate, config::l2_wbuffer))
+    , icache(get_l1_lower(), get_l1_config(config::icache_replacement, config::icache_prefetcher, config::icache_victims))
+    , dcache(get_l1_lower(), get_dcache_config())
     , rf()
+    , syscalls(memory, loader.get_data_end())
+    , profiler(AccessProfiler::create(Memory::PAGE_SIZE, config::cache_line))
     , PC(loader.get_start_PC())
     , clocks(0)
     , ops(0)
 {
+    loader.load(memory);
+    icache.set_profiler(profiler.get(), AccessProfiler::Access::FETCH);
+    dcache.set_profiler(profiler.get(), AccessProfiler::Access::LOAD);
+
     // setup stack
     rf.set_stack_pointer(memory.get_stack_pointer());
     rf.validate(Register::Number::s0);
@@ -27,8 +206,22 @@ PerfSim::PerfSim(std::string executable_filename)
     rf.validate(Register::Number::s3);
 }
 
+PerfSim::PerfSim(std::string executable_filename, const Checkpoint& checkpoint)
+    : PerfSim(executable_filename)
+{
+    this->memory.restore(checkpoint.memory);
+    std::copy(checkpoint.registers.begin(), checkpoint.registers.end(), this->rf.get_values());
+    this->PC = checkpoint.PC;
+    this->syscalls.set_state(checkpoint.syscalls);
+    this->halted = checkpoint.syscalls.exited;
+}
+
 void PerfSim::step() {
     memory.clock();
+    if (l3 != nullptr)
+        l3->clock();
+    if (l2 != nullptr)
+        l2->clock();
     icache.clock();
     dcache.clock();
 
@@ -38,14 +231,16 @@ void PerfSim::step() {
     this->decode_stage();
     this->fetch_stage();
 
-    std::cout << "STALLS: "
-              << wires.FD_stage_reg_stall
-              << wires.DE_stage_reg_stall
-              << wires.EM_stage_reg_stall
-              << std::endl;
+    TRACE(PERFSIM, BASIC, "STALLS: "
+                          << wires.FD_stage_reg_stall
+                          << wires.DE_stage_reg_stall
+                          << wires.EM_stage_reg_stall
+                          << '\n');
 
     rf.dump();
     clocks++;
+    if (this->profiler != nullptr)
+        this->profiler->tick();
 
     multiple_stall = static_cast<int>(branch_mispredict) + \
                     static_cast<int>(fetch_stall) + \
@@ -63,15 +258,9 @@ void PerfSim::step() {
         if (branch_mispredict)
             branch_penalties+=3;
     }
-    if (ops > 0)
-        std::cout << "CPI: " << clocks*1.0/ops << std::endl;
-    std::cout << std::dec << "Clocks: " << clocks << std::endl;
-    std::cout << "Ops: " << ops << std::endl;
-    std::cout << "Data stalls: " << data_stalls << std::endl;
-    std::cout << "Memory_stalls: " << memory_stalls << std::endl;
-    std::cout << "Branch penalties: " << branch_penalties << std::endl;
-    std::cout << "Multiple stalls: " << multiple_stalls << std::endl;
-    std::cout << std::string(50, '-') << std::endl << std::endl;
+    if (TRACE_ENABLED(PERFSIM, DETAILED))
+        this->dump_statistics(trace::sink());
+    TRACE(PERFSIM, BASIC, std::string(50, '-') << "\n\n");
 
     if (!wires.FD_stage_reg_stall)
         stage_registers.FETCH_DECODE.clock();
@@ -99,18 +288,55 @@ void PerfSim::step() {
     pipeline_not_empty = false;
 }
 
-void PerfSim::run(uint32 n) {
-    for (uint32 i = 0; i < n; ++i)
+void PerfSim::run(uint64 n) {
+    for (uint64 i = 0; i < n && !this->halted; ++i)
         this->step();
+
+    trace::flush();
+    this->dump_statistics(std::cout);
+}
+
+void PerfSim::run_until_exit() {
+    while (!this->halted)
+        this->step();
+
+    trace::flush();
+    this->dump_statistics(std::cout);
+}
+
+void PerfSim::dump_statistics(std::ostream& out) const {
+    if (ops > 0)
+        out << "CPI: " << clocks*1.0/ops << '\n';
+    out << std::dec << "Clocks: " << clocks << '\n';
+    out << "Ops: " << ops << '\n';
+    out << "Data stalls: " << data_stalls << '\n';
+    out << "Memory_stalls: " << memory_stalls << '\n';
+    out << "Branch penalties: " << branch_penalties << '\n';
+    out << "Multiple stalls: " << multiple_stalls << '\n';
+    icache.dump_statistics(out, "L1I", ops);
+    dcache.dump_statistics(out, "L1D", ops);
+    if (l2 != nullptr)
+        l2->dump_statistics(out, "L2", ops);
+    if (l3 != nullptr)
+        l3->dump_statistics(out, "L3", ops);
+    memory.dump_statistics(out);
+    out << "Guest memory: " << memory.get_resident_size() / 1024 << " KiB\n";
 }
 
 void PerfSim::fetch_stage() {
-    std::cout << "FETCH:  ";
-    static bool awaiting_memory_request = false;
-    static uint32 fetch_data = NO_VAL32;
+    TRACE(PERFSIM, BASIC, "FETCH:  ");
+    auto& awaiting_memory_request = this->fetch_request.awaiting;  // alias
+    auto& fetch_data = this->fetch_request.data;  // alias
 
     if (wires.FD_stage_reg_stall) {
-        std::cout << "BUBBLE" << std::endl;
+        TRACE(PERFSIM, BASIC, "BUBBLE\n");
+        stage_registers.FETCH_DECODE.write(nullptr);
+        return;
+    }
+
+    // nothing is fetched after guest exit
+    if (syscalls.has_exited()) {
+        TRACE(PERFSIM, BASIC, "HALTED\n");
         stage_registers.FETCH_DECODE.write(nullptr);
         return;
     }
@@ -120,13 +346,13 @@ void PerfSim::fetch_stage() {
         fetch_data = NO_VAL32;
         awaiting_memory_request = false;
         PC = wires.memory_to_fetch_target;
-        std::cout << "FLUSH, ";
+        TRACE(PERFSIM, BASIC, "FLUSH, ");
     }
 
-    std::cout << std::hex << "PC: " << PC << std::endl;
+    TRACE(PERFSIM, BASIC, std::hex << "PC: " << PC << '\n');
 
     if (icache.is_busy()) {
-        std::cout << "\tWAITING ICACHE" << std::endl;
+        TRACE(PERFSIM, BASIC, "\tWAITING ICACHE\n");
         stage_registers.FETCH_DECODE.write(nullptr);
         return;
     }
@@ -134,9 +360,9 @@ void PerfSim::fetch_stage() {
     if (!awaiting_memory_request) {
         // send requests to memory
         Addr addr = PC;
-        icache.send_read_request(addr, 4);
+        icache.send_read_request(addr, 4, addr);
         awaiting_memory_request = true;
-        std::cout << "\tsent request to icache" << std::endl;
+        TRACE(PERFSIM, BASIC, "\tsent request to icache\n");
     }
 
     auto request = icache.get_request_status();
@@ -144,26 +370,29 @@ void PerfSim::fetch_stage() {
     if (request.is_ready) {
         fetch_data = request.data;
 
-        std::cout << "\tgot request from icache" << std::endl;
+        TRACE(PERFSIM, BASIC, "\tgot request from icache\n");
         
         awaiting_memory_request = false;
         fetch_complete = true;
     }
 
     if (fetch_complete) {
-        if ((fetch_data == 0 )| (fetch_data == NO_VAL32)) {
-            stage_registers.FETCH_DECODE.write(nullptr);
-            std::cout << "Empty" << std::endl;
-        } else {
-            pipeline_not_empty = true;
-            Instruction* data = new Instruction(fetch_data, PC);
-            std::cout << "\t0x" << std::hex << data->get_PC() << ": "
-                      << data->get_disasm() << " "
-                      << std::endl;
-
-            stage_registers.FETCH_DECODE.write(data);
-            PC = PC + 4;
+        // word which can't be decoded passes down the pipeline as illegal
+        // instruction, it stops the program unless flushed before memory stage
+        Instruction::Predecoded predecoded;
+        try {
+            predecoded = Instruction::predecode(fetch_data);
         }
+        catch (const std::invalid_argument&) { }
+
+        pipeline_not_empty = true;
+        Instruction data(predecoded, PC);
+        TRACE(PERFSIM, BASIC, "\t0x" << std::hex << data.get_PC() << ": "
+                              << data.get_disasm() << " "
+                              << '\n');
+
+        stage_registers.FETCH_DECODE.write(&data);
+        PC = PC + 4;
     } else {
         stage_registers.FETCH_DECODE.write(nullptr);
         this->fetch_stall = true;
@@ -173,7 +402,7 @@ void PerfSim::fetch_stage() {
 
 
 void PerfSim::decode_stage() {
-    std::cout << "DECODE: ";
+    TRACE(PERFSIM, BASIC, "DECODE: ");
 
     Instruction* data = nullptr;
     data = stage_registers.FETCH_DECODE.read();
@@ -185,21 +414,20 @@ void PerfSim::decode_stage() {
     // branch mispredctiion handling
     if (wires.memory_to_all_flush) {
         stage_registers.DECODE_EXE.write(nullptr);
-        std::cout << "FLUSH" << std::endl;
-        if (data != nullptr) delete data;
+        TRACE(PERFSIM, BASIC, "FLUSH\n");
         return;
     }
     
 
     if (data == nullptr) {
         stage_registers.DECODE_EXE.write(nullptr);
-        std::cout << "BUBBLE" << std::endl;
+        TRACE(PERFSIM, BASIC, "BUBBLE\n");
         return;
     }
     pipeline_not_empty = true;
-    std::cout << "0x" << std::hex << data->get_PC() << ": "
-              << data->get_disasm() << " "
-              << std::endl;
+    TRACE(PERFSIM, BASIC, "0x" << std::hex << data->get_PC() << ": "
+                          << data->get_disasm() << " "
+                          << '\n');
 
     // read RF registers mask
     uint32 decode_stage_regs = \
@@ -219,13 +447,13 @@ void PerfSim::decode_stage() {
         stage_registers.DECODE_EXE.write(data);
     }
 
-    std::cout << "\tRegisters read: " << data->get_rs1() << " " \
-              << data->get_rs2() << std::endl;
+    TRACE(PERFSIM, BASIC, "\tRegisters read: " << data->get_rs1() << " " \
+                          << data->get_rs2() << '\n');
 }
 
 
 void PerfSim::execute_stage() {
-    std::cout << "EXE:    ";
+    TRACE(PERFSIM, BASIC, "EXE:    ");
 
     Instruction* data = nullptr;
     data = stage_registers.DECODE_EXE.read();
@@ -238,32 +466,31 @@ void PerfSim::execute_stage() {
     // branch mispredctiion handling
     if (wires.memory_to_all_flush) {
         stage_registers.EXE_MEM.write(nullptr);
-        std::cout << "FLUSH" << std::endl;
-        if (data != nullptr) delete data;
+        TRACE(PERFSIM, BASIC, "FLUSH\n");
         return;
     }
 
     if (data == nullptr) {
         stage_registers.EXE_MEM.write(nullptr);
-        std::cout << "BUBBLE" << std::endl;
+        TRACE(PERFSIM, BASIC, "BUBBLE\n");
         return;
     }
     pipeline_not_empty = true;
     // actual execution takes place here
-    data->execute();
+    if (!data->is_illegal())
+        data->execute();
     wires.execute_stage_regs = (1 << static_cast<uint32>(data->get_rd())); 
     stage_registers.EXE_MEM.write(data);
 
-    std::cout << "0x" << std::hex << data->get_PC() << ": "
-                      << data->get_disasm() << " "
-                      << std::endl;
+    TRACE(PERFSIM, BASIC, "0x" << std::hex << data->get_PC() << ": "
+                                  << data->get_disasm() << " "
+                                  << '\n');
 }
 
 void PerfSim::memory_stage() {
-    std::cout << "MEM:    ";
-    static uint memory_stage_iterations_complete = 0;
-    static bool awaiting_memory_request = false;
-    static uint32 memory_data = NO_VAL32;
+    TRACE(PERFSIM, BASIC, "MEM:    ");
+    auto& awaiting_memory_request = this->memory_request.awaiting;  // alias
+    auto& memory_data = this->memory_request.data;  // alias
 
     Instruction* data = nullptr;
     data = stage_registers.EXE_MEM.read();
@@ -274,7 +501,7 @@ void PerfSim::memory_stage() {
 
     if (data == nullptr) {
         stage_registers.MEM_WB.write(nullptr);
-        std::cout << "BUBBLE" << std::endl;
+        TRACE(PERFSIM, BASIC, "BUBBLE\n");
         return;
     }
     pipeline_not_empty = true;
@@ -283,7 +510,7 @@ void PerfSim::memory_stage() {
     // memory operations
     if (data->is_load() | data->is_store()) {
         if (dcache.is_busy()) {
-            std::cout << "WAITING DCACHE" << std::endl;
+            TRACE(PERFSIM, BASIC, "WAITING DCACHE\n");
             wires.EM_stage_reg_stall = true;
             stage_registers.MEM_WB.write(nullptr);
             this->memory_stall = true;
@@ -291,61 +518,49 @@ void PerfSim::memory_stage() {
         }
 
         if (!awaiting_memory_request) {
-            // send requests to memory
-            Addr addr = data->get_memory_addr() + (memory_stage_iterations_complete * 2);
-            size_t num_bytes = (data->get_memory_size() == 1) ? 1 : 2;
+            // whole access is a single request to cache
+            Addr addr = data->get_memory_addr();
+            size_t num_bytes = data->get_memory_size();
 
             if (data->is_load()) {
-                std::cout << "READING at " << std::hex << addr << std::endl;
-                dcache.send_read_request(addr, num_bytes);
+                TRACE(PERFSIM, BASIC, "READING at " << std::hex << addr << '\n');
+                dcache.send_read_request(addr, num_bytes, data->get_PC());
             }
 
             if (data->is_store()) {
                 memory_data = data->get_rs2_v();
-                std::cout << "WRITING " << std::hex << memory_data << " at " << std::hex << addr << std::endl;
-                if (memory_stage_iterations_complete == 0)
-                    dcache.send_write_request(memory_data, addr, num_bytes);
-                else
-                    dcache.send_write_request(memory_data >> 16, addr, num_bytes);
+                TRACE(PERFSIM, BASIC, "WRITING " << std::hex << memory_data << " at " << std::hex << addr << '\n');
+                dcache.send_write_request(memory_data, addr, num_bytes, data->get_PC());
             }
 
             awaiting_memory_request = true;
-            std::cout << "\tsent request to dcache" << std::endl;
+            TRACE(PERFSIM, BASIC, "\tsent request to dcache\n");
         }
 
         auto request = dcache.get_request_status();
-
-        if (request.is_ready) {
-            if (data->is_load()) {
-                if (memory_stage_iterations_complete == 0)
-                    memory_data = request.data;
-                else
-                    memory_data |= (request.data << 16);
-            }
-
-            awaiting_memory_request = false;
-            memory_stage_iterations_complete++;
-            std::cout << "GOT request from dcache" << std::endl;
-        }
-
-        bool memory_operation_complete = \
-            (memory_stage_iterations_complete * 2) >= data->get_memory_size();
-
-        if (memory_operation_complete) {
-            memory_stage_iterations_complete = 0;
-            data->set_rd_v(memory_data);
-        } else {
-            std::cout << "\tmemory_stage_iterations_complete: "
-                      << memory_stage_iterations_complete << std::endl;
+        if (!request.is_ready) {
             wires.EM_stage_reg_stall = true;
             stage_registers.MEM_WB.write(nullptr);
             this->memory_stall = true;
             return;
         }
+
+        if (data->is_load())
+            memory_data = request.data;
+        awaiting_memory_request = false;
+        TRACE(PERFSIM, BASIC, "GOT request from dcache\n");
+        data->set_rd_v(memory_data);
     } else {
-        std::cout << "NOT a memory operation" << std::endl;
+        TRACE(PERFSIM, BASIC, "NOT a memory operation\n");
     }
 
+    // system calls are served here, when all older instructions
+    // have completed memory operations
+    if (data->is_syscall())
+        this->serve_syscall(*data);
+    if (data->is_illegal())
+        this->serve_fault(*data);
+
     // jump operations
     if (data->is_jump() | data->is_branch()) {
         if (data->get_new_PC() != data->get_PC() + 4) {
@@ -359,30 +574,68 @@ void PerfSim::memory_stage() {
     // pass data to writeback stage
     stage_registers.MEM_WB.write(data);
 
-    std::cout << "\t0x" << std::hex << data->get_PC() << ": "
-              << data->get_disasm() << " "
-              << std::endl;
+    TRACE(PERFSIM, BASIC, "\t0x" << std::hex << data->get_PC() << ": "
+                          << data->get_disasm() << " "
+                          << '\n');
 
     if (wires.memory_to_all_flush)
-        std::cout << "\tbranch misprediction, flush" << std::endl;
+        TRACE(PERFSIM, BASIC, "\tflush\n");
 } 
 
 
+void PerfSim::serve_syscall(const Instruction& instr) {
+    // proxy accesses memory directly
+    if (this->l3 != nullptr)
+        this->l3->write_back();
+    if (this->l2 != nullptr)
+        this->l2->write_back();
+    this->dcache.write_back();
+    this->syscalls.execute(instr, this->rf);
+    const Addr addr = syscalls.get_modified_addr();
+    const Size size = syscalls.get_modified_size();
+    this->icache.invalidate(addr, size);
+    this->dcache.invalidate(addr, size);
+    if (this->l2 != nullptr)
+        this->l2->invalidate(addr, size);
+    if (this->l3 != nullptr)
+        this->l3->invalidate(addr, size);
+
+    // younger instructions might have read registers
+    // before they were written by system call
+    wires.memory_to_all_flush = true;
+    wires.memory_to_fetch_target = instr.get_new_PC();
+}
+
+
+void PerfSim::serve_fault(const Instruction& instr) {
+    this->syscalls.fault(instr.get_PC());
+    // younger instructions are dropped
+    wires.memory_to_all_flush = true;
+    wires.memory_to_fetch_target = instr.get_PC();
+}
+
+
 void PerfSim::writeback_stage() {
-    std::cout << "WB:     ";
+    TRACE(PERFSIM, BASIC, "WB:     ");
     Instruction* data = nullptr;
     
     data = stage_registers.MEM_WB.read();
 
     if (data == nullptr) {
-        std::cout << "BUBBLE" << std::endl;
+        TRACE(PERFSIM, BASIC, "BUBBLE\n");
         return;
     }
     pipeline_not_empty = true;
-    std::cout << "0x" << std::hex << data->get_PC() << ": "
-          << data->get_disasm() << " "
-          << std::endl;
+    TRACE(PERFSIM, BASIC, "0x" << std::hex << data->get_PC() << ": "
+                          << data->get_disasm() << " "
+                          << '\n');
+    // illegal instruction doesn't retire
+    if (data->is_illegal()) {
+        halted = true;
+        return;
+    }
     this->rf.writeback(*data);
     ops++;
-    delete data;
+    if (data->is_syscall() && syscalls.has_exited())
+        halted = true;
 }
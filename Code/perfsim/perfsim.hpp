@@ -7,22 +7,30 @@
 #include "cache/cache.hpp"
 #include "stage_register/stage_register.hpp"
 #include "infra/elf/elf.hpp"
+#include "syscall/syscall.hpp"
+#include "funcsim/checkpoint.hpp"
 
 class PerfSim {
 private:
     ElfLoader loader;
     PerfMemory memory;
+    // optional shared levels, constructed from the lowest one
+    std::unique_ptr<Cache> l3;
+    std::unique_ptr<Cache> l2;
     Cache icache;
     Cache dcache;
     RF rf;
+    SyscallProxy syscalls;
+    std::unique_ptr<AccessProfiler> profiler;
     Addr PC;
-    uint32 clocks;
-    uint32 ops;
-    uint32 branch_penalties = 0;
-    uint32 data_stalls = 0;
-    uint32 memory_stalls = 0;
-    uint32 multiple_stalls = 0;
+    uint64 clocks;
+    uint64 ops;
+    uint64 branch_penalties = 0;
+    uint64 data_stalls = 0;
+    uint64 memory_stalls = 0;
+    uint64 multiple_stalls = 0;
     bool pipeline_not_empty = true;
+    bool halted = false;  // guest exit has been committed
 
     bool branch_mispredict = false;
     bool fetch_stall = false;
@@ -53,9 +61,31 @@ private:
         uint32 memory_stage_regs = 0;
     } wires;
 
+    // cache requests in flight, per instance so that
+    // simulators forked from one checkpoint are independent
+    struct CacheRequest {
+        bool awaiting = false;
+        uint32 data = NO_VAL32;
+    };
+    CacheRequest fetch_request;
+    CacheRequest memory_request;
+
+    MemoryPort& get_l1_lower();
+    void dump_statistics(std::ostream& out) const;
+    void serve_syscall(const Instruction& instr);
+    void serve_fault(const Instruction& instr);
+
 public:
     PerfSim(std::string executable_filename);
-    void run(uint32 n);
+    // starts with empty pipeline from state of functional warm-up
+    PerfSim(std::string executable_filename, const Checkpoint& checkpoint);
+    void run(uint64 n);
+    void run_until_exit();
+
+    bool has_exited() const { return halted; }
+    int32 get_exit_code() const { return syscalls.get_exit_code(); }
+    uint64 get_ops() const { return ops; }
+    uint64 get_clocks() const { return clocks; }
     
     void step();
     
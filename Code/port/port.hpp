@@ -0,0 +1,42 @@
+#ifndef PORT_H
+#define PORT_H
+
+#include "infra/common.hpp"
+
+class Cache;
+
+// Lower level of memory hierarchy as seen by a cache: memory controller
+// or next-level cache. Requests move bytes of a single line, write data
+// is copied when request is accepted, read data is in destination when
+// request is ready. Result is ready for one cycle after completion.
+class MemoryPort {
+public:
+    using RequestId = uint64;
+
+    struct RequestResult {
+        bool is_ready = false;
+        uint32 data = NO_VAL32;
+    };
+
+    virtual ~MemoryPort() = default;
+
+    virtual bool can_accept(bool is_read) const = 0;
+    // largest request, e.g. cache line fill
+    virtual Size get_max_transfer() const = 0;
+    virtual RequestId send_read_request(uint8* dst, Addr addr, size_t num_bytes) = 0;
+    virtual RequestId send_write_request(const uint8* src, Addr addr, size_t num_bytes) = 0;
+    virtual RequestResult get_request_status(RequestId id) const = 0;
+
+    // exclusive level keeps only lines evicted from upper ones,
+    // so it has to receive clean evictions as well
+    virtual bool is_exclusive() const { return false; }
+    // upper cache to back-invalidate when inclusive level evicts a line
+    virtual void add_upper(Cache* /* cache */) { }
+
+    // zero-time accesses passing through all levels,
+    // copies found on the way are updated
+    virtual void read_functional(uint8* dst, Addr addr, size_t num_bytes) const = 0;
+    virtual void write_functional(const uint8* src, Addr addr, size_t num_bytes) = 0;
+};
+
+#endif
@@ -1,34 +1,30 @@
 #include "rf.hpp"
-#include "infra/config/config.hpp"
-
-namespace config {
-    static         Value<uint64>      dump_rf     = { "dump_rf", "whether to dump RF state", false };
-}
+#include "infra/trace/trace.hpp"
 
 uint32 RF::read(Register num) const {
     if (this->is_valid(num))
-        return this->register_table[num].value;
+        return this->values[num];
     
     throw std::invalid_argument("Register " + num.get_name() + " is INVALID");
 }
 
 void RF::write(Register num, uint32 value) {
     if (num == 0) return;
-    this->register_table[num].value = value;
+    this->values[num] = value;
     this->validate(num);
 }
 
 void RF::invalidate(Register num) {
     if (num == 0) return;
-    this->register_table[num].is_valid = false;
+    this->valid[num] = false;
 }
 
 void RF::validate(Register num) {
-    this->register_table[num].is_valid = true;
+    this->valid[num] = true;
 }
 
 bool RF::is_valid(Register num) const {
-    return this->register_table[num].is_valid;
+    return this->valid[num];
 }
 
 void RF::read_sources(Instruction &instr) const {
@@ -53,18 +49,19 @@ void RF::set_stack_pointer(uint32 value) {
 }
 
 void RF::dump() const {
-    if (!config::dump_rf)
+    if (!TRACE_ENABLED(RF, BASIC))
         return;
 
-    std::cout << "Register file dump:" << std::endl;
+    auto& out = trace::sink();
+    out << "Register file dump:\n";
     
     for(uint8 i = 0; i < (Register::MAX_NUMBER); ++i) {
         if (!this->is_valid(i))
             continue;
 
-        std::cout << '\t' << Register(i) << " = " << std::hex
-                  << this->register_table[i].value << std::endl;
+        out << '\t' << Register(i) << " = " << std::hex
+            << this->values[i] << '\n';
     }
 
-    std::cout << std::endl;
+    out << '\n';
 }
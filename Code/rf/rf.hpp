@@ -10,18 +10,16 @@ private:
     uint32 read(Register num) const;
     void write(Register num, uint32 value);
 
-    struct RegisterState {
-        uint32 value = 0;
-        bool is_valid = true; 
-    };
-    
-    std::array<RegisterState, Register::MAX_NUMBER> register_table;
+    // values and validity bits are kept apart, so values
+    // form a plain array accessible to fast functional engines
+    std::array<uint32, Register::MAX_NUMBER> values = {};
+    std::array<bool, Register::MAX_NUMBER> valid;
     
     void invalidate(Register num);
     bool is_valid(Register num) const;
 public:
     RF() {
-        register_table[Register::zero()].is_valid = true;
+        valid.fill(true);
     };
     
     void read_sources(Instruction &instr) const;
@@ -30,6 +28,11 @@ public:
     void validate(Register num);
 
     void dump() const;
+
+    // direct access to register values bypassing validity tracking,
+    // register zero must never be written through it
+    uint32* get_values() { return values.data(); }
+    const uint32* get_values() const { return values.data(); }
 };
 
 #endif
@@ -1,18 +1,27 @@
 #ifndef _PORT_H_
 #define _PORT_H_
 
+#include <optional>
+
 #include "infra/common.hpp"
 #include "instruction/instruction.hpp"
 
+// Pipeline register holding copy of data, nullptr means bubble.
+// Pointer returned by read() stays valid until the next clock().
 template <class Data>
 class StageRegister {
 private:
-    Data* data_in = nullptr;
-    Data* data_out = nullptr;
+    std::optional<Data> data_in;
+    std::optional<Data> data_out;
 public:
     void clock() { data_out = data_in; }
-    void write(Data* input) { data_in = input; }
-    Data* read() { return data_out; }
+    void write(const Data* input) {
+        if (input != nullptr)
+            data_in = *input;
+        else
+            data_in.reset();
+    }
+    Data* read() { return data_out ? &*data_out : nullptr; }
 };
 
-#endif
\ No newline at end of file
+#endif
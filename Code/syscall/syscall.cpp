@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "infra/config/config.hpp"
+#include "infra/trace/trace.hpp"
+#include "syscall.hpp"
+
+namespace config {
+    static         Value<std::string> sandbox = { "sandbox", "directory guest programs open files in", "." };
+}
+
+// newlib system call numbers
+enum Number : uint32 {
+    SYS_CLOSE = 57,
+    SYS_READ  = 63,
+    SYS_WRITE = 64,
+    SYS_EXIT  = 93,
+    SYS_EXIT_GROUP = 94,
+    SYS_BRK   = 214,
+    SYS_OPEN  = 1024
+};
+
+// newlib open flags
+static const int32 GUEST_O_ACCMODE = 0x3;
+static const int32 GUEST_O_APPEND  = 0x8;
+static const int32 GUEST_O_CREAT   = 0x200;
+static const int32 GUEST_O_TRUNC   = 0x400;
+static const int32 GUEST_O_EXCL    = 0x800;
+
+// heap must not grow into stack
+static const Size STACK_SIZE = 8 * 1024;
+
+// exit code of program stopped at breakpoint, as reported by shells for SIGTRAP
+static const int32 BREAKPOINT_EXIT_CODE = 128 + 5;
+// and of program stopped at illegal instruction, as for SIGILL
+static const int32 FAULT_EXIT_CODE = 128 + 4;
+
+static const Size MAX_PATH_LENGTH = 4096;
+
+SyscallProxy::SyscallProxy(Memory& memory, Addr data_end)
+    : memory(memory)
+    , sandbox(config::sandbox)
+    , brk_start(data_end)
+    , brk_limit(memory.get_stack_pointer() - STACK_SIZE)
+    , brk(data_end)
+{
+    // guest standard streams are the host ones
+    for (int fd : { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO })
+        this->files.emplace(fd, fd);
+}
+
+SyscallProxy::~SyscallProxy() {
+    for (const auto& [guest_fd, host_fd] : this->files)
+        if (host_fd > STDERR_FILENO)
+            close(host_fd);
+}
+
+void SyscallProxy::set_state(const State& state) {
+    this->brk = state.brk;
+    this->exited = state.exited;
+    this->exit_code = state.exit_code;
+}
+
+bool SyscallProxy::is_valid_range(Addr addr, Size size) const {
+    return static_cast<uint64>(addr) + size <= (1ull << 32);
+}
+
+int SyscallProxy::get_host_fd(int32 guest_fd) const {
+    auto it = this->files.find(guest_fd);
+    return it == this->files.end() ? -1 : it->second;
+}
+
+void SyscallProxy::fault(Addr PC) {
+    TRACE(FUNCSIM, BASIC, "illegal instruction at 0x" << std::hex << PC << '\n');
+    this->exited = true;
+    this->exit_code = FAULT_EXIT_CODE;
+}
+
+void SyscallProxy::execute(const Instruction& instr, RF& rf) {
+    this->modified_addr = NO_VAL32;
+    this->modified_size = 0;
+
+    // ebreak has non-zero immediate field
+    if (instr.get_imm_v() != 0) {
+        TRACE(FUNCSIM, BASIC, "breakpoint at 0x" << std::hex << instr.get_PC() << '\n');
+        this->exited = true;
+        this->exit_code = BREAKPOINT_EXIT_CODE;
+        return;
+    }
+
+    uint32* r = rf.get_values();
+    const uint32 number = r[Register(Register::Number::a7)];
+    const uint32 a0 = r[Register(Register::Number::a0)];
+    const uint32 a1 = r[Register(Register::Number::a1)];
+    const uint32 a2 = r[Register(Register::Number::a2)];
+
+    int32 result = -ENOSYS;
+    switch (number) {
+        case SYS_EXIT:
+        case SYS_EXIT_GROUP: result = this->sys_exit(a0);        break;
+        case SYS_WRITE:      result = this->sys_write(a0, a1, a2); break;
+        case SYS_READ:       result = this->sys_read(a0, a1, a2);  break;
+        case SYS_BRK:        result = this->sys_brk(a0);           break;
+        case SYS_OPEN:       result = this->sys_open(a0, a1, a2);  break;
+        case SYS_CLOSE:      result = this->sys_close(a0);         break;
+        default:
+            break;
+    }
+
+    TRACE(FUNCSIM, BASIC, "syscall " << std::dec << number << "("
+                          << a0 << ", " << a1 << ", " << a2 << ") = "
+                          << result << '\n');
+    r[Register(Register::Number::a0)] = result;
+}
+
+int32 SyscallProxy::sys_exit(int32 code) {
+    this->exited = true;
+    this->exit_code = code;
+    return code;
+}
+
+int32 SyscallProxy::sys_write(int32 fd, Addr buffer, Size count) {
+    int host_fd = this->get_host_fd(fd);
+    if (host_fd < 0)
+        return -EBADF;
+    if (!this->is_valid_range(buffer, count))
+        return -EFAULT;
+
+    // keep order with simulator's own output
+    if (host_fd == STDOUT_FILENO || host_fd == STDERR_FILENO) {
+        trace::flush();
+        std::cout.flush();
+    }
+
+    // host write is done page by page, untouched pages are zeros
+    static const std::array<uint8, Memory::PAGE_SIZE> zeros = {};
+    Size total = 0;
+    while (total < count) {
+        Addr addr = buffer + total;
+        Size offset = addr & (Memory::PAGE_SIZE - 1);
+        Size chunk = std::min(count - total, Memory::PAGE_SIZE - offset);
+        const uint8* page = this->memory.get_host_page(addr);
+        const uint8* data = page == nullptr ? zeros.data() : page + offset;
+
+        ssize_t written = write(host_fd, data, chunk);
+        if (written < 0)
+            return total == 0 ? -errno : static_cast<int32>(total);
+        total += static_cast<Size>(written);
+        if (static_cast<Size>(written) < chunk)
+            break;
+    }
+    return static_cast<int32>(total);
+}
+
+int32 SyscallProxy::sys_read(int32 fd, Addr buffer, Size count) {
+    int host_fd = this->get_host_fd(fd);
+    if (host_fd < 0)
+        return -EBADF;
+    if (!this->is_valid_range(buffer, count))
+        return -EFAULT;
+
+    // data is read straight to guest pages
+    Size total = 0;
+    while (total < count) {
+        Addr addr = buffer + total;
+        Size offset = addr & (Memory::PAGE_SIZE - 1);
+        Size chunk = std::min(count - total, Memory::PAGE_SIZE - offset);
+
+        ssize_t bytes_read = read(host_fd, this->memory.get_writable_host_page(addr) + offset, chunk);
+        if (bytes_read < 0) {
+            if (total == 0)
+                return -errno;
+            break;
+        }
+        total += static_cast<Size>(bytes_read);
+        if (static_cast<Size>(bytes_read) < chunk)
+            break;
+    }
+
+    this->modified_addr = buffer;
+    this->modified_size = total;
+    return static_cast<int32>(total);
+}
+
+int32 SyscallProxy::sys_brk(Addr addr) {
+    // failed request returns current break
+    if (addr >= this->brk_start && addr <= this->brk_limit)
+        this->brk = addr;
+    return this->brk;
+}
+
+int32 SyscallProxy::sys_open(Addr path, int32 flags, uint32 mode) {
+    std::string name;
+    for (Addr addr = path; ; ++addr) {
+        if (!this->is_valid_range(addr, 1) || name.size() == MAX_PATH_LENGTH)
+            return -EFAULT;
+        char c = static_cast<char>(this->memory.read(addr, 1));
+        if (c == '\0')
+            break;
+        name += c;
+    }
+
+    // guest may not leave sandbox
+    if (name.empty() || name[0] == '/')
+        return -EACCES;
+    for (size_t begin = 0; begin <= name.size(); ) {
+        size_t end = std::min(name.find('/', begin), name.size());
+        if (name.compare(begin, end - begin, "..") == 0)
+            return -EACCES;
+        begin = end + 1;
+    }
+
+    int host_flags = 0;
+    switch (flags & GUEST_O_ACCMODE) {
+        case 0: host_flags = O_RDONLY; break;
+        case 1: host_flags = O_WRONLY; break;
+        case 2: host_flags = O_RDWR;   break;
+        default: return -EINVAL;
+    }
+    if (flags & GUEST_O_APPEND) host_flags |= O_APPEND;
+    if (flags & GUEST_O_CREAT)  host_flags |= O_CREAT;
+    if (flags & GUEST_O_TRUNC)  host_flags |= O_TRUNC;
+    if (flags & GUEST_O_EXCL)   host_flags |= O_EXCL;
+
+    int host_fd = open((this->sandbox + "/" + name).c_str(), host_flags, mode);
+    if (host_fd < 0)
+        return -errno;
+
+    int32 fd = STDERR_FILENO + 1;
+    while (this->files.count(fd) != 0)
+        ++fd;
+    this->files.emplace(fd, host_fd);
+    return fd;
+}
+
+int32 SyscallProxy::sys_close(int32 fd) {
+    int host_fd = this->get_host_fd(fd);
+    if (host_fd < 0)
+        return -EBADF;
+
+    this->files.erase(fd);
+    // host standard streams stay open
+    if (host_fd > STDERR_FILENO && close(host_fd) < 0)
+        return -errno;
+    return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#include <map>
+
+#include "infra/common.hpp"
+#include "memory/memory.hpp"
+#include "rf/rf.hpp"
+#include "instruction/instruction.hpp"
+
+// Serves ecall/ebreak of guest programs built with newlib.
+// Calls are proxied to host: number is taken from a7, arguments
+// from a0-a2 and result (or negated errno) is returned in a0.
+// Files are opened only inside sandbox directory, data is moved
+// directly between guest memory and host file descriptors.
+class SyscallProxy {
+public:
+    // guest visible state saved with checkpoints,
+    // open files stay with the proxy
+    struct State {
+        Addr brk = NO_VAL32;
+        bool exited = false;
+        int32 exit_code = 0;
+    };
+
+private:
+    Memory& memory;
+    std::string sandbox;
+
+    // program break bounds
+    Addr brk_start;
+    Addr brk_limit;
+    Addr brk;
+
+    // guest file descriptors mapped to host ones
+    std::map<int32, int> files;
+
+    bool exited = false;
+    int32 exit_code = 0;
+
+    // guest memory range written by the latest call
+    Addr modified_addr = NO_VAL32;
+    Size modified_size = 0;
+
+    bool is_valid_range(Addr addr, Size size) const;
+    int get_host_fd(int32 guest_fd) const;
+
+    int32 sys_exit(int32 code);
+    int32 sys_write(int32 fd, Addr buffer, Size count);
+    int32 sys_read(int32 fd, Addr buffer, Size count);
+    int32 sys_brk(Addr addr);
+    int32 sys_open(Addr path, int32 flags, uint32 mode);
+    int32 sys_close(int32 fd);
+
+public:
+    SyscallProxy(Memory& memory, Addr data_end);
+    ~SyscallProxy();
+    SyscallProxy(const SyscallProxy&) = delete;
+    SyscallProxy& operator=(const SyscallProxy&) = delete;
+
+    // serves system call or breakpoint instruction
+    void execute(const Instruction& instr, RF& rf);
+    // stops program at word which can't be decoded
+    void fault(Addr PC);
+
+    bool has_exited() const { return exited; }
+    int32 get_exit_code() const { return exit_code; }
+
+    State get_state() const { return { brk, exited, exit_code }; }
+    void set_state(const State& state);
+
+    Addr get_modified_addr() const { return modified_addr; }
+    Size get_modified_size() const { return modified_size; }
+};
+
+#endif
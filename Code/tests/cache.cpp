@@ -0,0 +1,569 @@
+#include "infra/test/catch.hpp"
+#include "cache/cache.hpp"
+
+// places new line to victim way as cache does on miss
+static Way fill(ReplacementPolicy& policy, Set set) {
+    Way way = policy.get_victim(set);
+    policy.insert(set, way);
+    return way;
+}
+
+TEST_CASE("Packed LRU matches list LRU") {
+    for (Size ways : { 1, 2, 3, 4, 8, 16 }) {
+        auto packed = ReplacementPolicy::create("lru", ways, 4);
+        auto list = ReplacementPolicy::create("lru-list", ways, 4);
+        uint32 random = 1;
+        for (int i = 0; i < 10000; ++i) {
+            random = random * 1664525u + 1013904223u;
+            Set set = (random >> 8) % 4;
+            if ((random >> 20) % 4 == 0) {
+                Way way = fill(*packed, set);
+                CHECK(way == fill(*list, set));
+            }
+            else {
+                Way way = (random >> 12) % ways;
+                packed->touch(set, way);
+                list->touch(set, way);
+            }
+            CHECK(packed->get_victim(set) == list->get_victim(set));
+        }
+    }
+}
+
+TEST_CASE("Tree PLRU evicts from the other half") {
+    auto plru = ReplacementPolicy::create("plru", 4, 1);
+    for (Way way = 0; way < 4; ++way)
+        plru->touch(0, way);
+    CHECK(plru->get_victim(0) == 0);
+    plru->touch(0, 0);
+    CHECK(plru->get_victim(0) == 2);
+    plru->touch(0, 2);
+    CHECK(plru->get_victim(0) == 1);
+
+    uint32 random = 1;
+    auto wide = ReplacementPolicy::create("plru", 16, 1);
+    for (int i = 0; i < 1000; ++i) {
+        random = random * 1664525u + 1013904223u;
+        Way way = (random >> 8) % 16;
+        wide->touch(0, way);
+        CHECK(wide->get_victim(0) != way);
+    }
+    CHECK_THROWS(ReplacementPolicy::create("plru", 3, 1));
+}
+
+TEST_CASE("RRIP keeps reused line during scan") {
+    auto srrip = ReplacementPolicy::create("srrip", 4, 1);
+    for (int i = 0; i < 4; ++i)
+        fill(*srrip, 0);
+    srrip->touch(0, 2);
+    for (int i = 0; i < 3; ++i)
+        CHECK(fill(*srrip, 0) != 2);
+
+    // bimodal insertion makes scan lines replace each other
+    auto brrip = ReplacementPolicy::create("brrip", 4, 1);
+    for (int i = 0; i < 4; ++i)
+        fill(*brrip, 0);
+    Way scan = fill(*brrip, 0);
+    for (int i = 0; i < 20; ++i)
+        CHECK(fill(*brrip, 0) == scan);
+}
+
+TEST_CASE("FIFO and random replacement") {
+    auto fifo = ReplacementPolicy::create("fifo", 3, 2);
+    for (Way way : { 0, 1, 2, 0, 1 }) {
+        fifo->touch(0, 2);
+        CHECK(fill(*fifo, 0) == way);
+    }
+    CHECK(fifo->get_victim(1) == 0);
+
+    auto random = ReplacementPolicy::create("random", 5, 1);
+    std::vector<int> hits(5);
+    for (int i = 0; i < 1000; ++i)
+        hits.at(fill(*random, 0))++;
+    CHECK(std::count(hits.begin(), hits.end(), 0) == 0);
+
+    CHECK_THROWS(ReplacementPolicy::create("mru", 4, 1));
+}
+
+TEST_CASE("Invalidated way is the next victim") {
+    for (const char* name : { "lru", "lru-list", "plru", "srrip", "brrip", "fifo" }) {
+        auto policy = ReplacementPolicy::create(name, 4, 2);
+        for (int i = 0; i < 4; ++i)
+            fill(*policy, 1);
+        for (Way way = 0; way < 4; ++way)
+            policy->touch(1, way);
+        INFO(name);
+        policy->invalidate(1, 2);
+        CHECK(policy->get_victim(1) == 2);
+        CHECK(fill(*policy, 1) == 2);
+    }
+}
+
+TEST_CASE("Cache fills line and hits it") {
+    std::vector<uint8> image(256);
+    for (Size i = 0; i < image.size(); ++i)
+        image[i] = i;
+    PerfMemory memory(image, 3);
+    Cache cache(memory, 2, 4, 16, "plru");
+
+    auto wait = [&]() {
+        int cycles = 0;
+        while (!cache.get_request_status().is_ready) {
+            memory.clock();
+            cache.clock();
+            ++cycles;
+        }
+        return cycles;
+    };
+
+    cache.send_read_request(0x24, 4);
+    CHECK(wait() > 0);
+    CHECK(cache.get_request_status().data == 0x27262524);
+    cache.send_read_request(0x28, 2);
+    CHECK(wait() == 0);
+    CHECK(cache.get_request_status().data == 0x2928);
+    CHECK_THROWS(Cache(memory, 2, 4, 16, "mru"));
+}
+
+TEST_CASE("Cache fills invalid ways before replacing") {
+    std::vector<uint8> image(256);
+    PerfMemory memory(image, 3);
+    Cache cache(memory, 4, 1, 16, "random");
+
+    auto read = [&](Addr addr) {
+        cache.send_read_request(addr, 4);
+        int cycles = 0;
+        while (!cache.get_request_status().is_ready) {
+            memory.clock();
+            cache.clock();
+            ++cycles;
+        }
+        return cycles;
+    };
+
+    for (Addr addr : { 0x00, 0x10, 0x20, 0x30 })
+        CHECK(read(addr) > 0);
+    for (Addr addr : { 0x00, 0x10, 0x20, 0x30 })
+        CHECK(read(addr) == 0);
+
+    // line dropped by system call leaves its way to the next miss
+    cache.invalidate(0x10, 4);
+    CHECK(read(0x40) > 0);
+    for (Addr addr : { 0x00, 0x20, 0x30, 0x40 })
+        CHECK(read(addr) == 0);
+}
+
+TEST_CASE("Cache hierarchy keeps data coherent") {
+    using Inclusion = Cache::Inclusion;
+    for (Inclusion inclusion : { Inclusion::NINE, Inclusion::INCLUSIVE, Inclusion::EXCLUSIVE }) {
+        std::vector<uint8> image(1024);
+        PerfMemory memory(image, 3);
+        Cache::Config config;
+        config.num_ways = 2;
+        config.num_sets = 4;
+        config.line_size = 32;
+        config.latency = 2;
+        config.inclusion = inclusion;
+        Cache l2(memory, config);
+        Cache l1(l2, 2, 2, 16);
+
+        auto wait = [&]() {
+            while (!l1.get_request_status().is_ready) {
+                memory.clock();
+                l2.clock();
+                l1.clock();
+            }
+        };
+
+        std::vector<uint8> reference(image.size());
+        uint32 random = 1;
+        for (int i = 0; i < 5000; ++i) {
+            random = random * 1664525u + 1013904223u;
+            Addr addr = ((random >> 8) % image.size()) & ~3u;
+            if ((random >> 28) < 6) {
+                l1.send_write_request(i, addr, 4);
+                for (Size b = 0; b < 4; ++b)
+                    reference[addr + b] = static_cast<uint8>(i >> 8*b);
+                wait();
+            }
+            else {
+                l1.send_read_request(addr, 4);
+                wait();
+                uint32 value = reference[addr] | reference[addr + 1] << 8 | reference[addr + 2] << 16 | reference[addr + 3] << 24;
+                CHECK(l1.get_request_status().data == value);
+            }
+        }
+
+        const auto& s1 = l1.get_stats();
+        const auto& s2 = l2.get_stats();
+        CHECK(s1.hits + s1.misses == 5000);
+        CHECK(s2.writes == s1.writebacks);
+        if (inclusion != Inclusion::EXCLUSIVE)
+            CHECK(s2.reads == s1.misses);
+        CHECK((inclusion == Inclusion::INCLUSIVE) == (s1.back_invalidations != 0));
+
+        l2.write_back();
+        l1.write_back();
+        std::vector<uint8> bytes(image.size());
+        memory.read_functional(bytes.data(), 0, bytes.size());
+        CHECK(bytes == reference);
+    }
+}
+
+TEST_CASE("Non-blocking cache hits under miss") {
+    std::vector<uint8> image(256);
+    for (Size i = 0; i < image.size(); ++i)
+        image[i] = i;
+    PerfMemory memory(image, 10);
+    Cache::Config config;
+    config.num_ways = 2;
+    config.num_sets = 4;
+    config.mshrs = 2;
+    Cache cache(memory, config);
+
+    auto wait = [&]() {
+        int cycles = 0;
+        while (!cache.get_request_status().is_ready) {
+            memory.clock();
+            cache.clock();
+            ++cycles;
+        }
+        return cycles;
+    };
+
+    cache.send_read_request(0x10, 4);
+    CHECK(wait() > 10);
+    // write miss is posted, read hits while line is filled
+    cache.send_write_request(0xdeadbeef, 0x20, 4);
+    CHECK(cache.get_request_status().is_ready);
+    cache.send_read_request(0x14, 4);
+    CHECK(wait() == 0);
+    CHECK(cache.get_request_status().data == 0x17161514);
+    // the second miss to the line waits for the first one
+    cache.send_read_request(0x20, 4);
+    CHECK(wait() > 0);
+    CHECK(cache.get_request_status().data == 0xdeadbeef);
+
+    const auto& stats = cache.get_stats();
+    CHECK(stats.misses == 2);
+    CHECK(stats.secondary_misses == 1);
+    CHECK(stats.hits_under_miss == 1);
+}
+
+TEST_CASE("MSHRs don't change number of primary misses") {
+    auto run = [](Size mshrs) {
+        PerfMemory memory(std::vector<uint8>(256), 10);
+        Cache::Config config;
+        config.num_ways = 4;
+        config.num_sets = 4;
+        config.mshrs = mshrs;
+        Cache cache(memory, config);
+
+        auto clock = [&]() {
+            memory.clock();
+            cache.clock();
+        };
+
+        // words are stored and loaded in turn, lines fit into cache
+        for (Addr addr = 0; addr < 256; addr += 4) {
+            while (cache.is_busy())
+                clock();
+            if (addr % 8 == 0) {
+                cache.send_write_request(addr, addr, 4);
+                continue;
+            }
+            cache.send_read_request(addr, 4);
+            while (!cache.get_request_status().is_ready)
+                clock();
+        }
+        return cache.get_stats();
+    };
+
+    const auto blocking = run(0);
+    const auto stats = run(4);
+    CHECK(blocking.misses == 16);
+    CHECK(blocking.secondary_misses == 0);
+    CHECK(stats.misses == 16);
+    CHECK(stats.secondary_misses != 0);
+    CHECK(stats.hits + stats.misses + stats.secondary_misses == 64);
+}
+
+TEST_CASE("Non-blocking hierarchy keeps data coherent") {
+    std::vector<uint8> image(1024);
+    PerfMemory memory(image, 3);
+    Cache::Config config;
+    config.num_ways = 2;
+    config.num_sets = 4;
+    config.line_size = 32;
+    config.latency = 1;
+    config.mshrs = 2;
+    Cache l2(memory, config);
+    config.num_sets = 2;
+    config.line_size = 16;
+    config.latency = 0;
+    config.mshrs = 3;
+    Cache l1(l2, config);
+
+    auto clock = [&]() {
+        memory.clock();
+        l2.clock();
+        l1.clock();
+    };
+
+    std::vector<uint8> reference(image.size());
+    uint32 random = 1;
+    for (int i = 0; i < 5000; ++i) {
+        random = random * 1664525u + 1013904223u;
+        Addr addr = ((random >> 8) % image.size()) & ~3u;
+        while (l1.is_busy())
+            clock();
+        if ((random >> 28) < 6) {
+            l1.send_write_request(i, addr, 4);
+            for (Size b = 0; b < 4; ++b)
+                reference[addr + b] = static_cast<uint8>(i >> 8*b);
+        }
+        else {
+            l1.send_read_request(addr, 4);
+            // some reads are abandoned as by fetch after branch misprediction
+            if ((random >> 4) % 4 == 0)
+                continue;
+            while (!l1.get_request_status().is_ready)
+                clock();
+            uint32 value = reference[addr] | reference[addr + 1] << 8 | reference[addr + 2] << 16 | reference[addr + 3] << 24;
+            CHECK(l1.get_request_status().data == value);
+        }
+    }
+    CHECK(l1.get_stats().misses_under_miss != 0);
+    CHECK(l2.get_stats().hits_under_miss != 0);
+
+    l2.write_back();
+    l1.write_back();
+    std::vector<uint8> bytes(image.size());
+    memory.read_functional(bytes.data(), 0, bytes.size());
+    CHECK(bytes == reference);
+}
+
+TEST_CASE("Prefetchers predict next lines and strides") {
+    std::vector<Addr> lines;
+    auto next_line = Prefetcher::create("next-line", { 2, 1, 16 });
+    next_line->access(0x104, 0, false, lines);
+    CHECK(lines.empty());
+    next_line->access(0x104, 0, true, lines);
+    CHECK(lines == std::vector<Addr>{ 0x110, 0x120 });
+
+    // stream is confirmed by the second miss in a row
+    lines.clear();
+    auto stream = Prefetcher::create("stream", { 1, 2, 16 });
+    stream->access(0x200, 0, true, lines);
+    stream->access(0x500, 0, true, lines);
+    CHECK(lines.empty());
+    stream->access(0x1f0, 0, true, lines);
+    CHECK(lines == std::vector<Addr>{ 0x1d0 });
+
+    // stride is trusted after it repeats twice
+    lines.clear();
+    auto stride = Prefetcher::create("stride", { 1, 4, 16 });
+    for (Addr addr : { 0x1000, 0x1040, 0x1080 })
+        stride->access(addr, 0x400, false, lines);
+    CHECK(lines.empty());
+    stride->access(0x10c0, 0x400, false, lines);
+    CHECK(lines == std::vector<Addr>{ 0x11c0 });
+
+    CHECK(Prefetcher::create("none", { 1, 1, 16 }) == nullptr);
+    CHECK_THROWS(Prefetcher::create("stride", { 0, 1, 16 }));
+    CHECK_THROWS(Prefetcher::create("markov", { 1, 1, 16 }));
+}
+
+TEST_CASE("Stride prefetcher hides misses of array walk") {
+    std::vector<uint8> image(4096);
+    for (Size i = 0; i < image.size(); ++i)
+        image[i] = i;
+    PerfMemory::Config memory_config;
+    memory_config.latency = 20;
+    memory_config.read_queue_size = 4;
+    memory_config.max_outstanding = 4;
+
+    auto walk = [&](const std::string& prefetcher) {
+        PerfMemory memory(memory_config);
+        memory.write_bytes(image.data(), 0, image.size());
+        Cache::Config config;
+        config.mshrs = 4;
+        config.prefetcher = prefetcher;
+        config.prefetch_degree = 2;
+        config.prefetch_distance = 2;
+        Cache cache(memory, config);
+
+        int cycles = 0;
+        for (Addr addr = 0; addr < image.size(); addr += 8) {
+            cache.send_read_request(addr, 4, 0x400);
+            while (!cache.get_request_status().is_ready) {
+                memory.clock();
+                cache.clock();
+                ++cycles;
+            }
+            CHECK(cache.get_request_status().data == (addr & 0xff) * 0x01010101u + 0x03020100u);
+            memory.clock();
+            cache.clock();
+            ++cycles;
+        }
+        return std::make_pair(cycles, cache.get_stats());
+    };
+
+    const auto [base_cycles, base] = walk("none");
+    const auto [cycles, stats] = walk("stride");
+    CHECK(base.misses == image.size() / 16);
+    CHECK(stats.misses < base.misses / 3);
+    CHECK(cycles < base_cycles / 2);
+    CHECK(stats.prefetch_hits + stats.late_prefetches > stats.prefetches * 9 / 10);
+}
+
+TEST_CASE("Victim cache keeps conflicting lines") {
+    auto run = [](Size ways, Size victims) {
+        PerfMemory memory(std::vector<uint8>(256), 3);
+        Cache::Config config;
+        config.num_ways = ways;
+        config.num_sets = 4;
+        config.victim_entries = victims;
+        Cache cache(memory, config);
+
+        // three lines of the same set are written and read in turn
+        std::vector<uint8> reference(256);
+        for (int i = 0; i < 30; ++i) {
+            Addr addr = (i % 3) * 0x40;
+            if (i % 2 == 0) {
+                cache.send_write_request(i, addr, 4);
+                reference[addr] = i;
+            }
+            else {
+                cache.send_read_request(addr, 4);
+            }
+            while (!cache.get_request_status().is_ready) {
+                memory.clock();
+                cache.clock();
+            }
+            if (i % 2 != 0)
+                CHECK(cache.get_request_status().data == reference[addr]);
+        }
+
+        cache.write_back();
+        std::vector<uint8> bytes(reference.size());
+        memory.read_functional(bytes.data(), 0, bytes.size());
+        CHECK(bytes == reference);
+        return cache.get_stats();
+    };
+
+    CHECK(run(1, 0).misses == 30);
+    const auto stats = run(1, 2);
+    CHECK(stats.misses == 3);
+    CHECK(stats.victim_hits == 27);
+    // as good as adding ways for this set
+    CHECK(run(3, 0).misses == 3);
+}
+
+TEST_CASE("Write policies keep hierarchy coherent") {
+    for (int policy = 0; policy < 8; ++policy) {
+        std::vector<uint8> image(1024);
+        PerfMemory memory(image, 3);
+        Cache::Config config;
+        config.num_ways = 2;
+        config.num_sets = 4;
+        config.line_size = 32;
+        config.latency = 1;
+        config.mshrs = 2;
+        config.write_through = (policy & 1) != 0;
+        config.write_allocate = (policy & 2) == 0;
+        config.write_buffer = (policy & 4) != 0 ? 2 : 0;
+        Cache l2(memory, config);
+        config.num_sets = 2;
+        config.line_size = 16;
+        config.latency = 0;
+        config.mshrs = policy % 3;
+        Cache l1(l2, config);
+
+        auto clock = [&]() {
+            memory.clock();
+            l2.clock();
+            l1.clock();
+        };
+
+        std::vector<uint8> reference(image.size());
+        uint32 random = 1;
+        for (int i = 0; i < 3000; ++i) {
+            random = random * 1664525u + 1013904223u;
+            Addr addr = ((random >> 8) % image.size()) & ~3u;
+            while (l1.is_busy())
+                clock();
+            if ((random >> 28) < 8) {
+                l1.send_write_request(i, addr, 4);
+                for (Size b = 0; b < 4; ++b)
+                    reference[addr + b] = static_cast<uint8>(i >> 8*b);
+            }
+            else {
+                l1.send_read_request(addr, 4);
+                while (!l1.get_request_status().is_ready)
+                    clock();
+                uint32 value = reference[addr] | reference[addr + 1] << 8 | reference[addr + 2] << 16 | reference[addr + 3] << 24;
+                CHECK(l1.get_request_status().data == value);
+            }
+        }
+        CHECK((l1.get_stats().written_through != 0) == config.write_through);
+        CHECK((l1.get_stats().written_around != 0) == !config.write_allocate);
+
+        l2.write_back();
+        l1.write_back();
+        std::vector<uint8> bytes(image.size());
+        memory.read_functional(bytes.data(), 0, bytes.size());
+        CHECK(bytes == reference);
+    }
+}
+
+TEST_CASE("Write buffer takes stores off critical path") {
+    PerfMemory::Config memory_config;
+    memory_config.latency = 10;
+    memory_config.write_queue_size = 4;
+    memory_config.max_outstanding = 4;
+
+    auto store = [&](bool write_through, bool write_allocate, Size write_buffer) {
+        PerfMemory memory(memory_config);
+        Cache::Config config;
+        config.num_ways = 2;
+        config.num_sets = 4;
+        config.write_through = write_through;
+        config.write_allocate = write_allocate;
+        config.write_buffer = write_buffer;
+        Cache cache(memory, config);
+
+        // words of each line are stored one after another
+        int cycles = 0;
+        for (Addr addr = 0; addr < 256; addr += 4) {
+            cache.send_write_request(addr, addr, 4);
+            while (!cache.get_request_status().is_ready) {
+                memory.clock();
+                cache.clock();
+                ++cycles;
+            }
+            memory.clock();
+            cache.clock();
+            ++cycles;
+        }
+        // buffer drains in background
+        for (int i = 0; i < 20; ++i) {
+            memory.clock();
+            cache.clock();
+        }
+
+        cache.write_back();
+        for (Addr addr = 0; addr < 256; addr += 4)
+            CHECK(memory.read(addr, 4) == addr);
+        return std::make_pair(cycles, cache.get_stats());
+    };
+
+    const auto [base_cycles, base] = store(false, true, 0);
+    const auto [cycles, stats] = store(true, false, 4);
+    CHECK(base.misses == 16);
+    CHECK(cycles == 64);
+    CHECK(cycles < base_cycles / 2);
+    // a memory write per line
+    CHECK(stats.coalesced_writes == 48);
+    CHECK(stats.drained_writes == 16);
+}
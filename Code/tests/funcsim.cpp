@@ -0,0 +1,276 @@
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+
+#include "infra/test/catch.hpp"
+#include "funcsim/decode_cache.hpp"
+#include "funcsim/funcsim.hpp"
+#include "perfsim/perfsim.hpp"
+
+TEST_CASE("Decode cache hit and miss") {
+    DecodeCache cache(16);
+    CHECK(cache.lookup(0x100) == nullptr);
+
+    cache.fill(0x100, 0x00f70463);  // beq
+    const auto* predecoded = cache.lookup(0x100);
+    REQUIRE(predecoded != nullptr);
+    CHECK(predecoded->opcode == Instruction::OPCODE_beq);
+    CHECK(predecoded->imm_v == 8);
+
+    // same index, different PC
+    CHECK(cache.lookup(0x140) == nullptr);
+    CHECK(cache.get_hits() == 1);
+    CHECK(cache.get_misses() == 2);
+}
+
+TEST_CASE("Decode cache invalidation") {
+    DecodeCache cache(16);
+    cache.fill(0x100, 0x00f70463);
+    cache.fill(0x104, 0x00052783);
+
+    // byte store to the last byte of first instruction
+    cache.invalidate(0x103, 1);
+    CHECK(cache.lookup(0x100) == nullptr);
+    CHECK(cache.lookup(0x104) != nullptr);
+
+    // unaligned halfword store across instructions boundary
+    cache.fill(0x100, 0x00f70463);
+    cache.invalidate(0x103, 2);
+    CHECK(cache.lookup(0x100) == nullptr);
+    CHECK(cache.lookup(0x104) == nullptr);
+
+    CHECK_THROWS(DecodeCache(10));
+}
+
+// RISC-V executables from inputs/, others are host ELFs for the loader tests
+static std::vector<std::string> riscv_binaries() {
+    std::vector<std::string> binaries;
+    for (const auto& entry : std::filesystem::directory_iterator("inputs")) {
+        std::ifstream file(entry.path(), std::ios::binary);
+        char header[20] = { };
+        file.read(header, sizeof(header));
+        // ELF magic and e_machine of RISC-V
+        if (file && std::string(header, 4) == "\x7f" "ELF" && header[18] == '\xf3' && header[19] == 0)
+            binaries.push_back(entry.path().string());
+    }
+    std::sort(binaries.begin(), binaries.end());
+    return binaries;
+}
+
+static void check_lockstep(const std::string& binary, FuncSim& tested, uint64 limit) {
+    FuncSim reference(binary);
+
+    uint64 executed = 0;
+    for (uint32 chunk = 1; executed < limit; chunk = chunk % 61 + 1) {
+        reference.run(chunk);
+        tested.run(chunk);
+        executed += chunk;
+
+        INFO(binary << " after " << executed << " instructions");
+        REQUIRE(reference.get_PC() == tested.get_PC());
+        for (size_t i = 0; i < Register::MAX_NUMBER; ++i)
+            REQUIRE(reference.get_rf().get_values()[i] == tested.get_rf().get_values()[i]);
+        REQUIRE(reference.get_executed() == tested.get_executed());
+        REQUIRE(reference.has_exited() == tested.has_exited());
+        REQUIRE(reference.get_exit_code() == tested.get_exit_code());
+        REQUIRE(tested.get_memory().diff(reference.get_memory().snapshot()).empty());
+
+        if (reference.has_exited())
+            break;
+    }
+    // file written by inputs/syscalls
+    std::remove("output.txt");
+}
+
+static void check_lockstep(const std::string& binary, FuncSim::Engine engine, uint64 limit) {
+    FuncSim tested(binary);
+    tested.set_engine(engine);
+    check_lockstep(binary, tested, limit);
+}
+
+TEST_CASE("Threaded engine matches step") {
+    const auto binaries = riscv_binaries();
+    // inputs/smc rewrites its own hot loop
+    REQUIRE(std::count(binaries.begin(), binaries.end(), "inputs/smc") == 1);
+    for (const auto& binary : binaries)
+        check_lockstep(binary, FuncSim::Engine::THREADED, 2000000);
+}
+
+TEST_CASE("JIT engine matches step") {
+    if (!Jit::is_supported())
+        return;
+    for (const auto& binary : riscv_binaries())
+        check_lockstep(binary, FuncSim::Engine::JIT, 2000000);
+}
+
+TEST_CASE("JIT matches step with code buffer overflowing") {
+    if (!Jit::is_supported())
+        return;
+    // a few blocks fill the buffer, so translations are dropped over and over
+    FuncSim tested("inputs/8-queens-o0");
+    tested.enable_jit(2, 4096);
+    check_lockstep("inputs/8-queens-o0", tested, 2000000);
+    CHECK(tested.get_engine_stats().buffer_resets > 2);
+    CHECK(tested.get_engine_stats().translations > tested.get_engine_stats().buffer_resets);
+}
+
+TEST_CASE("Fused operations retire precisely") {
+    // varying chunks stop the engine inside and between fused pairs
+    check_lockstep("inputs/fusion", FuncSim::Engine::THREADED, 50000);
+
+    FuncSim fused("inputs/fusion");
+    FuncSim unfused("inputs/fusion");
+    fused.set_engine(FuncSim::Engine::THREADED);
+    unfused.set_engine(FuncSim::Engine::THREADED);
+    unfused.set_fusion(false);
+    fused.run_until_exit();
+    unfused.run_until_exit();
+    CHECK(fused.get_executed() == 40897);
+    CHECK(unfused.get_executed() == 40897);
+    CHECK(fused.get_exit_code() == 24);
+}
+
+TEST_CASE("Reuse distances don't depend on engine") {
+    FuncSim stepped("inputs/fusion");
+    FuncSim threaded("inputs/fusion");
+    stepped.enable_reuse_distance(64);
+    threaded.enable_reuse_distance(64);
+    threaded.set_engine(FuncSim::Engine::THREADED);
+    stepped.run_until_exit();
+    // batches of odd size stop the engine inside blocks
+    while (!threaded.has_exited())
+        threaded.run_batch(37);
+
+    CHECK(stepped.get_instruction_reuse()->get_accesses() == 40897);
+    CHECK(stepped.get_data_reuse()->get_accesses() != 0);
+    for (auto get : { &FuncSim::get_instruction_reuse, &FuncSim::get_data_reuse }) {
+        const ReuseDistance* expected = (stepped.*get)();
+        const ReuseDistance* actual = (threaded.*get)();
+        CHECK(actual->get_accesses() == expected->get_accesses());
+        CHECK(actual->get_cold_misses() == expected->get_cold_misses());
+        CHECK(actual->get_histogram() == expected->get_histogram());
+    }
+
+    // translated code isn't observed
+    if (Jit::is_supported())
+        CHECK_THROWS_AS(threaded.set_engine(FuncSim::Engine::JIT), std::invalid_argument);
+}
+
+TEST_CASE("Batch stops at budget, count, breakpoint and exit") {
+    const Addr square = 0x11140;  // subroutine called once per array element
+    for (auto engine : { FuncSim::Engine::STEP, FuncSim::Engine::THREADED, FuncSim::Engine::JIT }) {
+        if (engine == FuncSim::Engine::JIT && !Jit::is_supported())
+            continue;
+        FuncSim simulator("inputs/fusion");
+        simulator.set_engine(engine);
+
+        auto summary = simulator.run_batch(100);
+        CHECK(summary.reason == FuncSim::StopReason::BUDGET);
+        CHECK(summary.retired == 100);
+
+        FuncSim::StopPredicate count;
+        count.max_executed = 120;
+        summary = simulator.run_batch(5000000000ull, count);
+        CHECK(summary.reason == FuncSim::StopReason::COUNT);
+        CHECK(summary.retired == 20);
+        CHECK(simulator.get_executed() == 120);
+
+        FuncSim::StopPredicate breakpoint;
+        breakpoint.breakpoint = square;
+        for (int i = 0; i < 16; ++i) {
+            summary = simulator.run_batch(5000000000ull, breakpoint);
+            REQUIRE(summary.reason == FuncSim::StopReason::BREAKPOINT);
+            CHECK(simulator.get_PC() == square);
+        }
+
+        summary = simulator.run_batch(5000000000ull, breakpoint);
+        CHECK(summary.reason == FuncSim::StopReason::EXIT);
+        CHECK(summary.host_seconds >= 0);
+        CHECK(simulator.get_executed() == 40897);
+        CHECK(simulator.get_exit_code() == 24);
+    }
+}
+
+TEST_CASE("JIT translates again after breakpoint batch") {
+    if (!Jit::is_supported())
+        return;
+    FuncSim simulator("inputs/8-queens-o0");
+    simulator.set_engine(FuncSim::Engine::JIT);
+    simulator.run_batch(500000);
+    const uint64 translations = simulator.get_engine_stats().translations;
+    CHECK(translations != 0);
+
+    // breakpoint drops all translations
+    FuncSim::StopPredicate breakpoint;
+    breakpoint.breakpoint = 0x4;
+    simulator.run_batch(10, breakpoint);
+    simulator.run_batch(500000);
+    CHECK(simulator.get_engine_stats().translations >= 2 * translations);
+}
+
+TEST_CASE("Guest memory is sparse") {
+    for (auto engine : { FuncSim::Engine::STEP, FuncSim::Engine::THREADED, FuncSim::Engine::JIT }) {
+        if (engine == FuncSim::Engine::JIT && !Jit::is_supported())
+            continue;
+        FuncSim simulator("inputs/sparse");
+        simulator.set_engine(engine);
+        simulator.run_until_exit();
+        CHECK(simulator.get_exit_code() == 42);
+        // pages of image, stack and the word at 1 GiB
+        CHECK(simulator.get_memory().get_resident_pages() <= 4);
+    }
+}
+
+TEST_CASE("Segments are mapped copy-on-write") {
+    for (auto engine : { FuncSim::Engine::STEP, FuncSim::Engine::THREADED, FuncSim::Engine::JIT }) {
+        if (engine == FuncSim::Engine::JIT && !Jit::is_supported())
+            continue;
+        FuncSim simulator("inputs/bss");
+        // 16 full pages of .data are shared with the file
+        CHECK(simulator.get_memory().get_shared_pages() == 16);
+        simulator.set_engine(engine);
+        simulator.run_until_exit();
+        CHECK(simulator.get_exit_code() == 15);
+        // written page of .data is copied, 64 MiB .bss takes a single page
+        CHECK(simulator.get_memory().get_shared_pages() == 15);
+        CHECK(simulator.get_memory().get_resident_pages() <= 6);
+    }
+}
+
+TEST_CASE("Checkpoint forks functional warm-up") {
+    FuncSim warmup("inputs/fusion");
+    warmup.set_engine(FuncSim::Engine::THREADED);
+    FuncSim::StopPredicate stop;
+    stop.max_executed = 20000;
+    warmup.run_batch(1000000, stop);
+    const auto checkpoint = warmup.checkpoint();
+    CHECK(checkpoint.executed == 20000);
+
+    warmup.run_until_exit();
+    CHECK(warmup.get_executed() == 40897);
+
+    // the same simulator goes through the second half again
+    warmup.restore(checkpoint);
+    CHECK(!warmup.has_exited());
+    CHECK(warmup.get_PC() == checkpoint.PC);
+    warmup.run_until_exit();
+    CHECK(warmup.get_executed() == 40897);
+    CHECK(warmup.get_exit_code() == 24);
+
+    for (auto engine : { FuncSim::Engine::STEP, FuncSim::Engine::JIT }) {
+        if (engine == FuncSim::Engine::JIT && !Jit::is_supported())
+            continue;
+        FuncSim fork("inputs/fusion");
+        fork.set_engine(engine);
+        fork.restore(checkpoint);
+        fork.run_until_exit();
+        CHECK(fork.get_executed() == 40897);
+        CHECK(fork.get_exit_code() == 24);
+    }
+
+    PerfSim perf("inputs/fusion", checkpoint);
+    perf.run_until_exit();
+    CHECK(perf.get_exit_code() == 24);
+    CHECK(perf.get_ops() == 40897 - 20000);
+}
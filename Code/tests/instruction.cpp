@@ -1,5 +1,6 @@
 #include "infra/test/catch.hpp"
 #include "instruction/instruction.hpp"
+#include "instruction/isa.hpp"
 
 TEST_CASE("Instruction decode") {
     Instruction i(0b0000000'00010'00001'000'10000'0110011, 13u);
@@ -23,4 +24,43 @@ TEST_CASE("lui") {
     CHECK(i.get_imm_v() == 541065216);
     i.execute();
     CHECK(i.get_rd_v() == 541065216);
-}
\ No newline at end of file
+}
+
+TEST_CASE("Table decoder matches linear scan") {
+    uint32 raw = 0x12345678;
+    for (int i = 0; i < 100000; ++i) {
+        // force valid 32-bit encoding on half of words
+        raw = raw * 1664525u + 1013904223u;
+        uint32 word = (i % 2) ? (raw | 0b11) : raw;
+
+        const ISAEntry* expected = nullptr;
+        try { expected = &find_entry_linear(word); }
+        catch (const std::invalid_argument&) { }
+
+        if (expected == nullptr)
+            CHECK_THROWS(find_entry(word));
+        else
+            CHECK(&find_entry(word) == expected);
+    }
+}
+
+TEST_CASE("Decoder extracts only fields of format") {
+    auto store = Instruction::predecode(0xfef42623);  // sw $a5, -20($s0)
+    CHECK(store.opcode == Instruction::OPCODE_sw);
+    CHECK(store.rs1 == 8);
+    CHECK(store.rs2 == 15);
+    CHECK(store.rd == 0);
+    CHECK(store.imm_v == -20);
+
+    auto branch = Instruction::predecode(0xfef718e3);  // bne $a4, $a5, -16
+    CHECK(branch.opcode == Instruction::OPCODE_bne);
+    CHECK(branch.rs1 == 14);
+    CHECK(branch.rs2 == 15);
+    CHECK(branch.rd == 0);
+    CHECK(branch.imm_v == -16);
+
+    auto jump = Instruction::predecode(0xf95ff06f);  // jal $zero, -108
+    CHECK(jump.rs1 == 0);
+    CHECK(jump.rs2 == 0);
+    CHECK(jump.imm_v == -108);
+}
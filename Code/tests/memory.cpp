@@ -1,27 +1,118 @@
+#include <fstream>
+#include <unistd.h>
+
 #include "infra/test/catch.hpp"
 #include "memory/memory.hpp"
 
-//TEST_CASE("Memory read/write byte") {
-//    std::vector<uint8> data {'a', 'b', 'c', 'd'};
-//    Memory memory(data);
-//    CHECK(memory.read_byte(1) == 'b');
-//    memory.write_byte('x', 1);
-//    CHECK(memory.read_byte(1) == 'x');
-//}
+TEST_CASE("Memory read/write byte") {
+    std::vector<uint8> data {'a', 'b', 'c', 'd'};
+    FuncMemory memory(data);
+    CHECK(memory.read(1, 1) == 'b');
+    memory.write('x', 1, 1);
+    CHECK(memory.read(1, 1) == 'x');
+    CHECK(memory.read(0, 4) == 0x6463'7861);
+}
+
+TEST_CASE("Memory pages are allocated on write") {
+    FuncMemory memory(std::vector<uint8>(3 * Memory::PAGE_SIZE, 0));
+    CHECK(memory.get_resident_pages() == 0);
+
+    // untouched memory reads as zeros anywhere in address space
+    CHECK(memory.read(0x1234'5678, 4) == 0);
+    CHECK(memory.read(0xffff'fffc, 4) == 0);
+    CHECK(memory.get_resident_pages() == 0);
+
+    memory.write(0xdeadbeef, 0xffff'fffc, 4);
+    CHECK(memory.read(0xffff'fffc, 4) == 0xdeadbeef);
+    CHECK(memory.get_resident_pages() == 1);
+    CHECK_THROWS(memory.read(0xffff'fffe, 4));
+
+    // word crossing boundary of pages under different tables
+    memory.write(0x0102'0304, 0x003f'fffe, 4);
+    CHECK(memory.read(0x003f'fffe, 4) == 0x0102'0304);
+    CHECK(memory.get_resident_pages() == 3);
+    CHECK(memory.get_resident_size() < 64 * 1024);
+}
+
+TEST_CASE("Memory bulk copies") {
+    FuncMemory memory(std::vector<uint8>{});
+    std::vector<uint8> data(3 * Memory::PAGE_SIZE);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = static_cast<uint8>(i * 7);
+
+    memory.write_bytes(data.data(), 0x1000'0800, data.size());
+    CHECK(memory.get_resident_pages() == 4);
+
+    std::vector<uint8> copy(data.size() + 16, 0xff);
+    memory.read_bytes(copy.data(), 0x1000'0800, copy.size());
+    CHECK(std::equal(data.begin(), data.end(), copy.begin()));
+    CHECK(copy.back() == 0);
+}
+
+TEST_CASE("Memory shared pages are copied on write") {
+    auto host = std::make_shared<std::array<uint8, 2 * Memory::PAGE_SIZE>>();
+    uint8* bytes = host->data();
+    while (reinterpret_cast<uintptr_t>(bytes) % Memory::PAGE_SIZE != 0)
+        ++bytes;
+    std::fill_n(bytes, Memory::PAGE_SIZE, 0x5a);
+
+    FuncMemory memory;
+    CHECK_THROWS(memory.map_shared(0x1000'0800, bytes, Memory::PAGE_SIZE, host));
+    memory.map_shared(0x1000'0000, bytes, Memory::PAGE_SIZE, host);
+    CHECK(memory.get_shared_pages() == 1);
+    CHECK(memory.get_resident_pages() == 0);
+    CHECK(memory.read<4>(0x1000'0010) == 0x5a5a'5a5a);
+
+    memory.write<4>(0x1234'5678, 0x1000'0010);
+    CHECK(memory.read<4>(0x1000'0010) == 0x1234'5678);
+    CHECK(memory.read<1>(0x1000'0fff) == 0x5a);
+    CHECK(memory.get_shared_pages() == 0);
+    CHECK(memory.get_resident_pages() == 1);
+    // host memory is left intact
+    CHECK(bytes[0x10] == 0x5a);
+}
+
+TEST_CASE("Memory snapshots share pages until written") {
+    FuncMemory memory;
+    memory.write<4>(0x1111'2222, 0x1000);
+    memory.write<4>(0x3333'4444, 0x2000'0000);
+    auto snapshot = memory.snapshot();
+    CHECK(memory.diff(snapshot).empty());
+
+    // page cached in write TLB must be copied as well
+    memory.write<4>(0x5555'6666, 0x1000);
+    memory.write<4>(0, 0x5000);
+    memory.write<1>(7, 0x3000'0000);
+    CHECK(memory.diff(snapshot) == std::vector<Addr>{ 0x1000, 0x3000'0000 });
+
+    FuncMemory fork;
+    fork.restore(snapshot);
+    CHECK(fork.read<4>(0x1000) == 0x1111'2222);
+    CHECK(fork.read<4>(0x2000'0000) == 0x3333'4444);
+    fork.write<4>(1, 0x2000'0000);
+    CHECK(memory.read<4>(0x2000'0000) == 0x3333'4444);
+    CHECK(fork.diff(snapshot) == std::vector<Addr>{ 0x2000'0000 });
+
+    memory.restore(snapshot);
+    CHECK(memory.read<4>(0x1000) == 0x1111'2222);
+    CHECK(memory.read<1>(0x3000'0000) == 0);
+    CHECK(memory.diff(snapshot).empty());
+    CHECK_THROWS(memory.restore(Memory::Snapshot()));
+}
 
 TEST_CASE("PerfMemory read request") {
     std::vector<uint8> data {'a', 'b', 'c', 'd'};
     PerfMemory memory(data, 2);
-    memory.send_read_request(1, 1);
-    auto r = memory.get_request_status();
+    auto id = memory.send_read_request(1, 1);
+    auto r = memory.get_request_status(id);
     CHECK(!r.is_ready);
 
     memory.clock();
-    r = memory.get_request_status();
+    r = memory.get_request_status(id);
     CHECK(!r.is_ready);
 
     memory.clock();
-    r = memory.get_request_status();
+    r = memory.get_request_status(id);
     CHECK(r.is_ready);
     CHECK(r.data == static_cast<uint32>('b'));
 }
@@ -29,30 +120,326 @@ TEST_CASE("PerfMemory read request") {
 TEST_CASE("PerfMemory write request") {
     std::vector<uint8> data {'a', 'b', 'c', 'd'};
     PerfMemory memory(data, 2);
-    memory.send_write_request(static_cast<uint32>('x'), 1, 1);
-    auto r = memory.get_request_status();
+    auto id = memory.send_write_request(static_cast<uint32>('x'), 1, 1);
+    auto r = memory.get_request_status(id);
     CHECK(!r.is_ready);
 
     memory.clock();
-    r = memory.get_request_status();
+    r = memory.get_request_status(id);
     CHECK(!r.is_ready);
 
     memory.clock();
-    r = memory.get_request_status();
+    r = memory.get_request_status(id);
     CHECK(r.is_ready);
 
     memory.clock();
-    memory.send_read_request(1, 1);
-    r = memory.get_request_status();
+    id = memory.send_read_request(1, 1);
+    r = memory.get_request_status(id);
 
     CHECK(!r.is_ready);
 
     memory.clock();
-    r = memory.get_request_status();
+    r = memory.get_request_status(id);
     CHECK(!r.is_ready);
 
     memory.clock();
-    r = memory.get_request_status();
+    r = memory.get_request_status(id);
     CHECK(r.is_ready);
     CHECK(r.data == static_cast<uint32>('x'));
 }
+
+TEST_CASE("PerfMemory pipelines requests") {
+    std::vector<uint8> data {'a', 'b', 'c', 'd'};
+    PerfMemory::Config config;
+    config.latency = 4;
+    config.read_queue_size = 2;
+    config.write_queue_size = 2;
+    config.max_outstanding = 3;
+    config.issue_width = 2;
+    PerfMemory memory(data, config);
+
+    auto write = memory.send_write_request(static_cast<uint32>('x'), 0, 1);
+    auto first = memory.send_read_request(0, 1);
+    auto second = memory.send_read_request(2, 2);
+    CHECK(!memory.can_accept(true));
+    CHECK(memory.can_accept(false));
+    CHECK_THROWS(memory.send_read_request(3, 1));
+
+    // both reads start at the first clock, write waits for free slot
+    memory.clock();
+    auto third = memory.send_read_request(3, 1);
+    for (int i = 0; i < 3; ++i) {
+        CHECK(!memory.get_request_status(first).is_ready);
+        memory.clock();
+    }
+    CHECK(memory.get_request_status(first).is_ready);
+    CHECK(memory.get_request_status(first).data == static_cast<uint32>('x'));
+    CHECK(memory.get_request_status(second).data == 0x6463);
+    CHECK(!memory.get_request_status(write).is_ready);
+
+    // third read was sent after write, but completes before it
+    memory.clock();
+    CHECK(memory.get_request_status(third).is_ready);
+    CHECK(!memory.get_request_status(write).is_ready);
+    for (int i = 0; i < 3; ++i)
+        memory.clock();
+    CHECK(memory.get_request_status(write).is_ready);
+    CHECK(!memory.get_request_status(third).is_ready);
+
+    const auto& stats = memory.get_stats();
+    CHECK(stats.reads == 3);
+    CHECK(stats.writes == 1);
+    CHECK(stats.bytes == 5);
+    CHECK(stats.cycles == 8);
+}
+
+TEST_CASE("PerfMemory bursts take cycle per beat") {
+    std::vector<uint8> data(64);
+    std::iota(data.begin(), data.end(), 0);
+    PerfMemory::Config config;
+    config.latency = 3;
+    config.bus_width = 4;
+    config.burst_length = 4;
+    config.beat_cycles = 2;
+    PerfMemory memory(data, config);
+    CHECK(memory.get_max_transfer() == 16);
+
+    auto cycles_to_complete = [&](PerfMemory::RequestId id) {
+        int cycles = 0;
+        do {
+            memory.clock();
+            ++cycles;
+        } while (!memory.get_request_status(id).is_ready);
+        return cycles;
+    };
+
+    // first beat costs latency, each next one beat_cycles
+    std::array<uint8, 16> line = {};
+    CHECK(cycles_to_complete(memory.send_read_request(line.data(), 16, 16)) == 3 + 3 * 2);
+    CHECK(line[0] == 16);
+    CHECK(line[15] == 31);
+    CHECK(cycles_to_complete(memory.send_read_request(line.data(), 0, 5)) == 3 + 1 * 2);
+    CHECK(cycles_to_complete(memory.send_read_request(8, 4)) == 3);
+
+    std::fill(line.begin(), line.end(), 0xff);
+    CHECK(cycles_to_complete(memory.send_write_request(line.data(), 32, 16)) == 3 + 3 * 2);
+    CHECK(memory.read(44, 4) == 0xffffffff);
+    CHECK_THROWS(memory.send_read_request(line.data(), 0, 17));
+    CHECK(memory.get_stats().beats == 4 + 2 + 1 + 4);
+
+    config.bus_width = 65;
+    CHECK_THROWS(PerfMemory(data, config));
+}
+
+TEST_CASE("DRAM row buffer timing") {
+    Dram::Config config;
+    config.banks = 2;
+    config.row_size = 1024;
+    config.tRCD = 5;
+    config.tCAS = 3;
+    config.tRP = 7;
+    config.tREFI = 100;
+    config.tRFC = 20;
+    Dram dram(config);
+
+    // rows alternate between banks
+    CHECK(dram.access(0x0000, 0) == 5 + 3);
+    CHECK(!dram.is_ready(0x0010, 4));
+    CHECK(dram.is_ready(0x0010, 5));
+    CHECK(dram.is_row_hit(0x0010));
+    CHECK(dram.access(0x0010, 5) == 3);
+    CHECK(dram.access(0x0400, 5) == 5 + 3);
+    CHECK(dram.access(0x0800, 10) == 7 + 5 + 3);
+    CHECK(dram.get_bank_stats(0).hits == 1);
+    CHECK(dram.get_bank_stats(0).misses == 1);
+    CHECK(dram.get_bank_stats(0).conflicts == 1);
+    CHECK(dram.get_bank_stats(1).misses == 1);
+
+    // refresh closes rows and blocks banks
+    dram.clock(100);
+    CHECK(!dram.is_row_hit(0x0800));
+    CHECK(!dram.is_ready(0x0400, 119));
+    CHECK(dram.is_ready(0x0400, 120));
+
+    config.open_page = false;
+    Dram closed(config);
+    CHECK(closed.access(0x0000, 0) == 5 + 3);
+    CHECK(!closed.is_row_hit(0x0000));
+    CHECK(closed.is_ready(0x0000, 12));
+    CHECK(closed.access(0x0000, 12) == 5 + 3);
+}
+
+TEST_CASE("DRAM preset reproduces fixed latency") {
+    PerfMemory::Config config;
+    config.latency = 5;
+    config.read_queue_size = 4;
+    config.write_queue_size = 2;
+    config.max_outstanding = 3;
+    PerfMemory fixed(std::vector<uint8>{}, config);
+    config.dram = Dram::fixed_latency(config.latency);
+    PerfMemory dram(std::vector<uint8>{}, config);
+
+    std::vector<PerfMemory::RequestId> ids;
+    uint32 random = 1;
+    for (int cycle = 0; cycle < 1000; ++cycle) {
+        random = random * 1664525u + 1013904223u;
+        bool is_read = (random >> 20) % 3 != 0;
+        Addr addr = (random >> 8) & 0xfffe;
+        if ((random >> 28) % 2 == 0 && fixed.can_accept(is_read)) {
+            CHECK(dram.can_accept(is_read));
+            auto id = is_read ? fixed.send_read_request(addr, 2) : fixed.send_write_request(random, addr, 2);
+            CHECK(id == (is_read ? dram.send_read_request(addr, 2) : dram.send_write_request(random, addr, 2)));
+            ids.push_back(id);
+        }
+        fixed.clock();
+        dram.clock();
+        for (auto id : ids)
+            CHECK(fixed.get_request_status(id).is_ready == dram.get_request_status(id).is_ready);
+    }
+    CHECK(fixed.get_stats().reads + fixed.get_stats().writes > 100);
+    CHECK(fixed.get_stats().reads == dram.get_stats().reads);
+}
+
+TEST_CASE("DRAM scheduler prefers row hits") {
+    PerfMemory::Config config;
+    config.read_queue_size = 4;
+    Dram::Config dram;
+    dram.banks = 1;
+    dram.tRCD = 5;
+    dram.tCAS = 3;
+    dram.tRP = 7;
+    dram.tREFI = 0;
+    config.dram = dram;
+    PerfMemory memory(std::vector<uint8>{}, config);
+
+    auto open = memory.send_read_request(0x0000, 2);
+    memory.clock();
+    auto conflict = memory.send_read_request(0x1000, 2);
+    auto hit = memory.send_read_request(0x0010, 2);
+
+    // hit goes after the first request, conflict waits for it
+    int cycles = 1;
+    for (; !memory.get_request_status(open).is_ready; ++cycles)
+        memory.clock();
+    CHECK(cycles == 8);
+    for (; !memory.get_request_status(hit).is_ready; ++cycles)
+        memory.clock();
+    CHECK(cycles == 11);
+    for (; !memory.get_request_status(conflict).is_ready; ++cycles)
+        memory.clock();
+    CHECK(cycles == 26);
+}
+
+TEST_CASE("Profiler buckets accesses by page and line") {
+    using Access = AccessProfiler::Access;
+    char name[] = "/tmp/profile-test-XXXXXX";
+    REQUIRE(mkdtemp(name) != nullptr);
+    const std::string prefix = std::string(name) + "/run";
+
+    AccessProfiler::Config config;
+    config.prefix = prefix;
+    config.bucket_length = 4;
+    config.line_size = 16;
+    {
+        AccessProfiler profiler(config);
+        for (Addr addr = 0x1000; addr < 0x1010; addr += 4) {
+            profiler.record(Access::FETCH, addr);
+            profiler.tick();
+        }
+        profiler.record(Access::LOAD, 0x2000);
+        profiler.record(Access::STORE, 0x2004);
+        profiler.record(Access::LOAD, 0x3010);
+        profiler.tick();
+        profiler.finish();
+
+        const auto& curve = profiler.get_working_set();
+        REQUIRE(curve.size() == 2);
+        CHECK(curve[0].pages == 1);
+        CHECK(curve[0].lines == 1);
+        CHECK(curve[1].pages == 2);
+        CHECK(curve[1].lines == 2);
+        CHECK(profiler.get_line_counters(0x1008) == AccessProfiler::Counters{ 0, 0, 4 });
+        CHECK(profiler.get_line_counters(0x200c) == AccessProfiler::Counters{ 1, 1, 0 });
+        CHECK(profiler.get_line_counters(0x4000) == AccessProfiler::Counters{ 0, 0, 0 });
+    }
+
+    auto read_file = [](const std::string& file_name) {
+        std::ifstream file(file_name);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    };
+    CHECK(read_file(prefix + ".heat.csv") == "bucket,page,loads,stores,fetches\n"
+                                             "0,4096,0,0,4\n"
+                                             "1,8192,1,1,0\n"
+                                             "1,12288,1,0,0\n");
+    CHECK(read_file(prefix + ".wss.csv") == "bucket,pages,lines\n0,1,1\n1,2,2\n");
+    CHECK(read_file(prefix + ".lines.csv") == "line,loads,stores,fetches\n"
+                                              "4096,0,0,4\n"
+                                              "8192,1,1,0\n"
+                                              "12304,1,0,0\n");
+    for (const char* suffix : { ".heat.csv", ".wss.csv", ".lines.csv" })
+        unlink((prefix + suffix).c_str());
+    rmdir(name);
+
+    config.line_size = 24;
+    CHECK_THROWS(AccessProfiler(config));
+}
+
+TEST_CASE("Reuse distance matches LRU stack") {
+    // small capacity renumbers access times many times
+    ReuseDistance reuse(16, 64);
+    std::vector<Addr> stack;  // most recently used line first
+    std::vector<uint64> expected(1);
+    uint64 cold_misses = 0;
+
+    uint32 random = 1;
+    for (int i = 0; i < 100000; ++i) {
+        random = random * 1664525u + 1013904223u;
+        // mostly short reuses over a few hot lines with rare far ones
+        Addr addr = ((random >> 28) < 12 ? (random >> 8) % 256 : (random >> 8) % 8192) * 4;
+        reuse.access(addr);
+
+        Addr line = addr / 16;
+        auto it = std::find(stack.begin(), stack.end(), line);
+        if (it == stack.end()) {
+            cold_misses++;
+        }
+        else {
+            Size distance = it - stack.begin();
+            if (distance >= expected.size())
+                expected.resize(distance + 1);
+            expected[distance]++;
+            stack.erase(it);
+        }
+        stack.insert(stack.begin(), line);
+    }
+
+    CHECK(reuse.get_accesses() == 100000);
+    CHECK(reuse.get_cold_misses() == cold_misses);
+    CHECK(reuse.get_histogram() == expected);
+    CHECK(reuse.get_hit_rate(0) == 0);
+    CHECK(reuse.get_hit_rate(stack.size()) == static_cast<double>(100000 - cold_misses) / 100000);
+}
+
+TEST_CASE("Memory TLB fast path") {
+    FuncMemory memory(std::vector<uint8>{});
+
+    // read miss maps untouched page to zeros, write must replace it
+    CHECK(memory.read<4>(0x2000) == 0);
+    CHECK(memory.read<4>(0x2000) == 0);
+    memory.write<4>(0x11223344, 0x2000);
+    CHECK(memory.read<4>(0x2000) == 0x11223344);
+    CHECK(memory.read<2>(0x2002) == 0x1122);
+    CHECK(memory.read<1>(0x2001) == 0x33);
+
+    // misaligned and page crossing accesses take slow path
+    memory.write<4>(0xaabbccdd, 0x2ffe);
+    CHECK(memory.read<4>(0x2ffe) == 0xaabbccdd);
+    CHECK(memory.read<2>(0x3000) == 0xaabb);
+
+    // pages sharing TLB entry
+    const Addr alias = 0x2000 + (Memory::TLB_SIZE << Memory::PAGE_BITS);
+    memory.write<4>(0x55, alias);
+    CHECK(memory.read<4>(alias) == 0x55);
+    CHECK(memory.read<4>(0x2000) == 0x11223344);
+    CHECK(memory.read(alias, 4) == 0x55);
+}
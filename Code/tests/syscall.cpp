@@ -0,0 +1,95 @@
+#include <cstdlib>
+#include <fstream>
+#include <unistd.h>
+
+#include "infra/test/catch.hpp"
+#include "funcsim/funcsim.hpp"
+#include "perfsim/perfsim.hpp"
+
+// inputs/syscalls prints greeting, writes it to output.txt in sandbox,
+// reads the file back into heap and exits with number of bytes read
+static const uint64 SYSCALLS_INSTRUCTIONS = 47;
+static const int32 SYSCALLS_EXIT_CODE = 14;
+
+// runs test body in temporary directory used as sandbox
+class TemporaryDirectory {
+private:
+    std::string previous;
+    std::string path;
+public:
+    TemporaryDirectory() {
+        char cwd[4096];
+        REQUIRE(getcwd(cwd, sizeof(cwd)) != nullptr);
+        previous = cwd;
+        char name[] = "/tmp/syscall-test-XXXXXX";
+        REQUIRE(mkdtemp(name) != nullptr);
+        path = name;
+        REQUIRE(chdir(path.c_str()) == 0);
+    }
+    ~TemporaryDirectory() {
+        unlink((path + "/output.txt").c_str());
+        chdir(previous.c_str());
+        rmdir(path.c_str());
+    }
+    std::string binary(const std::string& name) const { return previous + "/" + name; }
+};
+
+static std::string read_file(const std::string& name) {
+    std::ifstream file(name);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+TEST_CASE("Functional simulator runs until guest exits") {
+    for (auto engine : { FuncSim::Engine::STEP, FuncSim::Engine::THREADED, FuncSim::Engine::JIT }) {
+        TemporaryDirectory directory;
+        FuncSim simulator(directory.binary("inputs/syscalls"));
+        simulator.set_engine(engine);
+        simulator.run_until_exit();
+
+        CHECK(simulator.has_exited());
+        CHECK(simulator.get_exit_code() == SYSCALLS_EXIT_CODE);
+        CHECK(simulator.get_executed() == SYSCALLS_INSTRUCTIONS);
+        CHECK(read_file("output.txt") == "Hello, world!\n");
+    }
+}
+
+TEST_CASE("Functional simulator stops at exit within budget") {
+    TemporaryDirectory directory;
+    FuncSim simulator(directory.binary("inputs/syscalls"));
+    simulator.run(1000);
+    CHECK(simulator.has_exited());
+    CHECK(simulator.get_executed() == SYSCALLS_INSTRUCTIONS);
+}
+
+TEST_CASE("Performance simulator runs until guest exits") {
+    TemporaryDirectory directory;
+    PerfSim simulator(directory.binary("inputs/syscalls"));
+    simulator.run_until_exit();
+
+    CHECK(simulator.has_exited());
+    CHECK(simulator.get_exit_code() == SYSCALLS_EXIT_CODE);
+    CHECK(simulator.get_ops() == SYSCALLS_INSTRUCTIONS);
+    CHECK(read_file("output.txt") == "Hello, world!\n");
+}
+
+// inputs/arithm runs into a word which is not an instruction
+static const uint64 ARITHM_INSTRUCTIONS = 29;
+static const int32 FAULT_EXIT_CODE = 128 + 4;
+
+TEST_CASE("Undecodable instruction stops guest") {
+    for (auto engine : { FuncSim::Engine::STEP, FuncSim::Engine::THREADED, FuncSim::Engine::JIT }) {
+        FuncSim simulator("inputs/arithm");
+        simulator.set_engine(engine);
+        simulator.run_until_exit();
+
+        CHECK(simulator.has_exited());
+        CHECK(simulator.get_exit_code() == FAULT_EXIT_CODE);
+        CHECK(simulator.get_executed() == ARITHM_INSTRUCTIONS);
+    }
+
+    PerfSim simulator("inputs/arithm");
+    simulator.run_until_exit();
+    CHECK(simulator.has_exited());
+    CHECK(simulator.get_exit_code() == FAULT_EXIT_CODE);
+    CHECK(simulator.get_ops() == ARITHM_INSTRUCTIONS);
+}
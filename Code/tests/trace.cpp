@@ -0,0 +1,40 @@
+#include <sstream>
+
+#include "infra/test/catch.hpp"
+#include "infra/trace/trace.hpp"
+
+using trace::Component;
+using trace::Level;
+
+TEST_CASE("Trace levels") {
+    trace::configure("perfsim,cache=2");
+    CHECK(trace::is_enabled(Component::PERFSIM, Level::BASIC));
+    CHECK(!trace::is_enabled(Component::PERFSIM, Level::DETAILED));
+    CHECK(trace::is_enabled(Component::CACHE, Level::DETAILED));
+    CHECK(!trace::is_enabled(Component::FUNCSIM, Level::BASIC));
+
+    trace::configure("all=1,rf=0");
+    CHECK(trace::is_enabled(Component::FUNCSIM, Level::BASIC));
+    CHECK(!trace::is_enabled(Component::RF, Level::BASIC));
+
+    CHECK_THROWS_AS(trace::configure("pipeline"), std::invalid_argument);
+    CHECK_THROWS_AS(trace::configure("cache=3"), std::invalid_argument);
+    trace::configure("");
+}
+
+#ifndef NDEBUG
+TEST_CASE("Trace is buffered") {
+    std::ostringstream output;
+    std::streambuf* buffer = std::cout.rdbuf(output.rdbuf());
+
+    trace::configure("cache");
+    TRACE(CACHE, BASIC, "hit " << 42 << '\n');
+    TRACE(FUNCSIM, BASIC, "skipped\n");
+    CHECK(output.str().empty());
+    trace::flush();
+    CHECK(output.str() == "hit 42\n");
+    trace::configure("");
+
+    std::cout.rdbuf(buffer);
+}
+#endif